@@ -22,48 +22,131 @@
 #include <stdexcept>
 #include <string>
 #include <map>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <memory>
 #include <sstream>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
 #include "TAGMcommunicator.h"
 
-std::map<std::string, int> TAGMcommunicator::fServer_sockfd;
+struct TAGMcommunicator::pending_request {
+   // a request sent to a server that has not been answered yet
+   std::string request;        // as sent, without its tag
+   TAGMcommunicator *board;    // board that made an async request, or 0
+   response_handler done;      // called with the response, or with an error
+   int sockfd;                 // connection it was sent over
+   bool repeatable;            // only reads back, safe to send twice
+   bool resent;                // sent again over a new connection already
+};
 
-TAGMcommunicator *TAGMcommunicator::fSelected;
+struct TAGMcommunicator::server_connection {
+   // connection to one server, shared by all boards on it, with a
+   // thread that reads the responses and hands each one to the
+   // request it answers, as identified by its tag
+   std::string server;
+   int sockfd;                 // -1 while not connected
+   unsigned long next_tag;
+   std::map<unsigned long, pending_request*> pending;  // by tag
+   std::mutex mutex;           // protects all of the above
+   std::recursive_mutex callback;  // held while responses are handed over
+};
+
+std::map<std::string, TAGMcommunicator::server_connection*> TAGMcommunicator::fServers;
+std::mutex TAGMcommunicator::fServer_lock;
+
+static bool repeatable_request(const std::string &req)
+{
+   // Only requests that read something back can safely be sent again
+   // when it is not known whether the server got them the first time.
+
+   std::size_t start = 0;
+   if (req.size() > 0 && req[0] == '@')
+      start = req.find(' ') + 1;
+   if (start == 0)
+      return false;
+   return (req.compare(start, 4, "get_") == 0 ||
+           req.compare(start, 5, "probe") == 0);
+}
+
+static bool peer_closed(int sockfd)
+{
+   // true if the server has closed this connection, which
+   // is only looked at while no responses are expected on it
+
+   struct pollfd pfd;
+   pfd.fd = sockfd;
+   pfd.events = POLLIN | POLLRDHUP;
+   pfd.revents = 0;
+   if (poll(&pfd, 1, 0) <= 0)
+      return false;
+   if (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))
+      return true;
+   char byte;
+   return (recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0);
+}
 
 TAGMcommunicator::TAGMcommunicator(unsigned char geoaddr, std::string server)
 {
-   if (fServer_sockfd.find(server) == fServer_sockfd.end())
-      open_client_connection(server);
-   fServer = server;
+   fGeoaddr = geoaddr;
+   fVoltages_latched = false;
+   fStatus_latched = false;
    char hexb[5];
    sprintf(hexb, "0x%2.2x", geoaddr);
    fBoard = hexb;
-   select();
+   attach(server);
 }
 
 TAGMcommunicator::TAGMcommunicator(unsigned char MACaddr[6], std::string server)
 {
-   if (fServer_sockfd.find(server) == fServer_sockfd.end())
-      open_client_connection(server);
-   fServer = server;
+   fGeoaddr = 0;
+   fVoltages_latched = false;
+   fStatus_latched = false;
    char hexb[20];
    sprintf(hexb, "%2.2x.%2.2x.%2.2x.%2.2x.%2.2x.%2.2x", 
                  MACaddr[0], MACaddr[1], MACaddr[2], 
                  MACaddr[3], MACaddr[4], MACaddr[5]);
    fBoard = hexb;
-   select();
+   attach(server);
 }
 
-void TAGMcommunicator::open_client_connection(std::string server)
+void TAGMcommunicator::attach(std::string server)
+{
+   // Check that the server can reach the board, connecting to it if
+   // this is the first board on it, and learn the geoaddr of the board
+   // if it was given by MAC address.
+
+   fServer = server;
+   fBoardPrefix = "@" + fBoard;
+   std::string netdev = get_netdev(server);
+   if (netdev.size() > 0)
+      fBoardPrefix += "::" + netdev;
+   fBoardPrefix += " ";
+   std::string resp(request_response("get_Geoaddr"));
+   if (resp.find("error") != resp.npos) {
+      char errmesg[1000];
+      snprintf(errmesg, 999, "TAGMcommunicator attach - %s", resp.c_str());
+      throw std::runtime_error(errmesg);
+   }
+   unsigned char geoaddr;
+   if (fGeoaddr == 0 && sscanf(resp.c_str(), "%hhx", &geoaddr) == 1)
+      fGeoaddr = geoaddr;
+}
+
+int TAGMcommunicator::open_client_connection(std::string server)
 {
    std::string sport("");
    std::string shost(server);
@@ -129,15 +212,23 @@ void TAGMcommunicator::open_client_connection(std::string server)
       snprintf(errmesg, 999, "Connection failed to server %s", server.c_str());
       throw std::runtime_error(errmesg);
    }
-   fServer_sockfd[server] = sockfd;
+
+   // requests go out as soon as they are written, even while
+   // others are still waiting for their responses
+   int nodelay = 1;
+   setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+   return sockfd;
 }
 
-TAGMcommunicator::~TAGMcommunicator() { }
+TAGMcommunicator::~TAGMcommunicator()
+{
+   // no async requests may reach the server after this point
+   cancel_async();
+   cancel_requests();
+}
 
 std::map<unsigned char, std::string> TAGMcommunicator::probe(std::string server)
 {
-   if (fServer_sockfd.find(server) == fServer_sockfd.end())
-      open_client_connection(server);
    std::string req("probe");
    std::string netdev = get_netdev(server);
    if (netdev.size() > 0)
@@ -160,8 +251,6 @@ std::map<unsigned char, std::string> TAGMcommunicator::probe(std::string server)
 
 const std::string TAGMcommunicator::get_hostMACaddr(std::string server)
 {
-   if (fServer_sockfd.find(server) == fServer_sockfd.end())
-      open_client_connection(server);
    std::string req("get_hostMACaddr");
    std::string netdev = get_netdev(server);
    if (netdev.size() > 0)
@@ -177,7 +266,6 @@ const std::string TAGMcommunicator::get_hostMACaddr(std::string server)
 
 bool TAGMcommunicator::ramp()
 {
-   select();
    std::string resp(request_response(std::string("ramp")));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -189,7 +277,6 @@ bool TAGMcommunicator::ramp()
 
 bool TAGMcommunicator::reset()
 {
-   select();
    std::string resp(request_response("reset"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -201,20 +288,25 @@ bool TAGMcommunicator::reset()
 
 const unsigned char TAGMcommunicator::get_Geoaddr()
 {
-   select();
+   // the geoaddr of a board does not change, so it is
+   // only asked for if it was not known from the start
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fGeoaddr != 0)
+         return fGeoaddr;
+   }
    std::string resp(request_response("get_Geoaddr"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
    unsigned char geoaddr;
+   std::lock_guard<std::mutex> lock(fLatch_lock);
    if (sscanf(resp.c_str(), "%hhx", &geoaddr) == 1)
-      return geoaddr;
-   else
-      return 0;
+      fGeoaddr = geoaddr;
+   return fGeoaddr;
 }
 
 const unsigned char *TAGMcommunicator::get_MACaddr()
 {
-   select();
    std::string resp(request_response("get_MACaddr"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -224,10 +316,45 @@ const unsigned char *TAGMcommunicator::get_MACaddr()
    return fMACaddr;
 }
 
+TAGMcontroller::StatusSnapshot TAGMcommunicator::get_status()
+{
+   // all status readings of the board, decoded from one S-packet
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus;
+   }
+   std::string resp(request_response("get_status"));
+   if (resp.find("error") != resp.npos)
+      throw std::runtime_error(resp.c_str());
+   unsigned char packet[64];
+   memset(packet, 0, sizeof(packet));
+   packet[15] = 'S';
+   std::stringstream sresp(resp);
+   unsigned int geoaddr;
+   std::string macaddr;
+   sresp >> std::hex >> geoaddr >> macaddr;
+   packet[14] = geoaddr;
+   sscanf(macaddr.c_str(), "%2hhx.%2hhx.%2hhx.%2hhx.%2hhx.%2hhx",
+                           &packet[6], &packet[7], &packet[8],
+                           &packet[9], &packet[10], &packet[11]);
+   for (int i=0; i < 17; ++i) {
+      unsigned int word = 0;
+      sresp >> word;
+      packet[2*i+16] = (word >> 8) & 0xff;
+      packet[2*i+17] = word & 0xff;
+   }
+   return StatusSnapshot(packet);
+}
+
 double TAGMcommunicator::get_Tchip()
 {
    // board temperature from T sensor chip (C)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_Tchip();
+   }
    std::string resp(request_response("get_Tchip"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -240,7 +367,11 @@ double TAGMcommunicator::get_Tchip()
 double TAGMcommunicator::get_pos5Vpower()
 {
    // +5V power level (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_pos5Vpower();
+   }
    std::string resp(request_response("get_pos5Vpower"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -253,7 +384,11 @@ double TAGMcommunicator::get_pos5Vpower()
 double TAGMcommunicator::get_neg5Vpower()
 {
    // -5V power level (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_neg5Vpower();
+   }
    std::string resp(request_response("get_neg5Vpower"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -266,7 +401,11 @@ double TAGMcommunicator::get_neg5Vpower()
 double TAGMcommunicator::get_pos3_3Vpower()
 {
    // +3.3V power level (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_pos3_3Vpower();
+   }
    std::string resp(request_response("get_pos3_3Vpower"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -279,7 +418,11 @@ double TAGMcommunicator::get_pos3_3Vpower()
 double TAGMcommunicator::get_pos1_2Vpower()
 {
    // +1.2V power level (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_pos1_2Vpower();
+   }
    std::string resp(request_response("get_pos1_2Vpower"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -292,7 +435,11 @@ double TAGMcommunicator::get_pos1_2Vpower()
 double TAGMcommunicator::get_Vsumref_1()
 {
    // SUMREF from preamp 1 (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_Vsumref_1();
+   }
    std::string resp(request_response("get_Vsumref_1"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -305,7 +452,11 @@ double TAGMcommunicator::get_Vsumref_1()
 double TAGMcommunicator::get_Vsumref_2()
 {
    // SUMREF from preamp 2 (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_Vsumref_2();
+   }
    std::string resp(request_response("get_Vsumref_2"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -318,7 +469,11 @@ double TAGMcommunicator::get_Vsumref_2()
 double TAGMcommunicator::get_Vgainmode()
 {
    // GAINMODE shared by both preamps (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_Vgainmode();
+   }
    std::string resp(request_response("get_Vgainmode"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -331,7 +486,11 @@ double TAGMcommunicator::get_Vgainmode()
 int TAGMcommunicator::get_gainmode()
 {
    // =0 (low) or =1 (high) or -1 (undefined)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_gainmode();
+   }
    std::string resp(request_response("get_gainmode"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -344,7 +503,11 @@ int TAGMcommunicator::get_gainmode()
 double TAGMcommunicator::get_Vtherm_1()
 {
    // thermister voltage on preamp 1 (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_Vtherm_1();
+   }
    std::string resp(request_response("get_Vtherm_1"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -357,7 +520,11 @@ double TAGMcommunicator::get_Vtherm_1()
 double TAGMcommunicator::get_Vtherm_2()
 {
    // thermister voltage on preamp 2 (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_Vtherm_2();
+   }
    std::string resp(request_response("get_Vtherm_2"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -370,7 +537,11 @@ double TAGMcommunicator::get_Vtherm_2()
 double TAGMcommunicator::get_Tpreamp_1()
 {
    // thermister temperature on preamp 1 (C)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_Tpreamp_1();
+   }
    std::string resp(request_response("get_Tpreamp_1"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -383,7 +554,11 @@ double TAGMcommunicator::get_Tpreamp_1()
 double TAGMcommunicator::get_Tpreamp_2()
 {
    // thermister temperature on preamp 2 (C)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_Tpreamp_2();
+   }
    std::string resp(request_response("get_Tpreamp_2"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -396,7 +571,11 @@ double TAGMcommunicator::get_Tpreamp_2()
 double TAGMcommunicator::get_VDAChealth()
 {
    // DAC channel 31 read-back level (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_VDAChealth();
+   }
    std::string resp(request_response("get_VDAChealth"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -409,7 +588,11 @@ double TAGMcommunicator::get_VDAChealth()
 double TAGMcommunicator::get_VDACdiode()
 {
    // DAC thermal diode voltage (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_VDACdiode();
+   }
    std::string resp(request_response("get_VDACdiode"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -422,7 +605,11 @@ double TAGMcommunicator::get_VDACdiode()
 double TAGMcommunicator::get_TDAC()
 {
    // DAC internal temperature reading (C)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fStatus_latched)
+         return fLastStatus.get_TDAC();
+   }
    std::string resp(request_response("get_TDAC"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -434,36 +621,186 @@ double TAGMcommunicator::get_TDAC()
 
 void TAGMcommunicator::latch_status()
 {
-   // capture board status in state variables
-   select();
-   request_response("latch_status");
+   // capture board status in local state variables
+   fetch_readings();
+   std::lock_guard<std::mutex> lock(fLatch_lock);
+   fStatus_latched = true;
 }
 
 void TAGMcommunicator::passthru_status()
 {
    // reset saved state from last latch_levels()
-   select();
-   request_response("passthru_status");
+   std::lock_guard<std::mutex> lock(fLatch_lock);
+   fStatus_latched = false;
 }
 
 void TAGMcommunicator::latch_voltages()
 {
-   // capture board's demand voltages in state variables
-   select();
-   request_response("latch_voltages");
+   // capture board's demand voltages in local state variables
+   fetch_readings();
+   std::lock_guard<std::mutex> lock(fLatch_lock);
+   fVoltages_latched = true;
 }
 
 void TAGMcommunicator::passthru_voltages()
 {
    // reset saved voltages from last latch_voltages()
-   select();
-   request_response("passthru_voltages");
+   std::lock_guard<std::mutex> lock(fLatch_lock);
+   fVoltages_latched = false;
+}
+
+bool TAGMcommunicator::is_status_latched()
+{
+   std::lock_guard<std::mutex> lock(fLatch_lock);
+   return fStatus_latched;
+}
+
+bool TAGMcommunicator::is_voltages_latched()
+{
+   std::lock_guard<std::mutex> lock(fLatch_lock);
+   return fVoltages_latched;
+}
+
+void TAGMcommunicator::latch_readings()
+{
+   // capture board status and demand voltages in local state
+   // variables, both from a single round trip to the server
+   fetch_readings();
+   std::lock_guard<std::mutex> lock(fLatch_lock);
+   fStatus_latched = true;
+   fVoltages_latched = true;
+}
+
+bool TAGMcommunicator::latch_readings_all(std::map<unsigned char,
+                                                   TAGMcontroller*> &boards,
+                                          unsigned char *failed_geoaddr,
+                                          std::string *errmsg)
+{
+   // Latch the status and demand voltages of all boards in the list,
+   // with a single get_readings_all round trip to each server for all
+   // of its boards. Boards that are not remote are latched directly.
+   // On failure, returns false with the geoaddr of the first board that
+   // failed in *failed_geoaddr and its error message in *errmsg.
+
+   std::map<std::string, std::vector<TAGMcommunicator*> > servers;
+   std::map<TAGMcommunicator*, unsigned char> geoaddrs;
+   std::string error;
+   unsigned char failed = 0;
+   std::map<unsigned char, TAGMcontroller*>::iterator iter;
+   for (iter = boards.begin(); iter != boards.end(); ++iter) {
+      TAGMcommunicator *remote = dynamic_cast<TAGMcommunicator*>(iter->second);
+      if (remote) {
+         servers[remote->fServer].push_back(remote);
+         geoaddrs[remote] = iter->first;
+         continue;
+      }
+      try {
+         iter->second->latch_readings();
+      }
+      catch (const std::runtime_error &err) {
+         if (error.size() == 0) {
+            error = err.what();
+            failed = iter->first;
+         }
+      }
+   }
+   std::map<std::string, std::vector<TAGMcommunicator*> >::iterator siter;
+   for (siter = servers.begin(); siter != servers.end(); ++siter) {
+      std::vector<TAGMcommunicator*> &remotes = siter->second;
+      std::string req("get_readings_all ");
+      for (unsigned int b=0; b < remotes.size(); ++b)
+         req += ((b > 0)? "," : "") + remotes[b]->fBoard;
+      std::string netdev = get_netdev(siter->first);
+      if (netdev.size() > 0)
+         req += " " + netdev;
+      std::stringstream sresp(request_response(req, siter->first));
+      for (unsigned int b=0; b < remotes.size(); ++b) {
+         std::string line;
+         getline(sresp, line);
+         try {
+            if (line.find("error") != line.npos || line.size() == 0)
+               throw std::runtime_error(line.c_str());
+            std::lock_guard<std::mutex> lock(remotes[b]->fLatch_lock);
+            remotes[b]->accept_readings(line);
+            remotes[b]->fStatus_latched = true;
+            remotes[b]->fVoltages_latched = true;
+         }
+         catch (const std::runtime_error &err) {
+            if (error.size() == 0) {
+               error = err.what();
+               failed = geoaddrs[remotes[b]];
+            }
+         }
+      }
+   }
+   if (error.size() > 0) {
+      if (failed_geoaddr)
+         *failed_geoaddr = failed;
+      if (errmsg)
+         *errmsg = error;
+      return false;
+   }
+   return true;
+}
+
+void TAGMcommunicator::fetch_readings()
+{
+   // bring over the status and voltages of the board in one response
+
+   std::string resp(request_response("get_readings"));
+   if (resp.find("error") != resp.npos)
+      throw std::runtime_error(resp.c_str());
+   std::lock_guard<std::mutex> lock(fLatch_lock);
+   accept_readings(resp);
+}
+
+void TAGMcommunicator::accept_readings(const std::string &line)
+{
+   // Take the status and voltages out of one line of a get_readings
+   // response: the fields of get_status followed by the 32 voltages.
+   // The caller holds fLatch_lock.
+
+   unsigned char packet[64];
+   memset(packet, 0, sizeof(packet));
+   packet[15] = 'S';
+   std::stringstream sresp(line);
+   unsigned int geoaddr;
+   std::string macaddr;
+   sresp >> std::hex >> geoaddr >> macaddr;
+   packet[14] = geoaddr;
+   sscanf(macaddr.c_str(), "%2hhx.%2hhx.%2hhx.%2hhx.%2hhx.%2hhx",
+                           &packet[6], &packet[7], &packet[8],
+                           &packet[9], &packet[10], &packet[11]);
+   for (int i=0; i < 17; ++i) {
+      unsigned int word = 0;
+      sresp >> word;
+      packet[2*i+16] = (word >> 8) & 0xff;
+      packet[2*i+17] = word & 0xff;
+   }
+   sresp >> std::dec;
+   double V[32];
+   for (int chan=0; chan < 32; ++chan)
+      sresp >> V[chan];
+   if (sresp.fail()) {
+      char errmesg[1000];
+      snprintf(errmesg, 999, "TAGMcommunicator accept_readings - "
+                             "bad response from server: %.900s", line.c_str());
+      throw std::runtime_error(errmesg);
+   }
+   fLastStatus = StatusSnapshot(packet);
+   fGeoaddr = geoaddr;
+   for (int chan=0; chan < 32; ++chan)
+      fLatchedV[chan] = V[chan];
 }
 
 double TAGMcommunicator::getV(unsigned int chan)
 {
    // voltage of channel reported by board (V)
-   select();
+   {
+      std::lock_guard<std::mutex> lock(fLatch_lock);
+      if (fVoltages_latched)
+         return (chan < 32)? fLatchedV[chan] : 0;
+   }
    std::stringstream sreq;
    sreq << "getV " << chan;
    std::string resp(request_response(sreq.str()));
@@ -478,7 +815,6 @@ double TAGMcommunicator::getV(unsigned int chan)
 double TAGMcommunicator::getVnew(unsigned int chan)
 { 
    // voltage of channel to be set in next ramp (V)
-   select();
    std::stringstream sreq;
    sreq << "getVnew " << chan;
    std::string resp(request_response(sreq.str()));
@@ -493,17 +829,120 @@ double TAGMcommunicator::getVnew(unsigned int chan)
 void TAGMcommunicator::setV(unsigned int chan, double V)
 {
    // assign voltage of channel to be set in next ramp (V)
-   select();
    std::stringstream sreq;
    sreq << "setV " << chan << " " << V;
    request_response(sreq.str());
 }
 
+void TAGMcommunicator::setV_many(unsigned int mask, const double V[32])
+{
+   // assign voltages of all channels in mask to be set in next ramp (V)
+   if (mask == 0)
+      return;
+   setpoints levels;
+   levels.mask = mask;
+   for (int chan=0; chan < 32; ++chan)
+      levels.V[chan] = V[chan];
+   std::string resp(request_response("setV_many " + format_setpoints(levels)));
+   if (resp.find("error") != resp.npos)
+      throw std::runtime_error(resp.c_str());
+}
+
+bool TAGMcommunicator::setV_many_all(std::map<unsigned char,
+                                              TAGMcontroller*> &boards,
+                                     std::map<unsigned char, setpoints> &levels,
+                                     unsigned char *failed_geoaddr,
+                                     std::string *errmsg)
+{
+   // Stage the levels of every board listed in levels for the next ramp,
+   // with a single setV_many_all message to each server carrying the
+   // levels of all of its boards. Boards that are not remote are staged
+   // directly. On failure, returns false with the geoaddr of the first
+   // board that failed in *failed_geoaddr and its error message in *errmsg.
+
+   std::map<std::string, std::vector<unsigned char> > servers;
+   std::string error;
+   unsigned char failed = 0;
+   std::map<unsigned char, setpoints>::iterator iter;
+   for (iter = levels.begin(); iter != levels.end(); ++iter) {
+      try {
+         if (boards.find(iter->first) == boards.end()) {
+            char errmesg[1000];
+            snprintf(errmesg, 999, "TAGMcommunicator setV_many_all - "
+                                   "no board at geoaddr 0x%2.2x",
+                     iter->first);
+            throw std::runtime_error(errmesg);
+         }
+         TAGMcontroller *board = boards[iter->first];
+         TAGMcommunicator *remote = dynamic_cast<TAGMcommunicator*>(board);
+         if (remote)
+            servers[remote->fServer].push_back(iter->first);
+         else
+            board->setV_many(iter->second.mask, iter->second.V);
+      }
+      catch (const std::runtime_error &err) {
+         if (error.size() == 0) {
+            error = err.what();
+            failed = iter->first;
+         }
+      }
+   }
+   std::map<std::string, std::vector<unsigned char> >::iterator siter;
+   for (siter = servers.begin(); siter != servers.end(); ++siter) {
+      std::vector<unsigned char> &geoaddrs = siter->second;
+      std::string req("setV_many_all");
+      for (unsigned int b=0; b < geoaddrs.size(); ++b) {
+         TAGMcommunicator *remote = (TAGMcommunicator*)boards[geoaddrs[b]];
+         req += " " + remote->fBoard + ":" +
+                format_setpoints(levels[geoaddrs[b]]);
+      }
+      std::string netdev = get_netdev(siter->first);
+      if (netdev.size() > 0)
+         req += " " + netdev;
+      std::stringstream sresp(request_response(req, siter->first));
+      for (unsigned int b=0; b < geoaddrs.size(); ++b) {
+         std::string line;
+         getline(sresp, line);
+         if (line.find("ok") != 0 && error.size() == 0) {
+            error = (line.size() > 0)? line : "TAGMcommunicator "
+                    "setV_many_all - no response for board";
+            failed = geoaddrs[b];
+         }
+      }
+   }
+   if (error.size() > 0) {
+      if (failed_geoaddr)
+         *failed_geoaddr = failed;
+      if (errmsg)
+         *errmsg = error;
+      return false;
+   }
+   return true;
+}
+
+std::string TAGMcommunicator::format_setpoints(const setpoints &levels)
+{
+   // levels as they go over the wire, <mask>:<V>[,<V>...] with one
+   // value for every channel in the mask in increasing channel order
+
+   char buf[20];
+   snprintf(buf, sizeof(buf), "%x:", levels.mask);
+   std::string spec(buf);
+   int count = 0;
+   for (int chan=0; chan < 32; ++chan) {
+      if (levels.mask & (1 << chan)) {
+         snprintf(buf, sizeof(buf), "%s%.6g", (count++ > 0)? "," : "",
+                  levels.V[chan]);
+         spec += buf;
+      }
+   }
+   return spec;
+}
+
 const unsigned char *TAGMcommunicator::get_last_packet()
 {
    // return a pointer to a read-only buffer containing
    // the last packet received from the board
-   select();
    std::string resp(request_response("get_last_packet"));
    if (resp.find("error") != resp.npos)
       throw std::runtime_error(resp.c_str());
@@ -527,61 +966,428 @@ std::string TAGMcommunicator::get_netdev(std::string server)
       return std::string("");
 }
 
-void TAGMcommunicator::select()
+std::string TAGMcommunicator::request_response(std::string req, 
+                                               std::string server)
 {
-   if (fSelected == this)
-      return;
-   std::string req("select");
-   req += " " + fBoard;
-   std::string netdev = get_netdev(fServer);
-   if (netdev.size() > 0)
-      req += " " + netdev;
-   std::string resp(request_response(req));
-   if (resp.find("ok") != 0) {
+   // Send req to the server and wait for its response. Other threads
+   // can have their own requests in flight over the same connection
+   // at the same time.
+
+   std::shared_ptr<std::promise<std::string> > result(new std::promise<std::string>);
+   std::future<std::string> response = result->get_future();
+   send_request(req, server, 0,
+                [result](const std::string *resp, const char *error) {
+                   if (resp)
+                      result->set_value(*resp);
+                   else
+                      result->set_exception(std::make_exception_ptr(
+                                            std::runtime_error(error)));
+                });
+   return response.get();
+}
+
+TAGMcommunicator::server_connection *TAGMcommunicator::get_connection(std::string server)
+{
+   // the connection to server, which is only opened
+   // once there is a request to send over it
+
+   std::lock_guard<std::mutex> lock(fServer_lock);
+   server_connection *&conn = fServers[server];
+   if (conn == 0) {
+      conn = new server_connection;
+      conn->server = server;
+      conn->sockfd = -1;
+      conn->next_tag = 0;
+   }
+   return conn;
+}
+
+void TAGMcommunicator::send_request(std::string req, std::string server,
+                                    TAGMcommunicator *board,
+                                    response_handler done)
+{
+   // Send req to the server with a new tag, connecting first if need be,
+   // and leave done to be called with the response by the reader thread.
+   // If the request was made for board, it is dropped along with it.
+   // A connection the server closed while it sat idle is replaced before
+   // anything is sent over it. Connecting is done without the lock, so
+   // that the responses to other requests keep coming in meanwhile.
+
+   server_connection *conn = get_connection(server);
+   std::unique_lock<std::mutex> lock(conn->mutex);
+   if (conn->sockfd >= 0 && conn->pending.size() == 0 &&
+       peer_closed(conn->sockfd))
+   {
+      // the reader thread closes it once it sees the end
+      conn->sockfd = -1;
+   }
+   while (conn->sockfd < 0) {
+      lock.unlock();
+      int sockfd = open_client_connection(server);
+      lock.lock();
+      if (conn->sockfd < 0) {
+         conn->sockfd = sockfd;
+         std::thread(read_responses, conn, sockfd).detach();
+      }
+      else {
+         close(sockfd);
+      }
+   }
+   pending_request *pending = new pending_request;
+   pending->request = req;
+   pending->board = board;
+   pending->done = done;
+   pending->sockfd = conn->sockfd;
+   pending->repeatable = repeatable_request(req);
+   pending->resent = false;
+   unsigned long tag = ++conn->next_tag;
+   conn->pending[tag] = pending;
+   if (! send_tagged(conn, tag, pending)) {
+      conn->pending.erase(tag);
+      delete pending;
       char errmesg[1000];
-      snprintf(errmesg, 999, "TAGMcommunicator select - %s", resp.c_str());
+      snprintf(errmesg, 999, "TAGMcommunicator request_response - "
+                             "Error writing to network socket.");
       throw std::runtime_error(errmesg);
    }
-   fSelected = this;
 }
 
-std::string TAGMcommunicator::request_response(std::string req, 
-                                               std::string server)
+bool TAGMcommunicator::send_tagged(server_connection *conn, unsigned long tag,
+                                   pending_request *pending)
 {
-   int fd = fServer_sockfd[server];
+   // Write one tagged request to the server over pending->sockfd, with
+   // conn->mutex held. A connection closed by the server is not an error
+   // here, since the reader thread sees it too and deals with the request.
+   // Returns false if it could not be written for any other reason.
 
 //#define VERBOSE 1
 #if VERBOSE
-   std::cout << "writing message \"" << req << "\""
-             << " to output fd=" << fd << std::endl;
+   std::cout << "writing message \"#" << tag << " " << pending->request << "\""
+             << " to output fd=" << conn->sockfd << std::endl;
 #endif
 
-   req += "\n";
-   if (write(fd, req.c_str(), req.size()) != req.size()) {
-      char errmesg[1000];
-      snprintf(errmesg, 999, "TAGMcommunicator request_response - "
-                             "Error writing to network socket.");
-      throw std::runtime_error(errmesg);
+   char hdr[30];
+   snprintf(hdr, sizeof(hdr), "#%lu ", tag);
+   std::string req = hdr + pending->request + "\n";
+   std::size_t nsent = 0;
+   while (nsent < req.size()) {
+      int nb = send(pending->sockfd, req.c_str() + nsent, req.size() - nsent,
+                    MSG_NOSIGNAL);
+      if (nb > 0)
+         nsent += nb;
+      else if (nb < 0 && errno == EINTR)
+         continue;
+      else if (nb < 0 && (errno == EPIPE || errno == ECONNRESET))
+         return true;
+      else
+         return false;
    }
+   return true;
+}
+
+void TAGMcommunicator::read_responses(server_connection *conn, int fd)
+{
+   // Reader thread: hand each response coming back from the server over
+   // connection fd to the request with the same tag, until the server
+   // closes it. Completion callbacks run under conn->callback, so that a
+   // board being deleted can wait for one running on its behalf to finish.
+
    std::string response;
-   while (1) {
-      int bufsize = 999;
-      char buf[bufsize];
-      int nb = read(fd, buf, bufsize);
-      for (int i=0; i < nb; ++i)
-         response += buf[i];
-      if (buf[nb - 1] == 0)
-         break;
-   }
+   char buf[4096];
+   for (;;) {
+      int nb = read(fd, buf, sizeof(buf));
+      if (nb < 0 && errno == EINTR)
+         continue;
+      for (int i=0; i < nb; ++i) {
+         if (buf[i] != 0) {
+            response += buf[i];
+            continue;
+         }
 
 #if VERBOSE
-   std::cout << "got back response: " << response;
+         std::cout << "got back response: " << response;
 #endif
 
-   return response;
+         std::size_t space = response.find(' ');
+         unsigned long tag = 0;
+         if (response.size() > 0 && response[0] == '#')
+            tag = strtoul(response.c_str() + 1, 0, 10);
+         std::string text((space == response.npos)? "" :
+                          response.substr(space + 1));
+         response.clear();
+         std::lock_guard<std::recursive_mutex> callback(conn->callback);
+         pending_request *pending = 0;
+         {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            std::map<unsigned long, pending_request*>::iterator iter;
+            iter = conn->pending.find(tag);
+            if (iter != conn->pending.end()) {
+               pending = iter->second;
+               conn->pending.erase(iter);
+            }
+         }
+         if (pending == 0) {
+            std::cerr << "TAGMcommunicator error - response from server "
+                      << conn->server << " with unknown tag: "
+                      << text << std::endl;
+            continue;
+         }
+         if (pending->done)
+            pending->done(&text, 0);
+         delete pending;
+      }
+      if (nb > 0)
+         continue;
+
+      // The server closed the connection, maybe because it was restarted
+      // or gave up on this client, so the requests still waiting may or
+      // may not have been served. Only those that just read something
+      // back are sent again over a new connection, and only once; the
+      // rest fail, since doing them twice could ramp or reset a board
+      // a second time. Nothing is locked while connecting. The fd is only
+      // closed once nothing refers to it any more, so that no request is
+      // sent over it, or over another socket that reuses its number.
+      response.clear();
+      std::vector<pending_request*> failed;
+      std::vector<unsigned long> resend;
+      std::string errmesg("TAGMcommunicator request_response - "
+                          "connection to server " + conn->server + " lost.");
+      {
+         std::lock_guard<std::recursive_mutex> callback(conn->callback);
+         {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            if (conn->sockfd == fd)
+               conn->sockfd = -1;
+            std::map<unsigned long, pending_request*>::iterator iter;
+            for (iter = conn->pending.begin(); iter != conn->pending.end();) {
+               pending_request *pending = iter->second;
+               if (pending->sockfd != fd) {
+                  ++iter;
+               }
+               else if (pending->repeatable && ! pending->resent) {
+                  pending->sockfd = -1;
+                  resend.push_back(iter->first);
+                  ++iter;
+               }
+               else {
+                  failed.push_back(pending);
+                  conn->pending.erase(iter++);
+               }
+            }
+            close(fd);
+         }
+         for (unsigned int i=0; i < failed.size(); ++i) {
+            if (failed[i]->done)
+               failed[i]->done(0, errmesg.c_str());
+            delete failed[i];
+         }
+      }
+      if (resend.size() == 0)
+         return;
+
+      fd = -1;
+      try {
+         fd = open_client_connection(conn->server);
+      }
+      catch (const std::runtime_error &) {
+         // the requests to resend fail below
+      }
+      failed.clear();
+      std::lock_guard<std::recursive_mutex> callback(conn->callback);
+      {
+         std::lock_guard<std::mutex> lock(conn->mutex);
+         if (conn->sockfd < 0) {
+            conn->sockfd = fd;
+         }
+         else if (fd >= 0) {
+            // someone else connected meanwhile, and reads the responses
+            close(fd);
+            fd = -1;
+         }
+         for (unsigned int i=0; i < resend.size(); ++i) {
+            std::map<unsigned long, pending_request*>::iterator iter;
+            iter = conn->pending.find(resend[i]);
+            if (iter == conn->pending.end())
+               continue;
+            pending_request *pending = iter->second;
+            pending->sockfd = conn->sockfd;
+            pending->resent = true;
+            if (conn->sockfd < 0 || ! send_tagged(conn, iter->first, pending)) {
+               failed.push_back(pending);
+               conn->pending.erase(iter);
+            }
+         }
+      }
+      for (unsigned int i=0; i < failed.size(); ++i) {
+         if (failed[i]->done)
+            failed[i]->done(0, errmesg.c_str());
+         delete failed[i];
+      }
+      if (fd < 0)
+         return;
+   }
 }
 
 std::string TAGMcommunicator::request_response(std::string req)
 {
-   return request_response(req, fServer);
+   // Send a request for this board to the server, addressed to the
+   // board so that it does not depend on anything sent before it,
+   // and wait for the response.
+
+   // the round trip to the server stands in for
+   // the board exchange time reported by get_last_rtt()
+   struct timespec t0, t1;
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   std::string resp(request_response(fBoardPrefix + req, fServer));
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   fLastRTT = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+   return resp;
+}
+
+std::future<int> TAGMcommunicator::request_async(std::string req,
+                                                 std::function<int(const std::string&)> accept,
+                                                 async_callback done)
+{
+   // Send a request for this board to the server without waiting for
+   // the response, which is taken in by accept() on the reader thread
+   // to give the result. An error response sets the result to -1, and
+   // the future throws it.
+
+   std::shared_ptr<std::promise<int> > result(new std::promise<int>);
+   std::future<int> future = result->get_future();
+   send_request(fBoardPrefix + req, fServer, this,
+                [accept, done, result](const std::string *resp,
+                                       const char *error)
+   {
+      int value = -1;
+      std::exception_ptr failure;
+      if (resp == 0) {
+         failure = std::make_exception_ptr(std::runtime_error(error));
+      }
+      else if (resp->find("error") != resp->npos) {
+         failure = std::make_exception_ptr(std::runtime_error(resp->c_str()));
+      }
+      else {
+         try {
+            value = accept(*resp);
+         }
+         catch (...) {
+            failure = std::current_exception();
+         }
+      }
+      if (done) {
+         try {
+            done(value);
+         }
+         catch (...) {
+            std::cerr << "TAGMcommunicator error - "
+                      << "exception thrown by completion callback"
+                      << std::endl;
+         }
+      }
+      if (failure)
+         result->set_exception(failure);
+      else
+         result->set_value(value);
+   });
+   return future;
+}
+
+void TAGMcommunicator::cancel_requests()
+{
+   // Withdraw the async requests of this board that are still waiting
+   // for their responses, which are dropped when they come back. A
+   // completion callback already running for the board is allowed to
+   // finish first.
+
+   server_connection *conn = get_connection(fServer);
+   std::lock_guard<std::recursive_mutex> callback(conn->callback);
+   std::vector<response_handler> cancelled;
+   {
+      std::lock_guard<std::mutex> lock(conn->mutex);
+      std::map<unsigned long, pending_request*>::iterator iter;
+      for (iter = conn->pending.begin(); iter != conn->pending.end(); ++iter) {
+         if (iter->second->board == this) {
+            cancelled.push_back(iter->second->done);
+            iter->second->done = 0;
+            iter->second->board = 0;
+         }
+      }
+   }
+   for (unsigned int i=0; i < cancelled.size(); ++i) {
+      if (cancelled[i])
+         cancelled[i](0, "TAGMcommunicator error - "
+                         "board deleted with async requests pending");
+   }
+}
+
+std::future<int> TAGMcommunicator::fetch_status_async(async_callback done)
+{
+   // start latching the status of the board, result 0 or -1
+   return request_async("get_readings",
+                        [this](const std::string &resp) {
+                           std::lock_guard<std::mutex> lock(fLatch_lock);
+                           accept_readings(resp);
+                           fStatus_latched = true;
+                           return 0;
+                        }, done);
+}
+
+std::future<int> TAGMcommunicator::fetch_voltages_async(async_callback done)
+{
+   // start latching the demand voltages of the board, result 0 or -1
+   return request_async("get_readings",
+                        [this](const std::string &resp) {
+                           std::lock_guard<std::mutex> lock(fLatch_lock);
+                           accept_readings(resp);
+                           fVoltages_latched = true;
+                           return 0;
+                        }, done);
+}
+
+std::future<int> TAGMcommunicator::set_voltages_async(unsigned int mask,
+                                                      const unsigned int values[32],
+                                                      async_callback done)
+{
+   // Start staging the DAC values of the channels in mask and ramping
+   // to them, result 0 or -1. Both requests go out at once, and the
+   // server serves them in order since they are for the same board.
+
+   setpoints levels;
+   levels.mask = mask;
+   for (int chan=0; chan < 32; ++chan)
+      levels.V[chan] = values[chan] * (50*fDAC_Vref/(1 << 14));
+   std::shared_ptr<std::string> staging_error(new std::string);
+   send_request(fBoardPrefix + "setV_many " + format_setpoints(levels),
+                fServer, this,
+                [staging_error](const std::string *resp, const char *error) {
+                   if (resp == 0)
+                      *staging_error = error;
+                   else if (resp->find("error") != resp->npos)
+                      *staging_error = *resp;
+                });
+   return request_async("ramp",
+                        [staging_error](const std::string &resp) {
+                           if (staging_error->size() > 0)
+                              throw std::runtime_error(staging_error->c_str());
+                           return (resp.find("ok") == 0)? 0 : -1;
+                        }, done);
+}
+
+std::future<int> TAGMcommunicator::ramp_async(async_callback done)
+{
+   // start ramp(), result 0 on success or -1
+   return request_async("ramp",
+                        [](const std::string &resp) {
+                           return (resp.find("ok") == 0)? 0 : -1;
+                        }, done);
+}
+
+std::future<int> TAGMcommunicator::reset_async(async_callback done)
+{
+   // start reset(), result 0 on success or -1
+   return request_async("reset",
+                        [](const std::string &resp) {
+                           return (resp.find("ok") == 0)? 0 : -1;
+                        }, done);
 }
@@ -31,6 +31,38 @@
 //     string to a std::string object. USER BEWARE! If you think that
 //     automatic conversion from a string literal to a std::string
 //     argument will work with these static methods, it won't.
+// (4) Boards on the same server share one connection. Every request
+//     names its board as "@<address>[::<netdev>] <request>", so there
+//     is no board selection on the server to keep track of and no select
+//     round trip when a program goes back and forth between boards.
+//     Requests made from different threads take turns on the connection,
+//     each one doing its request/response exchange without a break.
+// (5) The status and voltages of a board are latched on the client, all
+//     of them from a single get_readings round trip, after which the
+//     get_XXX() and getV() methods read the local copy without going to
+//     the server until passthru_status() or passthru_voltages() is called.
+//     latch_readings_all() latches a whole set of boards at once, with
+//     one get_readings_all round trip to each server.
+// (6) setV_many() stages all of its channels in one setV_many request,
+//     and setV_many_all() the levels of a whole set of boards with one
+//     setV_many_all message to each server, instead of one setV round
+//     trip per channel.
+// (7) The server disconnects clients that sit idle for too long. The
+//     next request then finds the connection closed, and goes out over
+//     a new one. If the connection is lost with requests in flight, only
+//     the get_XXX and probe requests are sent again; the others fail,
+//     since the server may already have carried them out.
+// (8) Every request goes out with a tag, and a reader thread for each
+//     server connection hands each response to the request it answers,
+//     whatever order they come back in. The blocking methods send one
+//     request and wait for its response, but the XXX_async() methods
+//     return at once with a std::future, so that a program can have
+//     requests to all of its boards in flight over one connection while
+//     the server works on them in parallel. The completion callbacks are
+//     invoked on the reader thread, so they may start more async requests
+//     but must not wait on a blocking method of a board on the same
+//     server. Requests to the same board are served in the order they
+//     were made.
 
 #ifndef TAGMCOMMUNICATOR_H
 #define TAGMCOMMUNICATOR_H
@@ -48,6 +80,7 @@ class TAGMcommunicator: public TAGMcontroller {
    const unsigned char get_Geoaddr();   // get the backplane slot address of this board
    const unsigned char *get_MACaddr();  // get the ethernet MAC address of this board
 
+   StatusSnapshot get_status();  // all status readings of the board, decoded from one S-packet
    double get_Tchip();         // board temperature from T sensor chip (C)
    double get_pos5Vpower();    // +5V power level (V)
    double get_neg5Vpower();    // -5V power level (V)
@@ -73,30 +106,76 @@ class TAGMcommunicator: public TAGMcontroller {
                                // and return captured data in response to getV()
    void passthru_voltages();   // reset saved voltages from last latch_voltages()
                                // and have each getV() request fresh data from board
+   void latch_readings();      // latch_status() and latch_voltages() together,
+                               // in a single round trip to the server
+   bool is_status_latched();   // true if a status reading is latched
+   bool is_voltages_latched(); // true if a reading of the demand voltages is latched
+   static bool latch_readings_all(std::map<unsigned char, TAGMcontroller*> &boards,
+                                  unsigned char *failed_geoaddr=0,
+                                  std::string *errmsg=0);  // latch_readings() of all boards, one round trip per server
 
    double getV(unsigned int chan);          // voltage of channel reported by board (V)
    double getVnew(unsigned int chan);       // voltage of channel to be set in next ramp (V)
    void setV(unsigned int chan, double V);  // assign voltage of channel to be set in next ramp (V)
+   void setV_many(unsigned int mask, const double V[32]);  // assign voltages of all channels in mask to be set in next ramp (V)
+
+   struct setpoints {
+    // levels to be staged on one board, for the channels in mask
+      unsigned int mask;
+      double V[32];
+   };
+   static bool setV_many_all(std::map<unsigned char, TAGMcontroller*> &boards,
+                             std::map<unsigned char, setpoints> &levels,
+                             unsigned char *failed_geoaddr=0,
+                             std::string *errmsg=0);  // setV_many() of all boards in levels, one message per server
    const unsigned char *get_last_packet();  // return a pointer to a read-only buffer containing the last packet received from the board
 
    bool ramp();                // push the new voltages to the board, if any
    bool reset();               // send a hard reset to the board
 
+   std::future<int> fetch_status_async(async_callback done=0);    // start latch_status(), result 0 or -1
+   std::future<int> fetch_voltages_async(async_callback done=0);  // start latch_voltages(), result 0 or -1
+   std::future<int> set_voltages_async(unsigned int mask,
+                                       const unsigned int values[32],
+                                       async_callback done=0);    // start setting DAC values in mask and ramping to them, result 0 or -1
+   std::future<int> ramp_async(async_callback done=0);    // start ramp(), result 0 on success or -1
+   std::future<int> reset_async(async_callback done=0);   // start reset(), result 0 on success or -1
+
  protected:
    std::string fBoard;
+   std::string fBoardPrefix;   // "@<address>[::<netdev>] " that starts each request
    std::string fServer;
    unsigned char fMACaddr[6];
    unsigned char fPacket[270];
+   double fLatchedV[32];       // voltages from the last get_readings response (V)
+   std::mutex fLatch_lock;     // protects the latched readings
 
-   static std::map<std::string, int> fServer_sockfd;
-   static TAGMcommunicator *fSelected;
+   typedef std::function<void(const std::string *resp,
+                              const char *error)> response_handler;
+   struct pending_request;     // request waiting for its response, see TAGMcommunicator.cc
+   struct server_connection;   // connection to a server, see TAGMcommunicator.cc
+   static std::map<std::string, server_connection*> fServers;
+   static std::mutex fServer_lock;  // protects fServers
 
-   static void open_client_connection(std::string server);
+   static int open_client_connection(std::string server);
    static std::string request_response(std::string req, std::string server);
    static std::string get_netdev(std::string server);
+   static server_connection *get_connection(std::string server);
+   static void send_request(std::string req, std::string server,
+                            TAGMcommunicator *board, response_handler done);
+   static bool send_tagged(server_connection *conn, unsigned long tag,
+                           pending_request *pending);
+   static void read_responses(server_connection *conn, int fd);
 
    std::string request_response(std::string req);
-   void select();
+   std::future<int> request_async(std::string req,
+                                  std::function<int(const std::string&)> accept,
+                                  async_callback done);
+   void cancel_requests();
+   void attach(std::string server);
+   void fetch_readings();
+   void accept_readings(const std::string &line);
+   static std::string format_setpoints(const setpoints &levels);
 };
 
 #endif
@@ -8,36 +8,48 @@
 // raw ethernet packets over the specified interface. The boards
 // are identified by either their geographical address set by
 // jumpers on the readout backplane, or else by the MAC address
-// of the board itself.
+// of the board itself. The MAC address found at each geoaddr is
+// remembered between runs in a discovery cache under /run.
 //
-// Requires the PCAP library for access to the ethernet
+// The packets are sent and received through a TAGMtransport, which
+// by default uses the PCAP library for access to the ethernet
 // network transport layer.
 //
 
 #include "TAGMcontroller.h"
+#include "TAGMtransport.h"
+#include "TAGMpacketlog.h"
 #include <iostream>
 #include <stdexcept>
 #include <sstream>
 #include <fstream>
-#include <ctime>
+#include <set>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #define RETRY_COUNT 3
+#define MISMATCH_RETRY_COUNT 10
 #define PROBE_TIMEOUT_MS 2000
 #define RESET_TIMEOUT_MS 2000
 #define STATUS_TIMEOUT_MS 1000
 #define READ_TIMEOUT_MS 1000
-#define RAMP_DELAY_US 1000
 #define PRESEND_DELAY_US 1000
+#define DEFAULT_RAMP_SLEW 50.0
+#define DEFAULT_RAMP_MAX_STEP 0.1
+#define ASYNC_POLL_MS 1
+#define RECEIVE_SLICE_MS 1
+#define CENSUS_GRACE_MS 10
+#define DISCOVERY_CACHE_PREFIX "/run/TAGMcontroller-"
+#define THERM_TABLE_SIZE 4096
 
-// The following are needed by get_hostMACaddr()
-#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
-#include <net/if.h>
-#include <net/if_arp.h>
-#include <sys/select.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 double TAGMcontroller::fADC_Vref = 2.5;
 double TAGMcontroller::fDAC_Vref = 3.3;
@@ -49,49 +61,407 @@ double TAGMcontroller::fTcoef_therm[5] = {142.973,
                                             2.62172,
                                            -0.167948,
                                             0.00531447};
+TAGMcontroller::RampProfile TAGMcontroller::fRampProfile =
+   {DEFAULT_RAMP_SLEW, DEFAULT_RAMP_MAX_STEP, 0};
+TAGMcontroller::RampProfile TAGMcontroller::fRampdownProfile =
+   {DEFAULT_RAMP_SLEW, DEFAULT_RAMP_MAX_STEP, 0};
 
-long int TAGMcontroller::max_logfile_size = 100000000;
-std::ofstream TAGMcontroller::logfile;
+// The discovery cache remembers the MAC address of the board found at
+// each geoaddr on a given network device, one "<geoaddr> <MAC>" pair
+// per line, so that constructors can skip the broadcast discovery.
+// It is filled by probe() and kept up to date by the constructors.
+// Threads of one process share the scratch file, hence the lock.
+// The utilities run setuid root, so the cache lives in a directory
+// that only root can write, is never opened through a symlink, and
+// is only believed if it belongs to root (or to the caller itself).
+static std::recursive_mutex discovery_cache_lock;
+
+static std::string discovery_cache_path(const std::string &netdev)
+{
+   if (netdev.size() == 0 || netdev.find('/') != netdev.npos)
+      return "";
+   return DISCOVERY_CACHE_PREFIX + netdev + ".macs";
+}
+
+static std::map<unsigned char, std::string>
+read_discovery_cache(const std::string &netdev)
+{
+   std::map<unsigned char, std::string> catalog;
+   std::string cachefile(discovery_cache_path(netdev));
+   if (cachefile.size() == 0)
+      return catalog;
+   int fd = open(cachefile.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+   if (fd < 0)
+      return catalog;
+   struct stat info;
+   if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+       (info.st_uid != 0 && info.st_uid != geteuid()) ||
+       (info.st_mode & (S_IWGRP | S_IWOTH)))
+   {
+      close(fd);
+      return catalog;
+   }
+   FILE *cache = fdopen(fd, "r");
+   if (cache == 0) {
+      close(fd);
+      return catalog;
+   }
+   char line[80];
+   while (fgets(line, sizeof(line), cache)) {
+      unsigned int geoaddr;
+      char MACaddr[25];
+      if (sscanf(line, "%x %24s", &geoaddr, MACaddr) == 2)
+         catalog[geoaddr] = MACaddr;
+   }
+   fclose(cache);
+   return catalog;
+}
+
+static void write_discovery_cache(const std::string &netdev,
+                                  const std::map<unsigned char,
+                                                 std::string> &catalog)
+{
+   // write to a scratch file and rename it into place, so that
+   // other processes never read back a partially written cache;
+   // mkstemp creates the scratch file exclusively, never through
+   // a link that someone else planted under the same name
+
+   std::lock_guard<std::recursive_mutex> lock(discovery_cache_lock);
+   std::string cachefile(discovery_cache_path(netdev));
+   if (cachefile.size() == 0)
+      return;
+   std::string tmpfile(cachefile + ".XXXXXX");
+   int fd = mkstemp(&tmpfile[0]);
+   if (fd < 0)
+      return;
+   FILE *cache = fdopen(fd, "w");
+   if (cache == 0) {
+      close(fd);
+      unlink(tmpfile.c_str());
+      return;
+   }
+   bool good = (fchmod(fd, 0644) == 0);
+   std::map<unsigned char, std::string>::const_iterator iter;
+   for (iter = catalog.begin(); iter != catalog.end(); ++iter) {
+      if (fprintf(cache, "%2.2x %s\n", (unsigned int)iter->first,
+                  iter->second.c_str()) < 0)
+         good = false;
+   }
+   if (fclose(cache) != 0)
+      good = false;
+   if (!good || rename(tmpfile.c_str(), cachefile.c_str()) != 0)
+      unlink(tmpfile.c_str());
+}
+
+static void update_discovery_cache(const std::string &netdev,
+                                   unsigned char geoaddr,
+                                   const std::string &MACaddr)
+{
+   // enter the MAC address of the board at geoaddr in the cache,
+   // or drop the entry for geoaddr if MACaddr is empty
+
+   std::lock_guard<std::recursive_mutex> lock(discovery_cache_lock);
+   std::map<unsigned char, std::string> catalog;
+   catalog = read_discovery_cache(netdev);
+   if (MACaddr.size() > 0)
+      catalog[geoaddr] = MACaddr;
+   else
+      catalog.erase(geoaddr);
+   write_discovery_cache(netdev, catalog);
+}
+
+// Warn on stderr that who saw pcnt packets it did not ask for, followed
+// by the header bytes of the last one if header is given (not null).
+// The message is put together on the stack and written out in one go,
+// so that the receive loops do not allocate or interleave with other
+// threads.
+static void warn_unexpected(const char *who, int pcnt,
+                            const unsigned char *header=0)
+{
+   static const char hexdigits[] = "0123456789abcdef";
+   char line[160];
+   int len = snprintf(line, 100, (header)?
+                      "%.20s saw %d unexpected response packets,"
+                      " header bytes follow:\n" :
+                      "%.20s saw %d unrequested packets\n", who, pcnt);
+   for (int n=0; header && n < 16; ++n) {
+      line[len++] = hexdigits[header[n] >> 4];
+      line[len++] = hexdigits[header[n] & 0xf];
+      line[len++] = ' ';
+   }
+   if (header)
+      line[len++] = '\n';
+   fwrite(line, 1, len, stderr);
+}
+
+// Context passed to packet_reader() when flushing
+// stale packets from the shared capture handle.
+struct reader_context {
+   void *session;
+   TAGMcontroller *receiver;
+   char reqtype;
+   int count;
+};
+
+// A ramp is paced by the time that has actually passed between steps,
+// which includes the round trip to the boards: each step may move a
+// channel by as many DAC codes as the slew rate of its profile allows
+// in the time since the last step, up to max_step, with any fraction
+// of a code carried over to the next step. Steps are sent no faster
+// than it takes the quickest profile still in use to build up a full
+// max_step, so when the round trip is short the ramp waits between
+// steps, and when it is long the steps grow to keep up the slew rate,
+// until they reach max_step. Profile 0 is the ramp profile, and
+// profile 1 the rampdown profile for channels on their way to 0V.
+struct TAGMcontroller::ramp_pacer {
+   double slew[2];       // DAC codes per second
+   int max_codes[2];     // largest step in DAC codes
+   int max_moving[2];    // most channels of a board moving at once, 0 for no limit
+   double carry[2];      // fraction of a code left over from the last step
+   int budget[2];        // DAC codes a channel may move in the present step
+   double last_step;     // monotonic time of the last step, 0 before the first (s)
+   unsigned int pending; // bit per profile with channels not yet at target
+
+   void init();
+   double next_step(double earliest);
+   void take_step(double t);
+   unsigned int step(const unsigned int levels[32],
+                     const unsigned int targets[32], unsigned int mask,
+                     unsigned int next_values[32]);
+};
+
+// An async request works through one or more request/response exchanges
+// with its board in the I/O thread, one exchange in flight at a time.
+struct TAGMcontroller::async_job {
+   enum {kFetchStatus, kFetchVoltages, kSetVoltages, kRamp, kReset} kind;
+   TAGMcontroller *board;
+   unsigned int mask;          // channels to set, or to ramp
+   unsigned int values[32];    // DAC values to set, or ramp targets
+   unsigned int levels[32];    // DAC values the ramp has reached
+   unsigned int step_mask;     // channels of the present ramp step, as first sent
+   unsigned int step_values[32]; // DAC values of the present ramp step
+   ramp_pacer pacer;           // pacing of the ramp steps
+   int stage;                  // exchanges completed so far, -1 before start
+   int retries;                // retries of the present exchange
+   int mismatches;             // resends of the present step after a read-back mismatch
+   unsigned char request[84];  // request packet of the present exchange
+   double timeout;             // response timeout of present exchange (s)
+   double ready;               // monotonic time the request may go out (s)
+   double sent;                // monotonic time the request went out, or 0 (s)
+   bool finished;
+   int result;
+   std::exception_ptr error;   // thrown from the future instead of result
+   std::promise<int> promise;
+   async_callback done;
+};
+
+// Requests are handed over to the I/O thread through the submitted
+// queue, and then kept in a queue per board until they finish. Jobs
+// that finished are reported once the mutex has been released.
+struct TAGMcontroller::async_engine {
+   std::mutex mutex;
+   std::condition_variable wakeup;
+   std::deque<async_job*> submitted;
+   std::map<TAGMcontroller*, std::deque<async_job*> > boards;
+   std::vector<async_job*> finished;
+   std::thread thread;
+   bool stopping;
+
+   async_engine() : stopping(false) {}
+   ~async_engine() {
+      std::unique_lock<std::mutex> lock(mutex);
+      stopping = true;
+      wakeup.notify_one();
+      lock.unlock();
+      if (thread.joinable())
+         thread.join();
+   }
+};
+
+std::map<std::string, TAGMcontroller::ethernet_session*>
+   TAGMcontroller::fEthernet_sessions;
+std::mutex TAGMcontroller::fEthernet_sessions_lock;
+std::string TAGMcontroller::fTransport(getenv("TAGM_TRANSPORT")?
+                                       getenv("TAGM_TRANSPORT") : "pcap");
+TAGMcontroller::async_engine TAGMcontroller::fAsync;
+
+TAGMcontroller::StatusSnapshot::StatusSnapshot()
+ : fGeoaddr(0xff)
+{
+   for (int i=0; i < 6; ++i)
+      fMACaddr[i] = 0;
+   for (int i=0; i < 17; ++i)
+      fStatus[i] = 0;
+   decode();
+}
+
+TAGMcontroller::StatusSnapshot::StatusSnapshot(const unsigned int status[17])
+ : fGeoaddr(0xff)
+{
+   for (int i=0; i < 6; ++i)
+      fMACaddr[i] = 0;
+   for (int i=0; i < 17; ++i)
+      fStatus[i] = status[i];
+   decode();
+}
+
+TAGMcontroller::StatusSnapshot::StatusSnapshot(const unsigned char *packet)
+ : fGeoaddr(packet[14])
+{
+   // decode the status words from an S-packet
+   for (int i=0; i < 6; ++i)
+      fMACaddr[i] = packet[i+6];
+   for (int i=0; i < 17; ++i) {
+      unsigned int byte1 = (unsigned int)packet[2*i+16];
+      unsigned int byte2 = (unsigned int)packet[2*i+17];
+      fStatus[i] = (byte1 << 8) + byte2;
+   }
+   decode();
+}
+
+void TAGMcontroller::StatusSnapshot::decode()
+{
+   // convert the raw status words to physical units, once for all
+
+   double Vscale = 2*fADC_Vref/(1 << 12);
+   fTchip = fStatus[0]*0.25;
+   fPos5Vpower = fStatus[3]*1.005 * Vscale;
+   double R1 = 100e3;
+   double R2 = 33.2e3;
+   double Vlevel = fStatus[1]*1.001 * Vscale;
+   fNeg5Vpower = Vlevel*(R1+R2)/R2 - fPos5Vpower*R1/R2;
+   fPos3_3Vpower = fStatus[2]*1.005 * Vscale;
+   fPos1_2Vpower = fStatus[4]*1.005 * Vscale;
+   fVsumref_1 = fStatus[13]*1.005 * Vscale;
+   fVsumref_2 = fStatus[10]*1.005 * Vscale;
+   fVgainmode = fStatus[11]*2.018 * Vscale;
+   fGainmode = (fVgainmode > 4.9 && fVgainmode < 5.1)? 0 :
+               (fVgainmode > 9.9 && fVgainmode < 10.1)? 1 : -1;
+   fVtherm_1 = fStatus[16]*1.005 * Vscale;
+   fVtherm_2 = fStatus[12]*1.005 * Vscale;
+   fTpreamp_1 = thermister_temperature(fVtherm_1, fPos5Vpower);
+   fTpreamp_2 = thermister_temperature(fVtherm_2, fPos5Vpower);
+   fVDAChealth = fStatus[15]*40.5 * Vscale;
+   fVDACdiode = fStatus[14]*1.005 * Vscale;
+   fTDAC = fDACdiode_Tref + (fPos5Vpower - fVDACdiode - fDACdiode_Vf)
+                            / fDACdiode_Tcoef;
+}
+
+double TAGMcontroller::StatusSnapshot::thermister_temperature(double Vtherm,
+                                                              double pos5V)
+{
+   // The thermister temperature depends only on the fraction x of the
+   // +5V supply that is seen across the thermister. The polynomial in
+   // log(R) is tabulated once against x at THERM_TABLE_SIZE intervals
+   // over 1/64 < x < 63/64, which covers -40 C to +127 C, and linear
+   // interpolation in the table agrees with the polynomial to better
+   // than 0.001 C. Readings outside that range, which only come from
+   // a missing or shorted thermister, use the polynomial directly.
+
+   struct table {
+      double x0;
+      double dx;
+      double T[THERM_TABLE_SIZE + 1];
+      static double polynomial(double x) {
+         double logR = log(100*(1-x)/x);
+         return  ((((fTcoef_therm[4])*logR +
+                     fTcoef_therm[3])*logR +
+                     fTcoef_therm[2])*logR +
+                     fTcoef_therm[1])*logR +
+                     fTcoef_therm[0];
+      }
+      table() : x0(1./64), dx((62./64) / THERM_TABLE_SIZE) {
+         for (int i=0; i <= THERM_TABLE_SIZE; ++i)
+            T[i] = polynomial(x0 + i*dx);
+      }
+   };
+   static const table therm;
+
+   double x = Vtherm / pos5V;
+   double index = (x - therm.x0) / therm.dx;
+   if (index >= 0 && index < THERM_TABLE_SIZE) {
+      int i = (int)index;
+      double frac = index - i;
+      return therm.T[i] + frac * (therm.T[i+1] - therm.T[i]);
+   }
+   return table::polynomial(x);
+}
 
 TAGMcontroller::TAGMcontroller()
- : fEthernet_fp(0),
-   fEthernet_timeout(0)
+ : fLastRTT(0),
+   fLastRxTime(0),
+   fNextMask(0),
+   fSession(0),
+   fMailFirst(0),
+   fMailCount(0),
+   fPacketRxTime(0),
+   fResetting(false)
 {
+   clear_channel_retries();
 }
 
 TAGMcontroller::TAGMcontroller(unsigned char geoaddr, const char *netdev)
- : fEthernet_fp(0),
-   fEthernet_timeout(0)
+ : fLastRTT(0),
+   fLastRxTime(0),
+   fSession(0),
+   fMailFirst(0),
+   fMailCount(0),
+   fPacketRxTime(0),
+   fResetting(false)
 {
    fEthernet_device = (netdev)? netdev : DEFAULT_NETWORK_DEVICE;
-   open_network_device(PROBE_TIMEOUT_MS / 100);
+   open_network_device();
 
    for (int i=0; i < 32; ++i) {
       fLastVoltages[i] = 0;
+      fNextVoltages[i] = 0;
    }
+   fNextMask = 0;
    fVoltages_latched = false;
    fStatus_latched = false;
+   clear_channel_retries();
 
    // format a broadcast packet to get the board at this
    // geoaddr to respond, so we can find its MAC address
    fGeoaddr = geoaddr;
-   std::string hostMAC(get_hostMACaddr(fEthernet_device.c_str()));
-   unsigned int mac[6];
-   if (sscanf(hostMAC.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x",
-              &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
-   {
-      char errmsg[99];
-      sprintf(errmsg, "TAGMcontroller::TAGMcontroller error: "
-                      "unable to get the MAC address of host "
-                      "ethernet adapter %s.",
-              fEthernet_device.c_str());
-      throw std::runtime_error(errmsg);
-   }
    for (int i = 0; i < 6; ++i) {
       fDestMACaddr[i] = 0xff;
-      fSrcMACaddr[i] = (unsigned char)mac[i];
+      fSrcMACaddr[i] = fSession->hostMACaddr[i];
+   }
+   build_templates();
+
+   // if the discovery cache knows the MAC address of this board,
+   // go straight to unicast; the reply validates the cache entry
+   std::map<unsigned char, std::string> cache;
+   if (fGeoaddr != 0xff)
+      cache = read_discovery_cache(fEthernet_device);
+   if (cache.find(fGeoaddr) != cache.end()) {
+      unsigned int bmac[6];
+      if (sscanf(cache[fGeoaddr].c_str(), "%2x:%2x:%2x:%2x:%2x:%2x",
+                 &bmac[0], &bmac[1], &bmac[2],
+                 &bmac[3], &bmac[4], &bmac[5]) == 6)
+      {
+         for (int i = 0; i < 6; ++i)
+            fDestMACaddr[i] = (unsigned char)bmac[i];
+         build_templates();
+         if (fetch_status() == 0) {
+            register_board();
+            return;
+         }
+         log_packet("TAGMcontroller::TAGMcontroller - no response from "
+                    "the MAC address in the discovery cache for geoaddr " +
+                    cache[fGeoaddr] + ", falling back on broadcast.");
+      }
+      for (int i = 0; i < 6; ++i)
+         fDestMACaddr[i] = 0xff;
+      build_templates();
    }
+
+   // boards missing from the cache are found by broadcast, which is
+   // best done from one thread at a time, or else after probe()
    if (fetch_status() != 0) {
+      if (fGeoaddr != 0xff)
+         update_discovery_cache(fEthernet_device, fGeoaddr, "");
       char errmsg[99];
       sprintf(errmsg, "TAGMcontroller::TAGMcontroller error: "
                       "no response from Vbias board "
@@ -100,110 +470,308 @@ TAGMcontroller::TAGMcontroller(unsigned char geoaddr, const char *netdev)
       throw std::runtime_error(errmsg);
    }
    else if (fLastPacket[14] != fGeoaddr && fGeoaddr != 0xff) {
-      char errmsg[99];
-      sprintf(errmsg, "TAGMcontroller::TAGMcontroller error: "
-                      "probe packet broadcast for geoaddr %2.2x, "
-                      "but response packet comes from geoaddr %2.2x!",
-              fGeoaddr, fLastPacket[14]);
+      char errmsg[160];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMcontroller::TAGMcontroller error: "
+               "probe packet broadcast for geoaddr %2.2x, "
+               "but response packet comes from geoaddr %2.2x!",
+               fGeoaddr, fLastPacket[14]);
       throw std::runtime_error(errmsg);
    }
    for (int i = 0; i < 6; ++i) {
       fDestMACaddr[i] = fLastPacket[i+6];
    }
+   build_templates();
+   if (fGeoaddr != 0xff) {
+      char MACaddr[25];
+      sprintf(MACaddr, "%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x",
+              fDestMACaddr[0], fDestMACaddr[1], fDestMACaddr[2],
+              fDestMACaddr[3], fDestMACaddr[4], fDestMACaddr[5]);
+      update_discovery_cache(fEthernet_device, fGeoaddr, MACaddr);
+   }
 
-   configure_network_filters();
+   register_board();
 }
 
 TAGMcontroller::TAGMcontroller(unsigned char MACaddr[6], const char *netdev)
- : fEthernet_fp(0),
-   fEthernet_timeout(0)
+ : fLastRTT(0),
+   fLastRxTime(0),
+   fSession(0),
+   fMailFirst(0),
+   fMailCount(0),
+   fPacketRxTime(0),
+   fResetting(false)
 {
    fEthernet_device = (netdev)? netdev : DEFAULT_NETWORK_DEVICE;
-   open_network_device(PROBE_TIMEOUT_MS / 100);
+   open_network_device();
 
    for (int i=0; i < 32; ++i) {
       fLastVoltages[i] = 0;
+      fNextVoltages[i] = 0;
    }
+   fNextMask = 0;
    fVoltages_latched = false;
    fStatus_latched = false;
+   clear_channel_retries();
 
    // send a probe packet to this Vbias board
    // and look in response packet for its geoaddr
    fGeoaddr = 0xff;
-   std::string hostMAC(get_hostMACaddr(netdev));
-   unsigned int mac[6];
-   if (sscanf(hostMAC.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x",
-              &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
-   {
-      char errmsg[99];
-      sprintf(errmsg, "TAGMcontroller::TAGMcontroller error: "
-                      "unable to get the MAC address of host "
-                      "ethernet adapter %s.",
-              fEthernet_device.c_str());
-      throw std::runtime_error(errmsg);
-   }
    for (int i = 0; i < 6; ++i) {
       fDestMACaddr[i] = MACaddr[i];
-      fSrcMACaddr[i] = (unsigned char)mac[i];
+      fSrcMACaddr[i] = fSession->hostMACaddr[i];
    }
+   build_templates();
    if (fetch_status() != 0) {
-      char errmsg[99];
-      sprintf(errmsg, "TAGcontroller::TAGMcontroller error: "
-                      "no response from Vbias board at MAC addr = "
-                      "%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x\n",
-              MACaddr);
+      char errmsg[160];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGcontroller::TAGMcontroller error: "
+               "no response from Vbias board at MAC addr = "
+               "%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x\n",
+               MACaddr[0], MACaddr[1], MACaddr[2],
+               MACaddr[3], MACaddr[4], MACaddr[5]);
       throw std::runtime_error(errmsg);
    }
    fGeoaddr = fLastPacket[14];
+   build_templates();
 
-   configure_network_filters();
+   register_board();
 }
 
 TAGMcontroller::~TAGMcontroller()
 {
-   if (fEthernet_fp)
-      pcap_close(fEthernet_fp);
+   cancel_async();
+   if (fSession) {
+      std::unique_lock<std::mutex> lock(fSession->lock);
+      std::string key((const char*)fDestMACaddr, 6);
+      std::map<std::string, TAGMcontroller*>::iterator iter;
+      iter = fSession->boards.find(key);
+      if (iter != fSession->boards.end() && iter->second == this)
+         fSession->boards.erase(iter);
+      lock.unlock();
+      close_session(fSession);
+   }
+}
+
+TAGMcontroller::ethernet_session *TAGMcontroller::open_session(
+                                  const std::string &netdev)
+{
+   // Look up the capture session that is shared by all boards on
+   // interface netdev, opening a new one if none exists yet. The
+   // caller must release it with close_session() when done. The
+   // capture handle stays open for as long as the session exists,
+   // response timeouts are enforced as deadlines in next_packet().
+   // The kind of transport is chosen by select_transport() or by
+   // the env variable TAGM_TRANSPORT, see TAGMtransport.h.
+
+   std::lock_guard<std::mutex> lock(fEthernet_sessions_lock);
+   if (fEthernet_sessions.find(netdev) != fEthernet_sessions.end()) {
+      ethernet_session *session = fEthernet_sessions[netdev];
+      session->refcount++;
+      return session;
+   }
+   ethernet_session *session = new ethernet_session;
+   try {
+      session->transport = TAGMtransport::open(fTransport, netdev);
+   }
+   catch (const std::runtime_error &err) {
+      delete session;
+      throw;
+   }
+   session->device = netdev;
+   session->hostMAC = session->transport->get_hostMAC();
+   unsigned int mac[6];
+   if (sscanf(session->hostMAC.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x",
+              &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
+   {
+      delete session->transport;
+      delete session;
+      char errmsg[160];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMcontroller::open_session error: "
+               "unable to get the MAC address of host "
+               "ethernet adapter %.40s.", netdev.c_str());
+      throw std::runtime_error(errmsg);
+   }
+   for (int i=0; i < 6; ++i)
+      session->hostMACaddr[i] = (unsigned char)mac[i];
+   session->refcount = 1;
+   fEthernet_sessions[netdev] = session;
+   return session;
 }
 
-void TAGMcontroller::open_network_device(int timeout_ms)
+void TAGMcontroller::close_session(ethernet_session *session)
 {
-   if (timeout_ms == fEthernet_timeout)
+   std::lock_guard<std::mutex> lock(fEthernet_sessions_lock);
+   if (--session->refcount > 0)
       return;
-   else if (fEthernet_fp)
-      pcap_close(fEthernet_fp);
-   fEthernet_timeout = timeout_ms;
-   char errbuf[PCAP_ERRBUF_SIZE];
-   fEthernet_fp = pcap_open_live(fEthernet_device.c_str(), 100, 1,
-                                 fEthernet_timeout, errbuf);
-   if (fEthernet_fp == 0) {
+   fEthernet_sessions.erase(session->device);
+   delete session->transport;
+   delete session;
+}
+
+void TAGMcontroller::select_transport(const std::string &transport)
+{
+   // Choose how network devices opened after this call are accessed,
+   // through libpcap, directly with an AF_PACKET socket, or else
+   // looped back in-process to a set of emulated boards.
+
+   if (transport != "pcap" && transport != "afpacket" &&
+       transport != "loopback")
+   {
       char errmsg[99];
-      sprintf(errmsg, "TAGMcontroller::open_network_device error: "
-                      "unable to open the ethernet adapter, "
-                      "maybe you need root permission to open %s?\n",
-              fEthernet_device.c_str());
+      sprintf(errmsg, "TAGMcontroller::select_transport error: "
+                      "unknown transport %.40s", transport.c_str());
       throw std::runtime_error(errmsg);
    }
+   fTransport = transport;
+}
+
+static void check_ramp_profile(const TAGMcontroller::RampProfile &profile,
+                               const char *method)
+{
+   if (profile.slew > 0 && profile.max_step > 0 && profile.max_moving >= 0)
+      return;
+   char errmsg[150];
+   sprintf(errmsg, "TAGMcontroller::%s error: bad ramp profile, "
+                   "slew=%g V/s, max_step=%g V, max_moving=%d",
+           method, profile.slew, profile.max_step, profile.max_moving);
+   throw std::runtime_error(errmsg);
+}
+
+void TAGMcontroller::set_ramp_profile(const RampProfile &profile)
+{
+   // Set how fast ramps started after this call move the Vbias levels,
+   // on all channels except those ramping down to 0V.
+
+   check_ramp_profile(profile, "set_ramp_profile");
+   fRampProfile = profile;
+}
+
+void TAGMcontroller::set_rampdown_profile(const RampProfile &profile)
+{
+   // Set how fast ramps started after this call bring the Vbias levels
+   // down on channels whose new level is 0V.
+
+   check_ramp_profile(profile, "set_rampdown_profile");
+   fRampdownProfile = profile;
+}
+
+void TAGMcontroller::open_network_device()
+{
+   if (fSession == 0)
+      fSession = open_session(fEthernet_device);
+}
+
+void TAGMcontroller::register_board()
+{
+   // Sign up with the shared capture session to receive the
+   // packets that arrive from this board's MAC address.
+
+   bool broadcast = true;
+   for (int i=0; i < 6; ++i) {
+      if (fDestMACaddr[i] != 0xff)
+         broadcast = false;
+   }
+   if (! broadcast) {
+      std::string key((const char*)fDestMACaddr, 6);
+      std::lock_guard<std::mutex> lock(fSession->lock);
+      fSession->boards[key] = this;
+   }
+}
+
+void TAGMcontroller::build_templates()
+{
+   // Prebuild the request packets addressed to this board, to be
+   // called again whenever its MAC address or geoaddr changes. A
+   // request then only writes its payload, and together with the
+   // fixed mailbox ring for packets picked up by other boards this
+   // keeps the exchanges of a constructed board free of allocation.
+
+   unsigned char *templates[3] = {fQueryTemplate, fResetTemplate,
+                                  fPacketTemplate};
+   const char reqtypes[3] = {'Q', 'R', 'P'};
+   for (int t=0; t < 3; ++t) {
+      unsigned char *packet = templates[t];
+      for (int i=0; i < 6; i++) {
+         packet[i] = fDestMACaddr[i];
+         packet[i+6] = fSrcMACaddr[i];
+      }
+      packet[12] = 0;
+      packet[13] = (reqtypes[t] == 'P')? 70 : 50;
+      packet[14] = fGeoaddr;
+      packet[15] = reqtypes[t];
+   }
+   memset(fQueryTemplate + 16, 0, 48);
+   memset(fResetTemplate + 16, 0, 48);
+   memset(fPacketTemplate + 16, 0, 4);
+}
+
+void TAGMcontroller::format_request(unsigned char *packet, char reqtype,
+                                    unsigned int mask,
+                                    const unsigned int *values)
+{
+   // Fill in a request packet of type reqtype addressed to this board,
+   // 84 bytes for a P-packet with the values of the channels in mask,
+   // or else 64 bytes for a Q- or R-packet, from the prebuilt packets.
+
+   if (reqtype == 'P') {
+      memcpy(packet, fPacketTemplate, 16);
+      packet[16] = mask  & 0xff;
+      packet[17] = (mask >> 8) & 0xff;
+      packet[18] = (mask >> 16) & 0xff;
+      packet[19] = (mask >> 24) & 0xff;
+      for (int i=0; i < 32; ++i) {
+         packet[2*i+20] = (values[i] >> 8) & 0xff;
+         packet[2*i+21] = values[i] & 0xff;
+      }
+   }
+   else if (reqtype == 'R') {
+      memcpy(packet, fResetTemplate, 64);
+   }
+   else {
+      memcpy(packet, fQueryTemplate, 64);
+      packet[15] = reqtype;
+   }
 }
 
-void TAGMcontroller::configure_network_filters()
+void TAGMcontroller::accept_response(const unsigned char *packet_data,
+                                     double t_sent)
 {
-   char filter_string[20];
-   sprintf(filter_string, "ether src %2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X",
-           fDestMACaddr[0], fDestMACaddr[1], fDestMACaddr[2],
-           fDestMACaddr[3], fDestMACaddr[4], fDestMACaddr[5]);
-   struct bpf_program pcap_filter_program;
-   int res = pcap_compile(fEthernet_fp, &pcap_filter_program,
-                          filter_string, 1, PCAP_NETMASK_UNKNOWN);
-   if (res != 0) {
-      throw std::runtime_error("TAGMcontroller::configure_network_filters"
-                               "error: pcap filter refuses to compile.");
+   // Record a valid S- or D-packet from this board as the last packet
+   // received, and take the status or voltage readings out of it.
+
+   // The round trip is timed to the kernel time stamp of the response,
+   // so it does not include the time the packet waited to be picked up.
+   fLastRxTime = fPacketRxTime;
+   if (fLastRxTime < t_sent)
+      fLastRxTime = TAGMtransport::monotonic_clock();
+   fLastRTT = fLastRxTime - t_sent;
+   int packet_len = packet_data[13] + 14;
+   for (int i=0; i < packet_len; ++i)
+      fLastPacket[i] = packet_data[i];
+   if (packet_data[15] == 'S') {
+      fLastStatus = StatusSnapshot(packet_data);
    }
-   res = pcap_setfilter(fEthernet_fp, &pcap_filter_program);
-   if (res != 0) {
-      throw std::runtime_error("TAGMcontroller::configure_network_filters"
-                               " error: pcap filter refuses to load.");
+   else if (packet_data[15] == 'D') {
+      for (int i=0; i < 32; ++i) {
+         unsigned int byte1 = (unsigned int)packet_data[2*i+16];
+         unsigned int byte2 = (unsigned int)packet_data[2*i+17];
+         fLastVoltages[i] = (byte1 << 8) + byte2;
+      }
    }
-   pcap_freecode(&pcap_filter_program);
+}
+
+int TAGMcontroller::copy_last_packet(unsigned char packet[270])
+{
+   // Copy out the last packet received from the board, returning its
+   // length, without another thread talking to the board in between.
+
+   std::lock_guard<std::recursive_mutex> exchange(fExchange);
+   const unsigned char *last = get_last_packet();
+   int len = last[13] + 14;
+   memcpy(packet, last, len);
+   return len;
 }
 
 std::map<unsigned char, std::string> TAGMcontroller::probe(const char *netdev)
@@ -211,99 +779,131 @@ std::map<unsigned char, std::string> TAGMcontroller::probe(const char *netdev)
    char defnetdev[] = DEFAULT_NETWORK_DEVICE;
    if (netdev == 0)
       netdev = defnetdev;
-   char errbuf[PCAP_ERRBUF_SIZE];
-   pcap_t *fp = pcap_open_live(netdev, 100, 1, PROBE_TIMEOUT_MS / 100, errbuf);
-   if (fp == 0) {
-      char errmsg[99];
-      sprintf(errmsg, "TAGMcontroller::probe error: "
-                      "unable to open the ethernet adapter, "
-                      "maybe you need root permission to open %s?\n",
-              netdev);
-      throw std::runtime_error(errmsg);
-   }
+   ethernet_session *session = open_session(netdev);
    std::map<unsigned char, std::string> result;
-   std::string hostMAC(get_hostMACaddr(netdev));
-   result = probe(fp, hostMAC);
-   pcap_close(fp);
+   try {
+      result = probe(session);
+   }
+   catch (const std::runtime_error &err) {
+      close_session(session);
+      throw;
+   }
+   close_session(session);
+   return result;
+}
+
+std::map<unsigned char, std::string> TAGMcontroller::probe(ethernet_session *session)
+{
+   // list the MAC address of every board that answers a broadcast query
+
+   std::map<unsigned char, StatusSnapshot> snapshots;
+   snapshots = snapshot_all(session, 0);
+   std::map<unsigned char, std::string> catalog;
+   std::map<unsigned char, StatusSnapshot>::iterator iter;
+   for (iter = snapshots.begin(); iter != snapshots.end(); ++iter) {
+      const unsigned char *MAC = iter->second.get_MACaddr();
+      char MACaddr[25];
+      sprintf(MACaddr, "%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x",
+              MAC[0], MAC[1], MAC[2], MAC[3], MAC[4], MAC[5]);
+      catalog[iter->first] = std::string(MACaddr);
+   }
+   write_discovery_cache(session->device, catalog);
+   return catalog;
+}
+
+std::map<unsigned char, TAGMcontroller::StatusSnapshot>
+TAGMcontroller::snapshot_all(const char *netdev, int expected_count)
+{
+   // Send a single broadcast Q-packet and return the status reported
+   // by every board that answers, indexed by geoaddr. If expected_count
+   // is nonzero, return as soon as that many boards have answered,
+   // otherwise keep listening until the probe timeout.
+
+   char defnetdev[] = DEFAULT_NETWORK_DEVICE;
+   if (netdev == 0)
+      netdev = defnetdev;
+   ethernet_session *session = open_session(netdev);
+   std::map<unsigned char, StatusSnapshot> result;
+   try {
+      result = snapshot_all(session, expected_count);
+   }
+   catch (const std::runtime_error &err) {
+      close_session(session);
+      throw;
+   }
+   close_session(session);
    return result;
 }
 
-std::map<unsigned char, std::string> TAGMcontroller::probe(pcap_t *fp, std::string hostMAC)
+std::map<unsigned char, TAGMcontroller::StatusSnapshot>
+TAGMcontroller::snapshot_all(ethernet_session *session, int expected_count)
 {
+   // the capture handle is kept for the whole exchange,
+   // since the responses from all boards are wanted here
+   std::lock_guard<std::mutex> lock(session->lock);
+
    // flush any pending packets from the input buffer
-   char errbuf[PCAP_ERRBUF_SIZE];
-   pcap_setnonblock(fp, 1, errbuf);
-   u_char user[] = "C";
-   int pcnt = pcap_dispatch(fp, -1, &packet_reader, user);
-   pcap_setnonblock(fp, 0, errbuf);
+   reader_context context = {session, 0, 'C', 0};
+   const unsigned char *frame;
+   int frame_len;
+   while (session->transport->receive(&frame, &frame_len, 0) > 0)
+      packet_reader((unsigned char*)&context, frame, frame_len);
 
    // send a broadcast Q-packet to solicit responses
    // from every Vbias board present on the network
    unsigned char packet[64];
-   unsigned int mac[6];
-   sscanf(hostMAC.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x",
-          &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
    for (int i = 0; i < 6; ++i) {
       packet[i] = 0xff;
-      packet[i+6] = (unsigned char)mac[i];
+      packet[i+6] = session->hostMACaddr[i];
    }
    packet[12] = 0;
    packet[13] = 50;
    packet[14] = 0xff;
    packet[15] = 'Q';
-   log_packet("TAGMcontroller::probe is broadcasting a Q request"
+   log_packet("TAGMcontroller::snapshot_all is broadcasting a Q request"
               " to all front-end boards", packet);
    if (PRESEND_DELAY_US > 0)
       usleep(PRESEND_DELAY_US);
-   if (pcap_sendpacket(fp, packet, 64) != 0) {
-      char errmsg[99];
-      sprintf(errmsg, "TAGMcontroller::probe error: "
-                      "failure transmitting Q-packet, %s\n",
-              pcap_geterr(fp));
+   if (session->transport->send(packet, 64) != 0) {
+      char errmsg[384];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMcontroller::snapshot_all error: "
+               "failure transmitting Q-packet, %s\n",
+               session->transport->geterr());
       log_packet(errmsg, packet);
       throw std::runtime_error(errmsg);
    }
  
    // wait for the response S-packets from each board
-   std::map<unsigned char, std::string> catalog;
+   std::map<unsigned char, StatusSnapshot> snapshots;
    int heartbeat = 0;
+   double deadline = TAGMtransport::monotonic_clock() + PROBE_TIMEOUT_MS * 1e-3;
    for (int pcnt=0; pcnt < 999; ++pcnt) {
-      pcap_pkthdr *packet_header;
       const unsigned char *packet_data;
-      pcap_setnonblock(fp, 1, errbuf);
-      int resp = pcap_next_ex(fp, &packet_header, &packet_data);
-      for (int t_ms=1; resp == 0 && t_ms < PROBE_TIMEOUT_MS; t_ms *= 2) {
-         fd_set readfds;
-         FD_ZERO(&readfds);
-         FD_SET(pcap_get_selectable_fd(fp), &readfds);
-         struct timeval timeout;
-         timeout.tv_sec = t_ms / 1000;
-         timeout.tv_usec = 1000 * (t_ms % 1000);
-         select(1, &readfds, 0, 0, &timeout);
-         resp = pcap_next_ex(fp, &packet_header, &packet_data);
-      }
-      pcap_setnonblock(fp, 0, errbuf);
+      int packet_len;
+      int resp = session->transport->receive(&packet_data, &packet_len, deadline);
       if (resp == 0) {
-         log_packet("TAGMcontroller:probe exits, timeout reached.",
+         log_packet("TAGMcontroller::snapshot_all exits, timeout reached.",
                     0, packet);
          break;
       }
       else if (resp < 0) {
-         char errmsg[99];
-         sprintf(errmsg, "TAGMcontroller::probe error: "
-                         "failure receiving response from Vbias boards, %s\n",
-                 pcap_geterr(fp));
+         char errmsg[384];
+         snprintf(errmsg, sizeof(errmsg),
+                  "TAGMcontroller::snapshot_all error: "
+                  "failure receiving response from Vbias boards, %s\n",
+                  session->transport->geterr());
          log_packet(errmsg, 0, packet);
          throw std::runtime_error(errmsg);
       }
       if (packet_data[15] != 'S') {
-         log_packet("TAGMcontroller:probe error:"
+         log_packet("TAGMcontroller::snapshot_all error:"
                     " received unexpected packet:", packet_data, packet);
          if (++heartbeat > 5)
             break;
          continue;
       }
-      log_packet("TAGMcontroller:probe received expected response:",
+      log_packet("TAGMcontroller::snapshot_all received expected response:",
                  packet_data, packet);
       bool broadcasting = true;
       for (int i=0; i < 6; ++i) {
@@ -312,271 +912,810 @@ std::map<unsigned char, std::string> TAGMcontroller::probe(pcap_t *fp, std::stri
       }
       if (broadcasting)
          continue;
-      unsigned char geoaddr = packet_data[14];
-      char MACaddr[25];
-      sprintf(MACaddr, "%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x",
-              packet_data[6], packet_data[7], packet_data[8],
-              packet_data[9], packet_data[10], packet_data[11]);
-      catalog[geoaddr] = std::string(MACaddr);
+      snapshots[packet_data[14]] = StatusSnapshot(packet_data);
+      if (expected_count > 0 && (int)snapshots.size() >= expected_count) {
+         log_packet("TAGMcontroller::snapshot_all exits, all expected"
+                    " boards have responded.");
+         break;
+      }
    }
-   return catalog;
+   return snapshots;
 }
 
 const std::string TAGMcontroller::get_hostMACaddr(const char *netdev)
 {
    // return the host MAC address encoded as a string
 
-   struct ifreq ifr;
    char defnetdev[] = DEFAULT_NETWORK_DEVICE;
    if (netdev == 0)
       netdev = defnetdev;
-   size_t devname_len = strlen(netdev);
-   if (devname_len < sizeof(ifr.ifr_name)) {
-      memcpy(ifr.ifr_name, netdev, devname_len);
-      ifr.ifr_name[devname_len] = 0;
-   }
-   else {
-      char errmsg[80];
-      sprintf(errmsg, "TAGMcontroller::get_hostMACaddr error: "
-                      "interface name %s is too long",
-                      "for host MAC address lookup method.",
-              netdev);
-      throw std::runtime_error(errmsg);
+   ethernet_session *session = open_session(netdev);
+   std::string hostMAC(session->hostMAC);
+   close_session(session);
+   return hostMAC;
+}
+
+void TAGMcontroller::ramp_pacer::init()
+{
+   // take the ramp profiles in force at the start of the ramp
+
+   const RampProfile *profile[2] = {&fRampProfile, &fRampdownProfile};
+   double codes_per_volt = (1 << 14) / (50*fDAC_Vref);
+   for (int p=0; p < 2; ++p) {
+      slew[p] = profile[p]->slew * codes_per_volt;
+      max_codes[p] = int(profile[p]->max_step * codes_per_volt + 0.5);
+      max_codes[p] = (max_codes[p] > 0)? max_codes[p] : 1;
+      max_moving[p] = profile[p]->max_moving;
+      carry[p] = 0;
+      budget[p] = 0;
    }
+   last_step = 0;
+   pending = 3;
+}
 
-   int fd = socket(AF_UNIX,SOCK_DGRAM,0);
-   if (fd == -1) {
-      char errmsg[80];
-      sprintf(errmsg, "TAGMcontroller::get_hostMACaddr error: "
-                      "failed to open ethernet socket on device %s.",
-              netdev);
-      throw std::runtime_error(errmsg);
+double TAGMcontroller::ramp_pacer::next_step(double earliest)
+{
+   // time at which the next step should be sent, not before earliest
+
+   if (last_step == 0)
+      return earliest;
+   double period = 0;
+   for (int p=0; p < 2; ++p) {
+      double t = max_codes[p] / slew[p];
+      if ((pending & (1 << p)) && (period == 0 || t < period))
+         period = t;
    }
-   if (ioctl(fd,SIOCGIFHWADDR,&ifr) == -1) {
-      int temp_errno = errno;
-      close(fd);
-      throw std::runtime_error(strerror(temp_errno));
+   return (last_step + period > earliest)? last_step + period : earliest;
+}
+
+void TAGMcontroller::ramp_pacer::take_step(double t)
+{
+   // work out how far a channel may move in a step sent at time t
+
+   for (int p=0; p < 2; ++p) {
+      if (last_step == 0) {
+         budget[p] = max_codes[p];
+         continue;
+      }
+      double codes = carry[p] + slew[p] * (t - last_step);
+      if (codes >= max_codes[p]) {
+         budget[p] = max_codes[p];
+         carry[p] = 0;
+      }
+      else {
+         budget[p] = int(codes);
+         carry[p] = codes - budget[p];
+      }
    }
-   else if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
-      char errmsg[80];
-      sprintf(errmsg, "TAGMcontroller::get_hostMACaddr error: "
-                      "%s is not an ethernet interface.",
-              netdev);
-      throw std::runtime_error(errmsg);
+   last_step = t;
+   pending = 0;
+}
+
+unsigned int TAGMcontroller::ramp_pacer::step(const unsigned int levels[32],
+                                              const unsigned int targets[32],
+                                              unsigned int mask,
+                                              unsigned int next_values[32])
+{
+   // Compute the next step of one board from the levels it has reached
+   // towards targets, on the channels in mask, and return the mask of
+   // channels that move in this step.
+
+   unsigned int next_mask = 0;
+   int moving[2] = {0, 0};
+   for (int chan=0; chan < 32; ++chan) {
+      int p = (targets[chan] == 0)? 1 : 0;
+      int delta = (mask & (1 << chan))? targets[chan] - levels[chan] : 0;
+      pending |= (unsigned int)(delta != 0) << p;
+      delta = (delta > +budget[p])? budget[p] :
+              (delta < -budget[p])? -budget[p] : delta;
+      if (delta != 0 && max_moving[p] > 0 && ++moving[p] > max_moving[p])
+         delta = 0;
+      next_values[chan] = levels[chan] + delta;
+      next_mask |= (unsigned int)(delta != 0) << chan;
    }
-   char MACaddr[25];
-   sprintf(MACaddr, "%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x",
-           (unsigned char)ifr.ifr_hwaddr.sa_data[0],
-           (unsigned char)ifr.ifr_hwaddr.sa_data[1],
-           (unsigned char)ifr.ifr_hwaddr.sa_data[2],
-           (unsigned char)ifr.ifr_hwaddr.sa_data[3],
-           (unsigned char)ifr.ifr_hwaddr.sa_data[4],
-           (unsigned char)ifr.ifr_hwaddr.sa_data[5]);
-   return std::string(MACaddr);
+   return next_mask;
 }
 
 bool TAGMcontroller::ramp()
 {
    // push the new voltages to the board, if any
  
-   if (fNextVoltages.size() == 0)
-      return true;
-   if (fetch_voltages() != 0)
-      return false;
+   std::map<unsigned char, TAGMcontroller*> self;
+   self[fGeoaddr] = this;
+   return ramp_all(self);
+}
 
-   unsigned int target_values[32];
-   for (int chan=0; chan < 32; ++chan)
-      if (fNextVoltages.find(chan) != fNextVoltages.end())
-         target_values[chan] = fNextVoltages[chan];
-      else
-         target_values[chan] = fLastVoltages[chan];
+bool TAGMcontroller::ramp_all(std::map<unsigned char, TAGMcontroller*> &boards,
+                              unsigned char *failed_geoaddr)
+{
+   // Push the new voltages to all of the boards in the list, stepping
+   // every board together in lockstep. Each step sends the P-packets
+   // to all boards back-to-back before collecting any of the D-packets,
+   // so the time to ramp the frontend is set by the slowest board rather
+   // than the sum over boards. Boards driven through a remote server
+   // are ramped one at a time by the server. On failure, returns false
+   // with the geoaddr of the board that failed in *failed_geoaddr.
+
+   struct ramp_state {
+      TAGMcontroller *board;
+      unsigned int levels[32];
+      unsigned int target_values[32];
+      unsigned int next_mask;
+      unsigned int next_values[32];
+   };
+   std::vector<ramp_state> ramping;
+
+   // hold on to every board until the ramp is over, taking them in a
+   // fixed order so that ramps over overlapping sets cannot deadlock
+   std::vector<TAGMcontroller*> order;
+   std::map<unsigned char, TAGMcontroller*>::iterator iter;
+   for (iter = boards.begin(); iter != boards.end(); ++iter) {
+      if (iter->second)
+         order.push_back(iter->second);
+   }
+   std::sort(order.begin(), order.end());
+   std::vector<std::unique_lock<std::recursive_mutex> > exchanges;
+   for (unsigned int b=0; b < order.size(); ++b)
+      exchanges.push_back(std::unique_lock<std::recursive_mutex>(order[b]->fExchange));
+
+   for (iter = boards.begin(); iter != boards.end(); ++iter) {
+      TAGMcontroller *board = iter->second;
+      if (board == 0)
+         continue;
+      bool ok = true;
+      if (board->fSession == 0)
+         ok = board->ramp();
+      else if (board->fNextMask == 0)
+         continue;
+      else if (board->fetch_voltages() != 0)
+         ok = false;
+      if (! ok) {
+         if (failed_geoaddr)
+            *failed_geoaddr = iter->first;
+         return false;
+      }
+      if (board->fSession == 0)
+         continue;
+
+      ramp_state state;
+      state.board = board;
+      for (int chan=0; chan < 32; ++chan) {
+         state.levels[chan] = board->fLastVoltages[chan];
+         state.target_values[chan] = (board->fNextMask & (1 << chan))?
+                                     board->fNextVoltages[chan] :
+                                     board->fLastVoltages[chan];
+      }
+      ramping.push_back(state);
+   }
+
+   ramp_pacer pacer;
+   pacer.init();
+   while (true) {
+      // work out the next step for all boards, as soon as the pacing
+      // lets at least one channel move
+      double t_send;
+      int moving = 0;
+      do {
+         double now = TAGMtransport::monotonic_clock();
+         t_send = pacer.next_step(now + PRESEND_DELAY_US * 1e-6);
+         pacer.take_step(t_send);
+         moving = 0;
+         for (unsigned int b=0; b < ramping.size(); ++b) {
+            ramp_state &state = ramping[b];
+            state.next_mask = pacer.step(state.levels, state.target_values,
+                                         0xffffffff, state.next_values);
+            if (state.next_mask != 0)
+               ++moving;
+         }
+      } while (moving == 0 && pacer.pending != 0);
+      if (moving == 0)
+         return true;
+
+      // send this step to all boards that are still moving
+      std::vector<TAGMcontroller*> moving_boards;
+      for (unsigned int b=0; b < ramping.size(); ++b) {
+         ramp_state &state = ramping[b];
+         if (state.next_mask != 0) {
+            state.board->prepare_voltages(state.next_mask,
+                                          state.next_values);
+            moving_boards.push_back(state.board);
+         }
+      }
+      double wait_s = t_send - TAGMtransport::monotonic_clock();
+      if (wait_s > 0)
+         usleep((useconds_t)(wait_s * 1e6));
+      send_requests(&moving_boards[0], moving_boards.size());
+
+      // collect the responses, falling back on the request/retry cycle
+      // in set_voltages() for any board that did not answer cleanly,
+      // resending only the channels that were read back wrong, if any.
+      // The ramp keeps its own account of the levels it has set, so that
+      // a bad read-back of some channel outside the step cannot throw
+      // off the next step for that channel.
+      for (unsigned int b=0; b < ramping.size(); ++b) {
+         ramp_state &state = ramping[b];
+         if (state.next_mask == 0)
+            continue;
+         int resp = state.board->receive_voltages();
+         if (resp != 0) {
+            unsigned int mask = (resp > 0)? state.board->fRequestMismatch :
+                                            state.next_mask;
+            if (state.board->set_voltages(mask, state.next_values) != 0) {
+               if (failed_geoaddr)
+                  *failed_geoaddr = state.board->fGeoaddr;
+               return false;
+            }
+         }
+         for (int chan=0; chan < 32; ++chan) {
+            if (state.next_mask & (1 << chan))
+               state.levels[chan] = state.next_values[chan];
+         }
+      }
+   }
+}
+
+bool TAGMcontroller::ramp_all_broadcast(std::map<unsigned char, TAGMcontroller*> &boards,
+                                        unsigned char *failed_geoaddr)
+{
+   // Push the new voltages to all of the boards in the list like
+   // ramp_all(), but move the channels that all boards ramp the same
+   // way through a common range of levels with broadcast P-packets, as
+   // when parking the whole frontend at one level and unparking it
+   // again. Each such channel is first brought to the edge of the common
+   // range on every board on its own, then stepped through it on all
+   // boards together, one broadcast P-packet per step, and finally taken
+   // to its new level on each board on its own. The D-packet from every
+   // board is still checked against the broadcast values, with any board
+   // that does not answer cleanly sent the step again on its own. Every
+   // board on the network device hears a broadcast, so this falls back
+   // on ramp_all() unless the boards are all driven over the same network
+   // device and no other board answers the census taken at the start by
+   // a broadcast P-packet that changes nothing, and also if either ramp
+   // profile limits the number of channels moving at once. On failure,
+   // returns false with the geoaddr of the board that failed in
+   // *failed_geoaddr.
+
+   std::vector<TAGMcontroller*> group;
+   std::map<unsigned char, TAGMcontroller*>::iterator iter;
+   for (iter = boards.begin(); iter != boards.end(); ++iter) {
+      TAGMcontroller *board = iter->second;
+      if (board == 0)
+         continue;
+      else if (board->fSession == 0 ||
+               (group.size() > 0 && board->fSession != group[0]->fSession))
+      {
+         return ramp_all(boards, failed_geoaddr);
+      }
+      group.push_back(board);
+   }
+   if (group.size() < 2 || fRampProfile.max_moving > 0 ||
+                           fRampdownProfile.max_moving > 0)
+   {
+      return ramp_all(boards, failed_geoaddr);
+   }
+   ethernet_session *session = group[0]->fSession;
+
+   // hold on to every board until the ramp is over, taking them in the
+   // same order as ramp_all() does
+   std::vector<TAGMcontroller*> order(group);
+   std::sort(order.begin(), order.end());
+   std::vector<std::unique_lock<std::recursive_mutex> > exchanges;
+   for (unsigned int b=0; b < order.size(); ++b)
+      exchanges.push_back(std::unique_lock<std::recursive_mutex>(order[b]->fExchange));
+
+   // the census also reads back the present levels of all boards
+   if (! broadcast_census(group))
+      return ramp_all(boards, failed_geoaddr);
 
-   int max_delta_allowed = 10; // max DAC code change in one step, ~100mV
-   int steps;
-   for (steps = 0; steps < 9999; ++steps) {
-      unsigned int next_mask = 0;
+   struct ramp_state {
+      TAGMcontroller *board;
+      unsigned int levels[32];
+      unsigned int target_values[32];
+      unsigned int goals[32];          // levels to move towards in this step
+      unsigned int next_mask;
       unsigned int next_values[32];
+   };
+   std::vector<ramp_state> ramping(group.size());
+   unsigned int common_mask = 0xffffffff;
+   for (unsigned int b=0; b < group.size(); ++b) {
+      TAGMcontroller *board = group[b];
+      ramp_state &state = ramping[b];
+      state.board = board;
+      for (int chan=0; chan < 32; ++chan) {
+         state.levels[chan] = board->fLastVoltages[chan];
+         state.target_values[chan] = (board->fNextMask & (1 << chan))?
+                                     board->fNextVoltages[chan] :
+                                     board->fLastVoltages[chan];
+      }
+      common_mask &= board->fNextMask;
+   }
+
+   // find the range of levels that each channel passes through on
+   // every board, if all of the boards move it the same way
+   unsigned int start[32];
+   unsigned int end[32];
+   for (int chan=0; chan < 32; ++chan) {
+      start[chan] = end[chan] = 0;
+      if ((common_mask & (1 << chan)) == 0)
+         continue;
+      unsigned int lo_level = 0xffff, hi_level = 0;
+      unsigned int lo_target = 0xffff, hi_target = 0;
+      for (unsigned int b=0; b < ramping.size(); ++b) {
+         unsigned int level = ramping[b].levels[chan];
+         unsigned int target = ramping[b].target_values[chan];
+         lo_level = (level < lo_level)? level : lo_level;
+         hi_level = (level > hi_level)? level : hi_level;
+         lo_target = (target < lo_target)? target : lo_target;
+         hi_target = (target > hi_target)? target : hi_target;
+      }
+      if (hi_target < lo_level) {
+         start[chan] = lo_level;
+         end[chan] = hi_target;
+      }
+      else if (lo_target > hi_level) {
+         start[chan] = hi_level;
+         end[chan] = lo_target;
+      }
+      else {
+         common_mask &= ~(1 << chan);
+      }
+   }
+
+   // channels go from gathering at the start of the common range to
+   // being broadcast, and then on to their new levels board by board;
+   // all other channels go straight to their new levels
+   unsigned int gathering = common_mask;
+   unsigned int broadcasting = 0;
+   unsigned int common_levels[32];
+   unsigned int next_common[32];
+   for (int chan=0; chan < 32; ++chan)
+      common_levels[chan] = start[chan];
+   ramp_pacer pacer;
+   pacer.init();
+   while (true) {
       for (int chan=0; chan < 32; ++chan) {
-         int delta = target_values[chan] - fLastVoltages[chan];
-         delta = (delta > +max_delta_allowed)? max_delta_allowed :
-                 (delta < -max_delta_allowed)? -max_delta_allowed : delta;
-         if (delta != 0) {
-            next_values[chan] = fLastVoltages[chan] + delta;
-            next_mask |= (1 << chan);
+         unsigned int bit = (1 << chan);
+         if (gathering & bit) {
+            bool gathered = true;
+            for (unsigned int b=0; b < ramping.size(); ++b) {
+               if (ramping[b].levels[chan] != start[chan])
+                  gathered = false;
+            }
+            if (gathered) {
+               gathering &= ~bit;
+               broadcasting |= bit;
+            }
+         }
+         if ((broadcasting & bit) && common_levels[chan] == end[chan])
+            broadcasting &= ~bit;
+      }
+      for (unsigned int b=0; b < ramping.size(); ++b) {
+         ramp_state &state = ramping[b];
+         for (int chan=0; chan < 32; ++chan) {
+            state.goals[chan] = (gathering & (1 << chan))? start[chan] :
+                                state.target_values[chan];
          }
       }
 
-      if (next_mask == 0)
+      // work out the next step, as soon as the pacing lets at least
+      // one channel move, either on all boards or on some board
+      double t_send;
+      unsigned int common_step;
+      int moving = 0;
+      do {
+         double now = TAGMtransport::monotonic_clock();
+         t_send = pacer.next_step(now + PRESEND_DELAY_US * 1e-6);
+         pacer.take_step(t_send);
+         common_step = pacer.step(common_levels, end, broadcasting,
+                                  next_common);
+         moving = (common_step != 0);
+         for (unsigned int b=0; b < ramping.size(); ++b) {
+            ramp_state &state = ramping[b];
+            state.next_mask = pacer.step(state.levels, state.goals,
+                                         ~broadcasting, state.next_values);
+            if (state.next_mask != 0)
+               ++moving;
+         }
+      } while (moving == 0 && pacer.pending != 0);
+      if (moving == 0)
          return true;
-      else if (set_voltages(next_mask, next_values) != 0)
+      double wait_s = t_send - TAGMtransport::monotonic_clock();
+      if (wait_s > 0)
+         usleep((useconds_t)(wait_s * 1e6));
+
+      // send the broadcast step, after giving every board the P-packet
+      // it would have been sent on its own, to check its read-back
+      // against and to resend if need be
+      if (common_step != 0) {
+         for (unsigned int b=0; b < group.size(); ++b) {
+            TAGMcontroller *board = group[b];
+            int pcnt = board->flush_packets('P');
+            if (pcnt > 0)
+               warn_unexpected("program", pcnt);
+            board->format_request(board->fRequestPacket, 'P',
+                                  common_step, next_common);
+            board->fRequestMask = common_step;
+         }
+         unsigned char packet[84];
+         memcpy(packet, group[0]->fRequestPacket, 84);
+         for (int i=0; i < 6; ++i)
+            packet[i] = 0xff;
+         packet[14] = 0xff;
+         log_packet("TAGMcontroller::ramp_all_broadcast is broadcasting"
+                    " a P request to all front-end boards", packet);
+         {
+            std::lock_guard<std::mutex> lock(session->lock);
+            if (session->transport->send(packet, 84) != 0) {
+               char errmsg[384];
+               snprintf(errmsg, sizeof(errmsg),
+                        "TAGMcontroller::ramp_all_broadcast error: "
+                        "P-packet transmit failed, %s\n",
+                        session->transport->geterr());
+               log_packet(errmsg, 0, packet);
+               throw std::runtime_error(errmsg);
+            }
+            double t_sent = TAGMtransport::monotonic_clock();
+            for (unsigned int b=0; b < group.size(); ++b)
+               group[b]->fRequestSent = t_sent;
+         }
+         for (unsigned int b=0; b < ramping.size(); ++b) {
+            ramp_state &state = ramping[b];
+            int resp = state.board->receive_voltages();
+            if (resp != 0) {
+               unsigned int mask = (resp > 0)? state.board->fRequestMismatch :
+                                               common_step;
+               if (state.board->set_voltages(mask, next_common) != 0) {
+                  if (failed_geoaddr)
+                     *failed_geoaddr = state.board->fGeoaddr;
+                  return false;
+               }
+            }
+            for (int chan=0; chan < 32; ++chan) {
+               if (common_step & (1 << chan))
+                  state.levels[chan] = next_common[chan];
+            }
+         }
+         for (int chan=0; chan < 32; ++chan) {
+            if (common_step & (1 << chan))
+               common_levels[chan] = next_common[chan];
+         }
+      }
+
+      // then the steps of the channels that move board by board,
+      // in the same way as in ramp_all()
+      std::vector<TAGMcontroller*> moving_boards;
+      for (unsigned int b=0; b < ramping.size(); ++b) {
+         ramp_state &state = ramping[b];
+         if (state.next_mask != 0) {
+            state.board->prepare_voltages(state.next_mask,
+                                          state.next_values);
+            moving_boards.push_back(state.board);
+         }
+      }
+      if (moving_boards.size() > 0)
+         send_requests(&moving_boards[0], moving_boards.size());
+      for (unsigned int b=0; b < ramping.size(); ++b) {
+         ramp_state &state = ramping[b];
+         if (state.next_mask == 0)
+            continue;
+         int resp = state.board->receive_voltages();
+         if (resp != 0) {
+            unsigned int mask = (resp > 0)? state.board->fRequestMismatch :
+                                            state.next_mask;
+            if (state.board->set_voltages(mask, state.next_values) != 0) {
+               if (failed_geoaddr)
+                  *failed_geoaddr = state.board->fGeoaddr;
+               return false;
+            }
+         }
+         for (int chan=0; chan < 32; ++chan) {
+            if (state.next_mask & (1 << chan))
+               state.levels[chan] = state.next_values[chan];
+         }
+      }
+   }
+}
+
+bool TAGMcontroller::broadcast_census(std::vector<TAGMcontroller*> &group)
+{
+   // Send a broadcast P-packet with an empty channel mask, which every
+   // board answers with a D-packet without changing any of its levels,
+   // and take the levels of the boards in group from the answers. After
+   // the last board in group has answered, keep listening for as long
+   // again, at least CENSUS_GRACE_MS, for answers from any other board.
+   // Returns true if all boards in group answered and no other board
+   // did, so that it is safe to broadcast steps to the group.
+
+   for (unsigned int b=0; b < group.size(); ++b) {
+      int pcnt = group[b]->flush_packets('P');
+      if (pcnt > 0)
+         warn_unexpected("program", pcnt);
+   }
+   ethernet_session *session = group[0]->fSession;
+   std::lock_guard<std::mutex> lock(session->lock);
+   std::map<std::string, TAGMcontroller*> members;
+   for (unsigned int b=0; b < group.size(); ++b) {
+      std::string key((const char*)group[b]->fDestMACaddr, 6);
+      members[key] = group[b];
+   }
+
+   unsigned char packet[84];
+   unsigned int values[32] = {0};
+   group[0]->format_request(packet, 'P', 0, values);
+   for (int i=0; i < 6; ++i)
+      packet[i] = 0xff;
+   packet[14] = 0xff;
+   log_packet("TAGMcontroller::broadcast_census is broadcasting a P"
+              " request with no channels to all front-end boards", packet);
+   if (PRESEND_DELAY_US > 0)
+      usleep(PRESEND_DELAY_US);
+   if (session->transport->send(packet, 84) != 0) {
+      char errmsg[384];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMcontroller::broadcast_census error: "
+               "P-packet transmit failed, %s\n",
+               session->transport->geterr());
+      log_packet(errmsg, 0, packet);
+      throw std::runtime_error(errmsg);
+   }
+   double t_sent = TAGMtransport::monotonic_clock();
+   double deadline = t_sent + READ_TIMEOUT_MS * 1e-3;
+   std::map<TAGMcontroller*, bool> answered;
+   bool strangers = false;
+   for (int pcnt=0; pcnt < 999; ++pcnt) {
+      const unsigned char *packet_data;
+      int packet_len;
+      int resp = session->transport->receive(&packet_data, &packet_len,
+                                             deadline);
+      if (resp == 0) {
          break;
-      else if (RAMP_DELAY_US > 0)
-         usleep(RAMP_DELAY_US);
+      }
+      else if (resp < 0) {
+         char errmsg[384];
+         snprintf(errmsg, sizeof(errmsg),
+                  "TAGMcontroller::broadcast_census error: "
+                  "failure receiving response from Vbias boards, %s\n",
+                  session->transport->geterr());
+         log_packet(errmsg, 0, packet);
+         throw std::runtime_error(errmsg);
+      }
+      std::string key((const char*)packet_data + 6, 6);
+      std::map<std::string, TAGMcontroller*>::iterator member;
+      member = members.find(key);
+      if (packet_data[15] != 'D') {
+         if (! route_packet(session, 0, packet_data, packet_len))
+            log_packet("TAGMcontroller::broadcast_census error:"
+                       " received unexpected packet:", packet_data, packet);
+         continue;
+      }
+      else if (member == members.end()) {
+         log_packet("TAGMcontroller::broadcast_census received response"
+                    " from a board outside the ramp:", packet_data, packet);
+         strangers = true;
+         continue;
+      }
+      log_packet("TAGMcontroller::broadcast_census received expected"
+                 " response:", packet_data, packet);
+      TAGMcontroller *board = member->second;
+      board->fPacketRxTime = session->transport->get_rx_time();
+      board->accept_response(packet_data, t_sent);
+      answered[board] = true;
+      if (answered.size() == group.size()) {
+         double now = TAGMtransport::monotonic_clock();
+         double grace = now - t_sent;
+         grace = (grace > CENSUS_GRACE_MS * 1e-3)? grace :
+                                                   CENSUS_GRACE_MS * 1e-3;
+         deadline = (now + grace < deadline)? now + grace : deadline;
+      }
    }
-   return false;
+   if (answered.size() < group.size()) {
+      log_packet("TAGMcontroller::broadcast_census exits, not all boards"
+                 " answered within timeout.", 0, packet);
+      return false;
+   }
+   return (! strangers);
 }
 
 int TAGMcontroller::set_voltages(unsigned int mask, unsigned int values[32])
 {
-   // send a P-packet, receive
+   // Send a P-packet and check the D-packet that comes back against it.
+   // Channels whose read-back disagrees are sent again on their own, up
+   // to MISMATCH_RETRY_COUNT times, before the card is reset and this
+   // gives up. Lost responses are retried up to RETRY_COUNT times.
+
+   std::lock_guard<std::recursive_mutex> exchange(fExchange);
+   int timeouts = 0;
+   int mismatches = 0;
+   while (true) {
+      if (PRESEND_DELAY_US > 0)
+         usleep(PRESEND_DELAY_US);
+      send_voltages(mask, values);
+      int resp = receive_voltages();
+      if (resp == 0) {
+         return 0;
+      }
+      else if (resp > 0) {
+         if (++mismatches > MISMATCH_RETRY_COUNT) {
+            char errmsg[99];
+            sprintf(errmsg, "TAGMcontroller::set_voltages error:"
+                    " mismatch between Vbias values requested and read back!");
+            log_packet(errmsg);
+            if (! fResetting)
+               reset();
+            throw std::runtime_error(errmsg);
+         }
+         mask = fRequestMismatch;
+         char msg[99];
+         sprintf(msg, "TAGMcontroller::set_voltages mismatch retry count"
+                      " is %d, resending channel mask %x", mismatches, mask);
+         log_packet(msg);
+      }
+      else if (++timeouts < RETRY_COUNT) {
+         char msg[99];
+         sprintf(msg, "TAGMcontroller::set_voltages retry count is %d",
+                 timeouts);
+         log_packet(msg);
+      }
+      else {
+         return -1;
+      }
+   }
+}
 
-   open_network_device(READ_TIMEOUT_MS / 100);
+void TAGMcontroller::send_voltages(unsigned int mask, unsigned int values[32])
+{
+   // send a P-packet to the board without waiting for the response,
+   // which must be collected afterwards by calling receive_voltages()
+
+   prepare_voltages(mask, values);
+   TAGMcontroller *self = this;
+   send_requests(&self, 1);
+}
+
+void TAGMcontroller::prepare_voltages(unsigned int mask, unsigned int values[32])
+{
+   // format the P-packet for the next send_requests() call
 
    // flush any pending packets from the input buffer
-   char errbuf[PCAP_ERRBUF_SIZE];
-   pcap_setnonblock(fEthernet_fp, 1, errbuf);
-   u_char user[] = "P";
-   int pcnt = pcap_dispatch(fEthernet_fp, -1, &packet_reader, user);
-   pcap_setnonblock(fEthernet_fp, 0, errbuf);
+   int pcnt = flush_packets('P');
    if (pcnt > 0)
-      std::cerr << "program saw " << pcnt << " unrequested packets"
-                << std::endl;
+      warn_unexpected("program", pcnt);
    
    // send out the P-packet
-   unsigned char packet[84];
-   for (int i=0; i < 6; i++) {
-      packet[i] = fDestMACaddr[i];
-      packet[i+6] = fSrcMACaddr[i];
-   }
-   packet[12] = 0;
-   packet[13] = 70;
-   packet[14] = fGeoaddr;
-   packet[15] = 'P';
-   packet[16] = mask  & 0xff;
-   packet[17] = (mask >> 8) & 0xff;
-   packet[18] = (mask >> 16) & 0xff;
-   packet[19] = (mask >> 24) & 0xff;
-   for (int i=0; i < 32; ++i) {
-      packet[2*i+20] = (values[i] >> 8) & 0xff;
-      packet[2*i+21] = values[i] & 0xff;
+   unsigned char *packet = fRequestPacket;
+   format_request(packet, 'P', mask, values);
+   fRequestMask = mask;
+
+   log_packet("TAGMcontroller::set_voltages sends request packet:",
+              packet);
+}
+
+void TAGMcontroller::send_requests(TAGMcontroller *const boards[], int count)
+{
+   // Transmit the P-packets prepared for all of the boards, handing
+   // those that share a network device to the kernel all at once.
+   // The batches are gathered on the stack, there are only a few
+   // network devices and a few dozen boards at most.
+
+   for (int first=0; first < count; ++first) {
+      ethernet_session *session = boards[first]->fSession;
+      bool done = false;
+      for (int b=0; b < first; ++b) {
+         if (boards[b]->fSession == session)
+            done = true;
+      }
+      if (done)
+         continue;
+      TAGMcontroller *batch[count];
+      const unsigned char *frames[count];
+      int lens[count];
+      int nbatch = 0;
+      for (int b=first; b < count; ++b) {
+         if (boards[b]->fSession != session)
+            continue;
+         batch[nbatch] = boards[b];
+         frames[nbatch] = boards[b]->fRequestPacket;
+         lens[nbatch++] = 84;
+      }
+      std::lock_guard<std::mutex> lock(session->lock);
+      if (session->transport->send(frames, lens, nbatch) != 0) {
+         char errmsg[384];
+         snprintf(errmsg, sizeof(errmsg),
+                  "TAGMcontroller::set_voltages error: "
+                  "P-packet transmit failed, %s\n",
+                  session->transport->geterr());
+         log_packet(errmsg, 0, frames[0]);
+         throw std::runtime_error(errmsg);
+      }
+      double t_sent = TAGMtransport::monotonic_clock();
+      for (int b=0; b < nbatch; ++b)
+         batch[b]->fRequestSent = t_sent;
    }
+}
 
-   for (int retry=0; retry < RETRY_COUNT; ++retry) {
-      log_packet("TAGMcontroller::set_voltages sends request packet:",
-                 packet);
-      if (PRESEND_DELAY_US > 0)
-         usleep(PRESEND_DELAY_US);
-      if (pcap_sendpacket(fEthernet_fp, packet, 84) != 0) {
-         char errmsg[99];
-         sprintf(errmsg, "TAGMcontroller::set_voltages error: "
-                         "P-packet transmit failed, %s\n",
-                 pcap_geterr(fEthernet_fp));
+int TAGMcontroller::receive_voltages()
+{
+   // wait for the D-packet answering the last send_voltages() request
+   // and check it against the request. Returns 0 on success, -1 if no
+   // response came back within the timeout, or +1 if the voltages read
+   // back do not match the values requested.
+
+   const unsigned char *packet = fRequestPacket;
+   double deadline = fRequestSent + READ_TIMEOUT_MS * 1e-3;
+   const unsigned char *packet_data = 0;
+   for (int pcnt=0; pcnt < 999; ++pcnt) {
+      if (pcnt > 0) {
+         warn_unexpected("program", pcnt, packet_data);
+         log_packet("TAGMcontroller::set_voltages error:"
+                    " saw unexpected response packet:", packet_data, packet);
+      }
+      int resp = next_packet(&packet_data, deadline);
+      if (resp == 0) {
+         log_packet("TAGMcontroller::set_voltages response error:"
+                    " no packets received within timeout.", 0, packet);
+         break;
+      }
+      else if (resp < 0) {
+         char errmsg[384];
+         snprintf(errmsg, sizeof(errmsg),
+                  "TAGMcontroller::set_voltages error: "
+                  "failure receiving response from Vbias board, %s\n",
+                  fSession->transport->geterr());
          log_packet(errmsg, 0, packet);
          throw std::runtime_error(errmsg);
       }
+      if (packet_data[15] != 'D') {
+         log_packet("TAGMcontroller::set_voltages error:"
+                    " received unexpected response:", packet_data, packet);
+         continue;
+      }
+      if (fGeoaddr != 0xff && packet_data[14] != fGeoaddr) {
+         log_packet("TAGMcontroller::set_voltages error:"
+                    " received response from unexpected source:",
+                    packet_data, packet);
+         continue;
+      }
+      bool broadcast = true;
+      bool matching = true;
+      for (int i=0; i < 6; ++i) {
+         if (fDestMACaddr[i] != 0xff)
+            broadcast = false;
+         if (packet_data[i+6] != fDestMACaddr[i])
+            matching = false;
+      }
+      if (! (broadcast || matching)) {
+         log_packet("TAGMcontroller::set_voltages error:"
+                    " response consistency check failed:",
+                    packet_data, packet);
+         continue;
+      }
+      else {
+         log_packet("TAGMcontroller::set_voltages received expected"
+                    " response:", packet_data, packet);
+      }
  
-      // wait for the response D-packet
-      for (int pcnt=0; pcnt < 999; ++pcnt) {
-         pcap_pkthdr *packet_header;
-         const unsigned char *packet_data;
-         if (pcnt > 0) {
-            std::cerr << "program saw " << pcnt 
-                      << " unexpected response packets, header bytes follow:"
-                      << std::endl;
-            for (int n=0; n < 16; ++n) {
-               char str[4];
-               sprintf(str, "%2.2x ", (unsigned int)packet_data[n]);
-               std::cerr << str;
-            }
-            std::cerr << std::endl;
-            log_packet("TAGMcontroller::set_voltages error:"
-                       " saw unexpected response packet:", packet_data, packet);
-         }
-         pcap_setnonblock(fEthernet_fp, 1, errbuf);
-         int resp = pcap_next_ex(fEthernet_fp, &packet_header, &packet_data);
-         for (int t_ms=1; resp == 0 && t_ms < READ_TIMEOUT_MS; t_ms *= 2) {
-            fd_set readfds;
-            FD_ZERO(&readfds);
-            FD_SET(pcap_get_selectable_fd(fEthernet_fp), &readfds);
-            struct timeval timeout;
-            timeout.tv_sec = t_ms / 1000;
-            timeout.tv_usec = 1000 * (t_ms % 1000);
-            select(1, &readfds, 0, 0, &timeout);
-            resp = pcap_next_ex(fEthernet_fp, &packet_header, &packet_data);
-         }
-         pcap_setnonblock(fEthernet_fp, 0, errbuf);
-         if (resp == 0) {
-            log_packet("TAGMcontroller::set_voltages response error:"
-                       " no packets received within timeout.", 0, packet);
-            break;
-         }
-         else if (resp < 0) {
-            char errmsg[99];
-            sprintf(errmsg, "TAGMcontroller::set_voltages error: "
-                            "failure receiving response from Vbias board, %s\n",
-                    pcap_geterr(fEthernet_fp));
-            log_packet(errmsg, 0, packet);
-            throw std::runtime_error(errmsg);
-         }
-         if (packet_data[15] != 'D') {
-            log_packet("TAGMcontroller::set_voltages error:"
-                       " received unexpected response:", packet_data, packet);
-            continue;
-         }
-         if (fGeoaddr != 0xff && packet_data[14] != fGeoaddr) {
-            log_packet("TAGMcontroller::set_voltages error:"
-                       " received response from unexpected source:",
-                       packet_data, packet);
-            continue;
-         }
-         bool broadcast = true;
-         bool matching = true;
-         for (int i=0; i < 6; ++i) {
-            if (fDestMACaddr[i] != 0xff)
-               broadcast = false;
-            if (packet_data[i+6] != fDestMACaddr[i])
-               matching = false;
-         }
-         if (! (broadcast || matching)) {
-            log_packet("TAGMcontroller::set_voltages error:"
-                       " response consistency check failed:",
-                       packet_data, packet);
+      // verify the values sent back against those requested, noting
+      // every channel that disagrees so that only those are resent
+      fRequestMismatch = 0;
+      for (int i=0; i < 32; ++i) {
+         if ((fRequestMask & (1 << i)) == 0)
             continue;
+         if (packet_data[16 + 2*i] != packet[20 + 2*i] ||
+             packet_data[17 + 2*i] != packet[21 + 2*i])
+         {
+            fRequestMismatch |= (1 << i);
+            ++fChannelRetries[i];
          }
-         else {
-            log_packet("TAGMcontroller::set_voltages received expected"
-                       " response:", packet_data, packet);
-         }
- 
-         // verify the values sent back and
-         // throw an exception on mismatch
-         for (int i=0; i < 32; ++i) {
-            if ((mask & (1 << i)) == 0)
-               continue;
-            if (packet_data[16 + 2*i] != packet[20 + 2*i] ||
-                packet_data[17 + 2*i] != packet[21 + 2*i])
-            {
-               char errmsg[99];
-               sprintf(errmsg, "TAGMcontroller::set_voltages error:"
-                       " mismatch between Vbias values requested and read back!");
-               log_packet("TAGMcontroller::set_voltages error:"
-                          " mismatch between expected and readback voltages,"
-                          "resetting the card, and aborting...");
-               static int bad_readback_recurse=0;
-               if (++bad_readback_recurse < 99) {
-                  std::cout << "recursively calling set_voltages, level=" << bad_readback_recurse << std::endl;
-                  set_voltages(mask, values);
-               }
-               else {
-                  reset();
-                  throw std::runtime_error(errmsg);
-               }
-            }
-         }
-
-         int packet_len = packet_data[13] + 14;
-         for (int i=0; i < packet_len; ++i)
-            fLastPacket[i] = packet_data[i];
-         for (int i=0; i < 32; ++i) {
-            unsigned int byte1 = (unsigned int)packet_data[2*i+16];
-            unsigned int byte2 = (unsigned int)packet_data[2*i+17];
-            fLastVoltages[i] = (byte1 << 8) + byte2;
-         }
-         return 0;
       }
-      std::stringstream msg;
-      msg << "TAGMcontroller::set_voltages retry count is " << retry;
-      log_packet(msg.str());
+      if (fRequestMismatch != 0) {
+         log_packet("TAGMcontroller::set_voltages error:"
+                    " mismatch between expected and readback voltages:",
+                    packet_data, packet);
+         return 1;
+      }
+
+      accept_response(packet_data, fRequestSent);
+      return 0;
    }
    return -1;
 }
@@ -586,84 +1725,70 @@ bool TAGMcontroller::reset()
    // send a R-packet, receive an S-packet from board, 
    // send a P-packet with zeros, receive a D-packet from board.
 
-   open_network_device(RESET_TIMEOUT_MS / 100);
+   std::lock_guard<std::recursive_mutex> exchange(fExchange);
+   fResetting = true;
+   bool ok;
+   try {
+      ok = reset_card();
+   }
+   catch (const std::runtime_error &err) {
+      fResetting = false;
+      throw;
+   }
+   fResetting = false;
+   return ok;
+}
+
+bool TAGMcontroller::reset_card()
+{
+   // the exchanges of reset(), see above
 
    // flush any pending packets from the input buffer
-   char errbuf[PCAP_ERRBUF_SIZE];
-   pcap_setnonblock(fEthernet_fp, 1, errbuf);
-   u_char user[] = "R";
-   int pcnt = pcap_dispatch(fEthernet_fp, -1, &packet_reader, user);
-   pcap_setnonblock(fEthernet_fp, 0, errbuf);
+   int pcnt = flush_packets('R');
    if (pcnt > 0)
-      std::cerr << "reset saw " << pcnt << " unrequested packets"
-                << std::endl;
+      warn_unexpected("reset", pcnt);
    
    // send out an R-packet
    unsigned char packet[64];
-   for (int i=0; i < 6; i++) {
-      packet[i] = fDestMACaddr[i];
-      packet[i+6] = fSrcMACaddr[i];
-   }
-   packet[12] = 0;
-   packet[13] = 50;
-   packet[14] = fGeoaddr;
-   packet[15] = 'R';
-   for (int i=16; i < 64; ++i) {
-      packet[i] = 0;
-   }
+   format_request(packet, 'R');
 
    log_packet("TAGMcontroller::reset sends request:", packet);
    if (PRESEND_DELAY_US > 0)
       usleep(PRESEND_DELAY_US);
-   if (pcap_sendpacket(fEthernet_fp, packet, 64) != 0) {
-      char errmsg[99];
-      sprintf(errmsg, "TAGMcontroller::reset error: "
-                      "R-packet transmit failed, %s\n",
-              pcap_geterr(fEthernet_fp));
+   std::unique_lock<std::mutex> lock(fSession->lock);
+   if (fSession->transport->send(packet, 64) != 0) {
+      char errmsg[384];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMcontroller::reset error: "
+               "R-packet transmit failed, %s\n",
+               fSession->transport->geterr());
       log_packet(errmsg, 0, packet);
       throw std::runtime_error(errmsg);
    }
+   lock.unlock();
  
    // wait for the response S-packet
+   double t_sent = TAGMtransport::monotonic_clock();
+   double deadline = t_sent + RESET_TIMEOUT_MS * 1e-3;
+   const unsigned char *packet_data = 0;
    for (int pcnt=0; pcnt < 999; ++pcnt) {
-      pcap_pkthdr *packet_header;
-      const unsigned char *packet_data;
       if (pcnt > 0) {
-         std::cerr << "reset saw " << pcnt
-                   << " unexpected response packets, header bytes follow:"
-                   << std::endl;
-         for (int n=0; n < 16; ++n) {
-            char str[4];
-            sprintf(str, "%2.2x ", (unsigned int)packet_data[n]);
-            std::cerr << str;
-         }
-         std::cerr << std::endl;
+         warn_unexpected("reset", pcnt, packet_data);
          log_packet("TAGMcontroller::reset error:"
                     " saw unexpected response packet:", packet_data, packet);
       }
-      pcap_setnonblock(fEthernet_fp, 1, errbuf);
-      int resp = pcap_next_ex(fEthernet_fp, &packet_header, &packet_data);
-      for (int t_ms=1; resp == 0 && t_ms < RESET_TIMEOUT_MS; t_ms *= 2) {
-         fd_set readfds;
-         FD_ZERO(&readfds);
-         FD_SET(pcap_get_selectable_fd(fEthernet_fp), &readfds);
-         struct timeval timeout;
-         timeout.tv_sec = t_ms / 1000;
-         timeout.tv_usec = 1000 * (t_ms % 1000);
-         select(1, &readfds, 0, 0, &timeout);
-         resp = pcap_next_ex(fEthernet_fp, &packet_header, &packet_data);
-      }
-      pcap_setnonblock(fEthernet_fp, 0, errbuf);
+      int resp = next_packet(&packet_data, deadline);
       if (resp == 0) {
          log_packet("TAGMcontroller::reset response error:"
                     " no packets received within timeout!", 0, packet);
          break;
       }
       else if (resp < 0) {
-         char errmsg[99];
-         sprintf(errmsg, "TAGMcontroller::reset error: "
-                         "failure receiving response from Vbias board: %s\n",
-                 pcap_geterr(fEthernet_fp));
+         char errmsg[384];
+         snprintf(errmsg, sizeof(errmsg),
+                  "TAGMcontroller::reset error: "
+                  "failure receiving response from Vbias board: %s\n",
+                  fSession->transport->geterr());
          log_packet(errmsg, 0, packet);
          throw std::runtime_error(errmsg);
       }
@@ -699,14 +1824,7 @@ bool TAGMcontroller::reset()
          log_packet("TAGMcontroller::reset received expected response:",
                     packet_data, packet);
       }
-      int packet_len = packet_data[13] + 14;
-      for (int i=0; i < packet_len; ++i)
-         fLastPacket[i] = packet_data[i];
-      for (int i=0; i < 17; ++i) {
-         unsigned int byte1 = (unsigned int)packet_data[2*i+16];
-         unsigned int byte2 = (unsigned int)packet_data[2*i+17];
-         fLastStatus[i] = (byte1 << 8) + byte2;
-      }
+      accept_response(packet_data, t_sent);
       break;
    }
 
@@ -728,84 +1846,54 @@ int TAGMcontroller::fetch_status()
 {
    // send a Q-packet, receive an S-packet from board
 
-   open_network_device(STATUS_TIMEOUT_MS / 100);
+   std::lock_guard<std::recursive_mutex> exchange(fExchange);
 
    // flush any pending packets from the input buffer
-   char errbuf[PCAP_ERRBUF_SIZE];
-   pcap_setnonblock(fEthernet_fp, 1, errbuf);
-   u_char user[] = "Q";
-   int pcnt = pcap_dispatch(fEthernet_fp, -1, &packet_reader, user);
-   pcap_setnonblock(fEthernet_fp, 0, errbuf);
+   int pcnt = flush_packets('Q');
    if (pcnt > 0)
-      std::cerr << "status saw " << pcnt << " unrequested packets"
-                << std::endl;
+      warn_unexpected("status", pcnt);
    
    // send out a Q-packet
    unsigned char packet[64];
-   for (int i=0; i < 6; i++) {
-      packet[i] = fDestMACaddr[i];
-      packet[i+6] = fSrcMACaddr[i];
-   }
-   packet[12] = 0;
-   packet[13] = 50;
-   packet[14] = fGeoaddr;
-   packet[15] = 'Q';
-   for (int i=16; i < 64; ++i) {
-      packet[i] = 0;
-   }
+   format_request(packet, 'Q');
    for (int retry=0; retry < RETRY_COUNT; ++retry) {
       log_packet("TAGMcontroller::fetch_status sends request packet:", packet);
       if (PRESEND_DELAY_US > 0)
          usleep(PRESEND_DELAY_US);
-      if (pcap_sendpacket(fEthernet_fp, packet, 64) != 0) {
-         char errmsg[99];
-         sprintf(errmsg, "TAGMcontroller::fetch_status error: "
-                         "failure transmitting Q-packet, %s\n",
-                 pcap_geterr(fEthernet_fp));
+      std::unique_lock<std::mutex> lock(fSession->lock);
+      if (fSession->transport->send(packet, 64) != 0) {
+         char errmsg[384];
+         snprintf(errmsg, sizeof(errmsg),
+                  "TAGMcontroller::fetch_status error: "
+                  "failure transmitting Q-packet, %s\n",
+                  fSession->transport->geterr());
          log_packet(errmsg, 0, packet);
          throw std::runtime_error(errmsg);
       }
+      lock.unlock();
  
       // wait for the response S-packet
+      double t_sent = TAGMtransport::monotonic_clock();
+      double deadline = t_sent + STATUS_TIMEOUT_MS * 1e-3;
+      const unsigned char *packet_data = 0;
       for (int pcnt=0; pcnt < 999; ++pcnt) {
-         pcap_pkthdr *packet_header;
-         const unsigned char *packet_data;
          if (pcnt > 0) {
-            std::cerr << "status saw " << pcnt 
-                      << " unexpected response packets, header bytes follow:"
-                      << std::endl;
-            for (int n=0; n < 16; ++n) {
-               char str[4];
-               sprintf(str, "%2.2x ", (unsigned int)packet_data[n]);
-               std::cerr << str;
-            }
-            std::cerr << std::endl;
+            warn_unexpected("status", pcnt, packet_data);
             log_packet("TAGMcontroller::fetch_status error:"
                        " saw unexpected response packet:", packet_data, packet);
          }
-         pcap_setnonblock(fEthernet_fp, 1, errbuf);
-         int resp = pcap_next_ex(fEthernet_fp, &packet_header, &packet_data);
-         for (int t_ms=1; resp == 0 && t_ms < STATUS_TIMEOUT_MS; t_ms *= 2) {
-            fd_set readfds;
-            FD_ZERO(&readfds);
-            FD_SET(pcap_get_selectable_fd(fEthernet_fp), &readfds);
-            struct timeval timeout;
-            timeout.tv_sec = t_ms / 1000;
-            timeout.tv_usec = 1000 * (t_ms % 1000);
-            select(1, &readfds, 0, 0, &timeout);
-            resp = pcap_next_ex(fEthernet_fp, &packet_header, &packet_data);
-         }
-         pcap_setnonblock(fEthernet_fp, 0, errbuf);
+         int resp = next_packet(&packet_data, deadline);
          if (resp == 0) {
             log_packet("TAGMcontroller::fetch_status response error:"
                        " no packets received within timeout", 0, packet);
             break;
          }
          else if (resp < 0) {
-            char errmsg[99];
-            sprintf(errmsg, "TAGMcontroller::fetch_status error: "
-                            "failure receiving response from Vbias board, %s\n",
-                    pcap_geterr(fEthernet_fp));
+            char errmsg[384];
+            snprintf(errmsg, sizeof(errmsg),
+                     "TAGMcontroller::fetch_status error: "
+                     "failure receiving response from Vbias board, %s\n",
+                     fSession->transport->geterr());
             throw std::runtime_error(errmsg);
          }
          if (packet_data[15] != 'S') {
@@ -836,179 +1924,743 @@ int TAGMcontroller::fetch_status()
             log_packet("TAGMcontroller::fetch_status received expected response:",
                        packet_data, packet);
          }
-         int packet_len = packet_data[13] + 14;
-         for (int i=0; i < packet_len; ++i)
-            fLastPacket[i] = packet_data[i];
-         for (int i=0; i < 17; ++i) {
-            unsigned int byte1 = (unsigned int)packet_data[2*i+16];
-            unsigned int byte2 = (unsigned int)packet_data[2*i+17];
-            fLastStatus[i] = (byte1 << 8) + byte2;
-         }
+         accept_response(packet_data, t_sent);
          return 0;
       }
    }
    return -1;
 }
 
-void TAGMcontroller::packet_reader(unsigned char *user,
-                                   const struct pcap_pkthdr *h,
-                                   const u_char *bytes)
+std::future<int> TAGMcontroller::fetch_status_async(async_callback done)
 {
-   std::stringstream msg;
-   msg << "TAGMcontroller::packet_reader received unexpected packet,"
-       << " while setting up to send a " << user[0] << " packet request";
-   log_packet(msg.str(), bytes);
+   // start a fetch_status() exchange in the I/O thread
+
+   async_job *job = new async_job;
+   job->kind = async_job::kFetchStatus;
+   job->mask = 0;
+   job->done = done;
+   return submit_async(job);
 }
 
-void TAGMcontroller::log_packet(std::string msg, 
-                                const unsigned char *packet,
-                                const unsigned char *refpacket)
+std::future<int> TAGMcontroller::fetch_voltages_async(async_callback done)
 {
-   if (!logfile) {
-      logfile.open("/tmp/TAGMcontroller.log", std::ios_base::app);
-      if (!logfile) {
-         char errmsg[99];
-         sprintf(errmsg, "TAGMcontroller::log_packet error:"
-                         "cannot open logfile /tmp/TAGMcontroller.log");
-         throw std::runtime_error(errmsg);
+   // start a fetch_voltages() exchange in the I/O thread
+
+   async_job *job = new async_job;
+   job->kind = async_job::kFetchVoltages;
+   job->mask = 0;
+   job->done = done;
+   return submit_async(job);
+}
+
+std::future<int> TAGMcontroller::set_voltages_async(unsigned int mask,
+                                                    const unsigned int values[32],
+                                                    async_callback done)
+{
+   // start setting the DAC values of the channels in mask in the I/O
+   // thread, in a single step without ramping, checking the read-back
+
+   async_job *job = new async_job;
+   job->kind = async_job::kSetVoltages;
+   job->mask = mask;
+   for (int chan=0; chan < 32; ++chan)
+      job->values[chan] = values[chan];
+   job->done = done;
+   return submit_async(job);
+}
+
+std::future<int> TAGMcontroller::ramp_async(async_callback done)
+{
+   // start a ramp() to the new voltages in the I/O thread, with the
+   // targets taken from the setV() calls made before this one
+
+   async_job *job = new async_job;
+   job->kind = async_job::kRamp;
+   std::unique_lock<std::recursive_mutex> exchange(fExchange);
+   job->mask = fNextMask;
+   for (int chan=0; chan < 32; ++chan)
+      job->values[chan] = fNextVoltages[chan];
+   exchange.unlock();
+   job->done = done;
+   return submit_async(job);
+}
+
+std::future<int> TAGMcontroller::reset_async(async_callback done)
+{
+   // start a reset() of the board in the I/O thread
+
+   async_job *job = new async_job;
+   job->kind = async_job::kReset;
+   job->mask = 0;
+   job->done = done;
+   return submit_async(job);
+}
+
+std::future<int> TAGMcontroller::submit_async(async_job *job)
+{
+   // Queue up a request for the I/O thread, starting the thread
+   // if this is the first request since the program started. Each
+   // board works through its own requests in order, while those to
+   // different boards are all in flight at the same time. The future
+   // gets the result, and the done callback, if any, is invoked with
+   // it on the I/O thread as soon as it is known. While the board has
+   // requests in flight its blocking exchanges throw, and it must not
+   // be deleted by one thread while another is submitting to it.
+
+   job->board = this;
+   job->stage = -1;
+   job->retries = 0;
+   job->mismatches = 0;
+   job->sent = 0;
+   job->finished = false;
+   job->result = 0;
+   std::future<int> result = job->promise.get_future();
+   // a blocking exchange underway on another thread is let finish
+   // before the request is queued, see flush_packets()
+   std::lock_guard<std::recursive_mutex> exchange(fExchange);
+   std::unique_lock<std::mutex> lock(fAsync.mutex);
+   if (! fAsync.thread.joinable())
+      fAsync.thread = std::thread(async_main);
+   fAsync.submitted.push_back(job);
+   fAsync.wakeup.notify_one();
+   return result;
+}
+
+bool TAGMcontroller::async_pending()
+{
+   // Tell if this board has async requests that are not yet finished.
+
+   std::lock_guard<std::mutex> lock(fAsync.mutex);
+   std::map<TAGMcontroller*, std::deque<async_job*> >::iterator iter;
+   iter = fAsync.boards.find(this);
+   if (iter != fAsync.boards.end()) {
+      for (unsigned int i=0; i < iter->second.size(); ++i) {
+         if (! iter->second[i]->finished)
+            return true;
       }
    }
-   logfile.seekp(0, std::ios_base::end);
-   long int len = logfile.tellp();
-   if (len > max_logfile_size) {
-      logfile.close();
-      rename("/tmp/TAGMcontroller.log", "/tmp/TAGMcontroller.log.old");
-      return log_packet(msg, packet, refpacket);
+   for (unsigned int i=0; i < fAsync.submitted.size(); ++i) {
+      if (fAsync.submitted[i]->board == this)
+         return true;
    }
+   return false;
+}
 
-   time_t rawtime;
-   struct tm * timeinfo;
-   char timebuffer[80];
-   time(&rawtime);
-   timeinfo = localtime(&rawtime);
-   strftime(timebuffer, sizeof(timebuffer),"%d-%m-%Y %H:%M:%S", timeinfo);
-   std::string timestr(timebuffer);
-   if (packet == 0) {
-      logfile << timestr << " " << msg << std::endl;
-      return;
+void TAGMcontroller::cancel_async()
+{
+   // Withdraw all async requests for this board, before it goes away.
+
+   std::vector<async_job*> cancelled;
+   std::unique_lock<std::mutex> lock(fAsync.mutex);
+   std::deque<async_job*>::iterator iter = fAsync.submitted.begin();
+   while (iter != fAsync.submitted.end()) {
+      if ((*iter)->board == this) {
+         cancelled.push_back(*iter);
+         iter = fAsync.submitted.erase(iter);
+      }
+      else {
+         ++iter;
+      }
    }
+   if (fAsync.boards.find(this) != fAsync.boards.end()) {
+      std::deque<async_job*> &queue = fAsync.boards[this];
+      cancelled.insert(cancelled.end(), queue.begin(), queue.end());
+      fAsync.boards.erase(this);
+   }
+   lock.unlock();
 
-   int geoaddr = packet[14];
-   char destaddr[30];
-   char srcaddr[30];
-   if (geoaddr == 0xff) {
-      sprintf(destaddr, "0xff (broadcast)");
-      sprintf(srcaddr, "0x?? (%02x:%02x:%02x:%02x:%02x:%02x)",
-              packet[6], packet[7], packet[8],
-              packet[9], packet[10], packet[11]);
+   for (unsigned int i=0; i < cancelled.size(); ++i) {
+      async_job *job = cancelled[i];
+      if (job->done)
+         job->done(-1);
+      job->promise.set_exception(std::make_exception_ptr(
+         std::runtime_error("TAGMcontroller::cancel_async error: "
+                            "board deleted with async requests pending")));
+      delete job;
    }
-   else {
-      sprintf(destaddr, "0x%02x (%02x:%02x:%02x:%02x:%02x:%02x)",
-              geoaddr, packet[0], packet[1], packet[2],
-              packet[3], packet[4], packet[5]);
-      sprintf(srcaddr, "0x%02x (%02x:%02x:%02x:%02x:%02x:%02x)",
-              geoaddr, packet[6], packet[7], packet[8],
-              packet[9], packet[10], packet[11]);
-   }
-   if (packet) {
-      char type = packet[15];
-      if (type == 'R') {
-         logfile << timestr << " " << msg << std::endl
-                 << "  request packet type R (hard reset)"
-                 << " to card " << destaddr << std::endl;
-      }
-      else if (type == 0xd5) {
-         logfile << timestr << " " << msg << std::endl
-                 << "  request packet type R' (soft reset)"
-                 << " to card " << destaddr << std::endl;
-      }
-      else if (type == 'Q') {
-         logfile << timestr << " " << msg << std::endl
-                 << "  request packet type Q (card state)"
-                 << " to card " << destaddr << std::endl;
-      }
-      else if (type == 'S') {
-         logfile << timestr << " " << msg << std::endl
-                 << "  response packet type S (card state)"
-                 << " from card " << srcaddr << std::endl;
-         int tempval = (packet[16] << 8) + packet[17];
-         double tempC = tempval * 0.25;
-         logfile << "    temperature = " << tempC << " C" << std::endl;
-         for (int i=0; i < 16; ++i) {
-            char a[30];
-            sprintf(a, "    adc[%x]=0x%03x", i,
-                         packet[19 + i*2] + (packet[18 + i*2] & 0xf));
-            logfile << a;
-            if (i % 4 == 3)
-               logfile << std::endl;
-         }
-      }
-      else if (type == 'P') {
-         logfile << timestr << " " << msg << std::endl
-                 << "  request packet type P (set/get Vbias values)"
-                 << " to card " << destaddr << std::endl;
-         long int mask = packet[16] + (packet[17] << 8) +
-                         (packet[18] << 16) + (packet[19] << 24);
-         int n=0;
-         std::stringstream updates;
-         for (int i=0; i < 32; ++i) {
-            if (mask & (1 << i)) {
-               char a[30];
-               sprintf(a, "    V[%02x]=0x%04x", i,
-                       (packet[20 +i*2] << 8) + packet[21 + i*2]);
-               updates << a;
-               if (n % 4 == 3)
-                  updates << std::endl;
-               ++n;
-            }
-         }
-         logfile << "    " << n << " updated values requested" << std::endl;
-         if (n > 0) {
-            logfile << updates.str();
-            if (n % 4 != 0)
-               logfile << std::endl;
-         }
-      }
-      else if (type == 'D') {
-         logfile << timestr << " " << msg << std::endl
-                 << "  response packet type D (Vbias readback)"
-                 << " from card " << srcaddr;
-         long int mask = 0;
-         if (refpacket) {
-            mask = refpacket[16] + (refpacket[17] << 8) +
-                   (refpacket[18] << 16) + (refpacket[19] << 24);
-            char a[30];
-            sprintf(a, ", using write mask 0x%08x", (unsigned int)mask);
-            logfile << a;
-         }
-         logfile << std::endl;
-         for (int i=0; i < 32; ++i) {
-            char a[30];
-            unsigned int V = (packet[16 +i*2] << 8) + packet[17 + i*2];
-            sprintf(a, "    V[%02x]=0x%04x", i, V);
-            logfile << a;
-            if (refpacket) {
-               int Vref = (refpacket[20 +i*2] << 8) + refpacket[21 + i*2];
-               if (mask & (1 << i)) {
-                  if (V == Vref)
-                     logfile << "(good)";
-                  else
-                     logfile << "(BAD!)";
+}
+
+void TAGMcontroller::async_main()
+{
+   // Body of the I/O thread. Each pass starts the next request of every
+   // board that is idle, sends out the requests that are ready, listens
+   // a short while for responses, handing each one to the request that
+   // it answers, and retries the exchanges that have timed out. The
+   // pass is kept short so that new requests do not wait long to go out.
+
+   std::unique_lock<std::mutex> lock(fAsync.mutex);
+   while (! fAsync.stopping) {
+      while (fAsync.submitted.size() > 0) {
+         async_job *job = fAsync.submitted.front();
+         fAsync.boards[job->board].push_back(job);
+         fAsync.submitted.pop_front();
+      }
+      if (fAsync.boards.size() == 0) {
+         fAsync.wakeup.wait(lock);
+         continue;
+      }
+
+      double now = TAGMtransport::monotonic_clock();
+      double next_event = now + ASYNC_POLL_MS * 1e-3;
+      std::vector<async_job*> outgoing;
+      std::map<TAGMcontroller*, std::deque<async_job*> >::iterator iter;
+      for (iter = fAsync.boards.begin(); iter != fAsync.boards.end(); ++iter) {
+         async_job *job = iter->second.front();
+         if (job->stage < 0)
+            async_step(job, 0);
+         else if (job->sent > 0 && job->sent + job->timeout < now)
+            async_retry(job, "no response received within timeout");
+         if (job->finished)
+            continue;
+         else if (job->sent > 0)
+            next_event = std::min(next_event, job->sent + job->timeout);
+         else if (job->ready <= now)
+            outgoing.push_back(job);
+         else
+            next_event = std::min(next_event, job->ready);
+      }
+      if (outgoing.size() > 0)
+         async_send(outgoing);
+
+      // listen on every network device with an exchange in flight,
+      // only the last one is allowed to block until next_event
+      std::set<ethernet_session*> listening;
+      for (iter = fAsync.boards.begin(); iter != fAsync.boards.end(); ++iter) {
+         async_job *job = iter->second.front();
+         if (! job->finished && job->sent > 0)
+            listening.insert(job->board->fSession);
+      }
+      std::set<ethernet_session*>::iterator siter = listening.begin();
+      for (; siter != listening.end(); ++siter) {
+         bool last = (listening.size() == 1 || *siter == *listening.rbegin());
+         async_receive(*siter, (last && fAsync.finished.size() == 0)?
+                                next_event : 0);
+      }
+      if (listening.size() == 0 && fAsync.finished.size() == 0) {
+         double wait_s = next_event - TAGMtransport::monotonic_clock();
+         if (wait_s > 0)
+            fAsync.wakeup.wait_for(lock, std::chrono::duration<double>(wait_s));
+      }
+
+      // retire the requests that finished, and report their results
+      // with the lock released, in case the callbacks submit more
+      iter = fAsync.boards.begin();
+      while (iter != fAsync.boards.end()) {
+         while (iter->second.size() > 0 && iter->second.front()->finished)
+            iter->second.pop_front();
+         if (iter->second.size() == 0)
+            fAsync.boards.erase(iter++);
+         else
+            ++iter;
+      }
+      if (fAsync.finished.size() > 0) {
+         std::vector<async_job*> finished;
+         finished.swap(fAsync.finished);
+         lock.unlock();
+         for (unsigned int i=0; i < finished.size(); ++i) {
+            async_job *job = finished[i];
+            if (job->done) {
+               try {
+                  job->done(job->result);
+               }
+               catch (...) {
+                  log_packet("TAGMcontroller::async_main error: "
+                             "exception thrown by completion callback");
                }
             }
-            if (i % 4 == 3)
-               logfile << std::endl;
+            if (job->error)
+               job->promise.set_exception(job->error);
+            else
+               job->promise.set_value(job->result);
+            delete job;
+         }
+         lock.lock();
+      }
+   }
+}
+
+void TAGMcontroller::async_send(std::vector<async_job*> &jobs)
+{
+   // Transmit the requests of all of the jobs, handing those that
+   // share a network device to the kernel all at once.
+
+   std::map<ethernet_session*, std::vector<async_job*> > batches;
+   for (unsigned int j=0; j < jobs.size(); ++j)
+      batches[jobs[j]->board->fSession].push_back(jobs[j]);
+   std::map<ethernet_session*, std::vector<async_job*> >::iterator iter;
+   for (iter = batches.begin(); iter != batches.end(); ++iter) {
+      std::vector<async_job*> &batch = iter->second;
+      int count = batch.size();
+      const unsigned char *frames[count];
+      int lens[count];
+      for (int j=0; j < count; ++j) {
+         frames[j] = batch[j]->request;
+         lens[j] = (batch[j]->request[15] == 'P')? 84 : 64;
+         log_packet("TAGMcontroller::async_send sends request packet:",
+                    batch[j]->request);
+      }
+      std::lock_guard<std::mutex> lock(iter->first->lock);
+      if (iter->first->transport->send(frames, lens, count) != 0) {
+         char errmsg[384];
+         snprintf(errmsg, sizeof(errmsg),
+                  "TAGMcontroller::async_send error: "
+                  "request transmit failed, %s\n",
+                  iter->first->transport->geterr());
+         log_packet(errmsg, 0, frames[0]);
+         for (int j=0; j < count; ++j) {
+            batch[j]->error = std::make_exception_ptr(std::runtime_error(errmsg));
+            async_finish(batch[j], -1);
+         }
+         continue;
+      }
+      double t_sent = TAGMtransport::monotonic_clock();
+      for (int j=0; j < count; ++j)
+         batch[j]->sent = t_sent;
+   }
+}
+
+void TAGMcontroller::async_receive(ethernet_session *session, double deadline)
+{
+   // Wait until deadline for packets to arrive on the network device,
+   // then take in all that are waiting and pass each one to the request
+   // in flight that it answers. Packets from boards without any request
+   // in flight go to their mailboxes, as in next_packet().
+
+   std::lock_guard<std::mutex> lock(session->lock);
+
+   // responses picked up off the capture handle by blocking calls to
+   // other boards on the device wait in the mailbox of their sender
+   std::map<TAGMcontroller*, std::deque<async_job*> >::iterator iter;
+   for (iter = fAsync.boards.begin(); iter != fAsync.boards.end(); ++iter) {
+      async_job *job = iter->second.front();
+      TAGMcontroller *board = job->board;
+      const int slots = sizeof(board->fMailbox) / sizeof(mail);
+      while (board->fSession == session && board->fMailCount > 0) {
+         mail &slot = board->fMailbox[board->fMailFirst];
+         memcpy(board->fMailPacket, slot.packet, slot.len);
+         double rx_time = slot.rx_time;
+         board->fMailFirst = (board->fMailFirst + 1) % slots;
+         board->fMailCount--;
+         if (job->finished || job->sent == 0) {
+            log_packet("TAGMcontroller::async_receive discards"
+                       " unrequested packet:", board->fMailPacket);
+            continue;
          }
+         async_accept(job, board->fMailPacket, rx_time);
+         deadline = 0;
+      }
+   }
+
+   const unsigned char *packet_data;
+   int len;
+   int resp;
+   while ((resp = session->transport->receive(&packet_data, &len, deadline)) > 0) {
+      deadline = 0;
+      if (len < 16)
+         continue;
+      async_job *job = 0;
+      std::string key((const char*)packet_data + 6, 6);
+      std::map<std::string, TAGMcontroller*>::iterator owner;
+      owner = session->boards.find(key);
+      if (owner != session->boards.end()) {
+         iter = fAsync.boards.find(owner->second);
+         if (iter != fAsync.boards.end())
+            job = iter->second.front();
       }
       else {
-         logfile << "  unrecognized packet received from " << srcaddr
-                 << " to " << destaddr << std::endl;
-         for (int i=0; i < 8; ++i) {
-            char a[30];
-            sprintf(a, "    0x04%x", packet[12 + i]);
-            logfile << a;
+         // maybe the answer to a request from a board addressed by broadcast
+         for (iter = fAsync.boards.begin(); iter != fAsync.boards.end(); ++iter) {
+            TAGMcontroller *board = iter->second.front()->board;
+            bool broadcast = (board->fSession == session);
+            for (int i=0; i < 6; ++i) {
+               if (board->fDestMACaddr[i] != 0xff)
+                  broadcast = false;
+            }
+            if (broadcast && (board->fGeoaddr == 0xff ||
+                              board->fGeoaddr == packet_data[14]))
+            {
+               job = iter->second.front();
+               break;
+            }
+         }
+      }
+      if (job == 0 || job->finished || job->sent == 0) {
+         if (! route_packet(session, 0, packet_data, len))
+            log_packet("TAGMcontroller::async_receive discards"
+                       " unrequested packet:", packet_data);
+         continue;
+      }
+      async_accept(job, packet_data, session->transport->get_rx_time());
+   }
+   if (resp < 0) {
+      char errmsg[384];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMcontroller::async_receive error: "
+               "failure receiving response from Vbias board, %s\n",
+               session->transport->geterr());
+      log_packet(errmsg);
+      for (iter = fAsync.boards.begin(); iter != fAsync.boards.end(); ++iter) {
+         async_job *job = iter->second.front();
+         if (job->board->fSession == session && job->sent > 0 &&
+             ! job->finished)
+         {
+            job->error = std::make_exception_ptr(std::runtime_error(errmsg));
+            async_finish(job, -1);
+         }
+      }
+   }
+}
+
+void TAGMcontroller::async_accept(async_job *job,
+                                  const unsigned char *packet_data,
+                                  double rx_time)
+{
+   // Move the job on with packet_data if it is the response that the
+   // job is waiting for, otherwise log it and leave the job waiting.
+
+   char expected = (job->request[15] == 'P')? 'D' : 'S';
+   if (packet_data[15] != expected ||
+       (job->board->fGeoaddr != 0xff &&
+        packet_data[14] != job->board->fGeoaddr))
+   {
+      log_packet("TAGMcontroller::async_receive error:"
+                 " saw unexpected response packet:",
+                 packet_data, job->request);
+      return;
+   }
+   log_packet("TAGMcontroller::async_receive received expected"
+              " response:", packet_data, job->request);
+   job->board->fPacketRxTime = rx_time;
+   async_step(job, packet_data);
+}
+
+void TAGMcontroller::async_step(async_job *job,
+                                const unsigned char *packet_data)
+{
+   // Move a request on to its next exchange with the board, given the
+   // response to the present one, or start it if packet_data is null.
+
+   TAGMcontroller *board = job->board;
+   if (packet_data == 0) {
+      job->stage = 0;
+      job->step_mask = 0;
+      if (job->kind == async_job::kFetchStatus)
+         async_exchange(job, 'Q');
+      else if (job->kind == async_job::kSetVoltages)
+         async_exchange(job, 'P', job->mask, job->values);
+      else if (job->kind == async_job::kReset)
+         async_exchange(job, 'R');
+      else if (job->kind == async_job::kRamp && job->mask == 0)
+         async_finish(job, 0);
+      else
+         async_exchange(job, 'P', 0, board->fLastVoltages);
+      return;
+   }
+
+   // verify the values sent back against those requested
+   if (packet_data[15] == 'D') {
+      const unsigned char *packet = job->request;
+      unsigned int mask = packet[16] + (packet[17] << 8) +
+                          (packet[18] << 16) + (packet[19] << 24);
+      unsigned int mismatch = 0;
+      unsigned int values[32];
+      for (int i=0; i < 32; ++i) {
+         values[i] = (packet[20 + 2*i] << 8) + packet[21 + 2*i];
+         if ((mask & (1 << i)) == 0)
+            continue;
+         if (packet_data[16 + 2*i] != packet[20 + 2*i] ||
+             packet_data[17 + 2*i] != packet[21 + 2*i])
+         {
+            mismatch |= (1 << i);
+            ++board->fChannelRetries[i];
          }
-         logfile << std::endl;
       }
+      if (mismatch != 0) {
+         log_packet("TAGMcontroller::async_step error: mismatch between"
+                    " expected and readback voltages:", packet_data, packet);
+         if (++job->mismatches > MISMATCH_RETRY_COUNT) {
+            job->error = std::make_exception_ptr(std::runtime_error(
+                         "TAGMcontroller::async_step error: mismatch "
+                         "between Vbias values requested and read back!"));
+            if (job->kind == async_job::kReset) {
+               async_finish(job, -1);
+            }
+            else {
+               // reset the card before giving up, as set_voltages()
+               // does, the job fails with the error once it is done
+               job->kind = async_job::kReset;
+               job->stage = 0;
+               job->mismatches = 0;
+               async_exchange(job, 'R');
+            }
+         }
+         else {
+            async_exchange(job, 'P', mismatch, values);
+         }
+         return;
+      }
+   }
+   board->accept_response(packet_data, job->sent);
+   job->sent = 0;
+   job->mismatches = 0;
+   job->stage++;
+
+   if (job->kind == async_job::kRamp) {
+      // the ramp keeps its own account of the levels it has set, so
+      // that a bad read-back of some channel outside the step cannot
+      // throw off the next step for that channel; the whole step is
+      // applied, not just the channels of the last mismatch resend
+      for (int chan=0; chan < 32; ++chan) {
+         if (job->stage == 1)
+            job->levels[chan] = board->fLastVoltages[chan];
+         else if (job->step_mask & (1 << chan))
+            job->levels[chan] = job->step_values[chan];
+      }
+      if (job->stage == 1)
+         job->pacer.init();
+      unsigned int next_mask;
+      unsigned int next_values[32];
+      double t_send;
+      do {
+         double now = TAGMtransport::monotonic_clock();
+         t_send = job->pacer.next_step(now + PRESEND_DELAY_US * 1e-6);
+         job->pacer.take_step(t_send);
+         next_mask = job->pacer.step(job->levels, job->values, job->mask,
+                                     next_values);
+      } while (next_mask == 0 && job->pacer.pending != 0);
+      if (next_mask == 0) {
+         async_finish(job, 0);
+      }
+      else {
+         async_exchange(job, 'P', next_mask, next_values);
+         job->ready = t_send;
+         job->step_mask = next_mask;
+         for (int chan=0; chan < 32; ++chan)
+            job->step_values[chan] = next_values[chan];
+      }
+   }
+   else if (job->kind == async_job::kReset && job->stage == 1) {
+      // If the host is outside the ethernet broadcast domain of the board
+      // then the S-packet from the reset is not seen, see reset().
+      async_exchange(job, 'Q');
+   }
+   else if (job->kind == async_job::kReset && job->stage == 2) {
+      unsigned int zeros[32];
+      for (int i=0; i < 32; i++)
+         zeros[i] = 0;
+      async_exchange(job, 'P', 0xffffffff, zeros);
+   }
+   else {
+      async_finish(job, 0);
+   }
+}
+
+void TAGMcontroller::async_exchange(async_job *job, char reqtype,
+                                    unsigned int mask,
+                                    const unsigned int *values)
+{
+   // set up the next request packet of the job, to go out after the
+   // same delay that the blocking methods wait before sending
+
+   job->board->format_request(job->request, reqtype, mask, values);
+   job->timeout = ((reqtype == 'Q')? STATUS_TIMEOUT_MS :
+                   (reqtype == 'R')? RESET_TIMEOUT_MS :
+                                     READ_TIMEOUT_MS) * 1e-3;
+   job->retries = 0;
+   job->sent = 0;
+   job->ready = TAGMtransport::monotonic_clock() + PRESEND_DELAY_US * 1e-6;
+}
+
+void TAGMcontroller::async_retry(async_job *job, const char *reason)
+{
+   // Repeat the present exchange of the job after it failed, up to
+   // RETRY_COUNT times in all. The reset itself is not repeated, any
+   // failure to see its response is caught by the status query that
+   // comes after it, as in reset().
+
+   char msg[150];
+   snprintf(msg, sizeof(msg), "TAGMcontroller::async_retry error: %s,"
+            " retry count is %d", reason, job->retries);
+   log_packet(msg, 0, job->request);
+   if (job->kind == async_job::kReset && job->stage == 0) {
+      job->stage++;
+      async_exchange(job, 'Q');
+   }
+   else if (++job->retries < RETRY_COUNT) {
+      job->sent = 0;
+      job->ready = TAGMtransport::monotonic_clock() + PRESEND_DELAY_US * 1e-6;
+   }
+   else {
+      async_finish(job, -1);
+   }
+}
+
+void TAGMcontroller::async_finish(async_job *job, int result)
+{
+   // mark the job as done, to be reported at the end of this pass,
+   // a job that has an error to throw fails whatever the result
+
+   job->finished = true;
+   job->result = (job->error)? -1 : result;
+   job->sent = 0;
+   fAsync.finished.push_back(job);
+}
+
+void TAGMcontroller::packet_reader(unsigned char *user,
+                                   const unsigned char *bytes, int len)
+{
+   reader_context *context = (reader_context*)user;
+   ethernet_session *session = (ethernet_session*)context->session;
+   if (route_packet(session, context->receiver, bytes, len))
+      return;
+   char msg[120];
+   sprintf(msg, "TAGMcontroller::packet_reader received unexpected packet,"
+                " while setting up to send a %c packet request",
+           context->reqtype);
+   log_packet(msg, bytes);
+   context->count++;
+}
+
+bool TAGMcontroller::route_packet(ethernet_session *session,
+                                  TAGMcontroller *receiver,
+                                  const unsigned char *bytes, int len)
+{
+   // Deliver a packet that arrived on the shared capture handle to the
+   // mailbox of the board that sent it, unless that board is receiver.
+   // Returns true if the packet was routed to some other board, false
+   // if it is left for receiver (or nobody) to deal with.
+
+   if (len < 16)
+      return false;
+   if (receiver) {
+      bool broadcast = true;
+      for (int i=0; i < 6; ++i) {
+         if (receiver->fDestMACaddr[i] != 0xff)
+            broadcast = false;
+      }
+      if (broadcast || memcmp(bytes + 6, receiver->fDestMACaddr, 6) == 0)
+         return false;
    }
+   std::string key((const char*)bytes + 6, 6);  // short enough to stay off the heap
+   std::map<std::string, TAGMcontroller*>::iterator iter;
+   iter = session->boards.find(key);
+   if (iter == session->boards.end())
+      return false;
+   TAGMcontroller *owner = iter->second;
+   const int slots = sizeof(owner->fMailbox) / sizeof(mail);
+   if (owner->fMailCount == slots) {
+      log_packet("TAGMcontroller::route_packet discards oldest unclaimed"
+                 " packet, mailbox is full:",
+                 owner->fMailbox[owner->fMailFirst].packet);
+      owner->fMailFirst = (owner->fMailFirst + 1) % slots;
+      owner->fMailCount--;
+   }
+   mail &slot = owner->fMailbox[(owner->fMailFirst + owner->fMailCount) % slots];
+   slot.rx_time = session->transport->get_rx_time();
+   slot.len = (len < (int)sizeof(slot.packet))? len : sizeof(slot.packet);
+   memcpy(slot.packet, bytes, slot.len);
+   owner->fMailCount++;
+   return true;
+}
+
+int TAGMcontroller::flush_packets(char reqtype)
+{
+   // Discard any pending packets from this board before sending a new
+   // request, routing those from other boards to their own mailboxes.
+   // Returns the number of unrequested packets that were discarded.
+   // Every blocking exchange starts here, so this is also where one is
+   // refused while the I/O thread is talking to the board.
+
+   if (async_pending()) {
+      char errmsg[160];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMcontroller error: blocking %c-packet request to "
+               "Vbias board %2.2x while async requests to it are in "
+               "flight", reqtype, fGeoaddr);
+      throw std::runtime_error(errmsg);
+   }
+   std::lock_guard<std::mutex> lock(fSession->lock);
+   reader_context context = {fSession, this, reqtype, 0};
+   const int slots = sizeof(fMailbox) / sizeof(mail);
+   while (fMailCount > 0) {
+      char msg[120];
+      sprintf(msg, "TAGMcontroller::flush_packets discards unrequested packet,"
+                   " while setting up to send a %c packet request", reqtype);
+      log_packet(msg, fMailbox[fMailFirst].packet);
+      fMailFirst = (fMailFirst + 1) % slots;
+      fMailCount--;
+      context.count++;
+   }
+   const unsigned char *frame;
+   int frame_len;
+   while (fSession->transport->receive(&frame, &frame_len, 0) > 0)
+      packet_reader((unsigned char*)&context, frame, frame_len);
+   return context.count;
+}
+
+int TAGMcontroller::next_packet(const unsigned char **packet_data,
+                                double deadline)
+{
+   // Wait until deadline for the next packet from this board, taking it
+   // from the mailbox if another board already picked it up off the shared
+   // capture handle. Return value has the same meaning as for pcap_next_ex().
+   // Threads talking to other boards may be waiting on the same capture
+   // handle, so it is held for no more than RECEIVE_SLICE_MS at a time,
+   // and the packet is copied out before the handle is let go.
+
+   std::unique_lock<std::mutex> lock(fSession->lock);
+   while (true) {
+      if (fMailCount > 0) {
+         mail &slot = fMailbox[fMailFirst];
+         memcpy(fMailPacket, slot.packet, slot.len);
+         fPacketRxTime = slot.rx_time;
+         fMailFirst = (fMailFirst + 1) % (sizeof(fMailbox) / sizeof(mail));
+         fMailCount--;
+         *packet_data = fMailPacket;
+         return 1;
+      }
+
+      double slice = TAGMtransport::monotonic_clock() + RECEIVE_SLICE_MS * 1e-3;
+      slice = (slice < deadline)? slice : deadline;
+      const unsigned char *frame;
+      int len;
+      int resp = fSession->transport->receive(&frame, &len, slice);
+      if (resp < 0) {
+         return resp;
+      }
+      else if (resp > 0) {
+         if (route_packet(fSession, this, frame, len))
+            continue;
+         len = (len < (int)sizeof(fMailPacket))? len : sizeof(fMailPacket);
+         memcpy(fMailPacket, frame, len);
+         fPacketRxTime = fSession->transport->get_rx_time();
+         *packet_data = fMailPacket;
+         return 1;
+      }
+
+      // a timeout ahead of the slice means that nothing more is coming
+      double now = TAGMtransport::monotonic_clock();
+      if (now >= deadline || now < slice)
+         return 0;
+      lock.unlock();
+      std::this_thread::yield();
+      lock.lock();
+   }
+}
+
+void TAGMcontroller::log_packet(const char *msg,
+                                const unsigned char *packet,
+                                const unsigned char *refpacket)
+{
+   // Hand the packet over to the background logger, which only copies
+   // it here; formatting and file output happen on its own thread.
+
+   TAGMpacketlog::get_log()->post(msg, packet, refpacket);
+}
+
+void TAGMcontroller::log_packet(const std::string &msg,
+                                const unsigned char *packet,
+                                const unsigned char *refpacket)
+{
+   TAGMpacketlog::get_log()->post(msg.c_str(), packet, refpacket);
 }
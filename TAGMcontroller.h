@@ -5,13 +5,12 @@
 //          GlueX tagger microscope readout electronics
 //
 // All communication with the frontend Vbias boards is done using
-// raw ethernet packets over the specified interface. The boards
-// are identified by either their geographical address set by
-// jumpers on the readout backplane, or else by the MAC address
-// of the board itself.
-//
-// Requires the PCAP library for access to the ethernet
-// network transport layer.
+// raw ethernet packets over the specified interface, sent through a
+// TAGMtransport (see TAGMtransport.h). The boards are identified by
+// either their geographical address set by jumpers on the readout
+// backplane, or else by the MAC address of the board itself. Board
+// objects can be shared between threads, and requests can also be
+// started without waiting for them with the XXX_async() methods.
 //
 
 #ifndef TAGMCONTROLLER_H
@@ -19,26 +18,102 @@
 
 #define DEFAULT_NETWORK_DEVICE "em2"
 
-extern "C" {
-#include <pcap.h>
-}
-
 #include <map>
+#include <deque>
+#include <vector>
 #include <math.h>
 #include <iostream>
 #include <string>
+#include <future>
+#include <functional>
+#include <mutex>
+
+class TAGMtransport;
 
 class TAGMcontroller {
  public:
+   class StatusSnapshot {
+    // status readings decoded from a single S-packet from one board,
+    // converted to physical units once when the snapshot is made and
+    // never changed after that, so copies can be kept or handed over
+    // to another thread and read without any further conversions
+    public:
+      StatusSnapshot();
+      StatusSnapshot(const unsigned int status[17]);
+      StatusSnapshot(const unsigned char *packet);
+
+      unsigned char get_Geoaddr() const;         // backplane slot address of the board
+      const unsigned char *get_MACaddr() const;  // ethernet MAC address of the board
+      const unsigned int *get_status_words() const;  // the 17 raw status words sent by the board
+
+      double get_Tchip() const;         // board temperature from T sensor chip (C)
+      double get_pos5Vpower() const;    // +5V power level (V)
+      double get_neg5Vpower() const;    // -5V power level (V)
+      double get_pos3_3Vpower() const;  // +3.3V power level (V)
+      double get_pos1_2Vpower() const;  // +1.2V power level (V)
+      double get_Vsumref_1() const;     // SUMREF from preamp 1 (V)
+      double get_Vsumref_2() const;     // SUMREF from preamp 2 (V)
+      double get_Vgainmode() const;     // GAINMODE shared by both preamps (V)
+      int get_gainmode() const;         // =0 (low) or =1 (high) or =-1 (undefined)
+      double get_Vtherm_1() const;      // thermister voltage on preamp 1 (V)
+      double get_Vtherm_2() const;      // thermister voltage on preamp 2 (V)
+      double get_Tpreamp_1() const;     // thermister temperature on preamp 1 (C)
+      double get_Tpreamp_2() const;     // thermister temperature on preamp 2 (C)
+      double get_VDAChealth() const;    // DAC channel 31 read-back level (V)
+      double get_VDACdiode() const;     // DAC temperature diode voltage (V)
+      double get_TDAC() const;          // DAC internal temperature reading (C)
+
+    protected:
+      unsigned char fGeoaddr;
+      unsigned char fMACaddr[6];
+      unsigned int fStatus[17];
+      double fTchip;
+      double fPos5Vpower;
+      double fNeg5Vpower;
+      double fPos3_3Vpower;
+      double fPos1_2Vpower;
+      double fVsumref_1;
+      double fVsumref_2;
+      double fVgainmode;
+      int fGainmode;
+      double fVtherm_1;
+      double fVtherm_2;
+      double fTpreamp_1;
+      double fTpreamp_2;
+      double fVDAChealth;
+      double fVDACdiode;
+      double fTDAC;
+
+      void decode();
+      static double thermister_temperature(double Vtherm, double pos5V);
+   };
+
+   struct RampProfile {
+    // how fast the Vbias levels are moved by ramp() and ramp_all(), in
+    // steps of at most max_step; channels ramping down to 0V follow the
+    // rampdown profile instead, both default to 50 V/s in 0.1V steps,
+    // boards driven through a remote server use those of the server
+      double slew;         // rate of change of each channel (V/s)
+      double max_step;     // largest change of a channel in one step (V)
+      int max_moving;      // most channels on one board moving at once, 0 for no limit
+   };
+
    TAGMcontroller(unsigned char geoaddr, const char *netdev=0);
    TAGMcontroller(unsigned char MACaddr[6], const char *netdev=0);
    virtual ~TAGMcontroller();
 
    static std::map<unsigned char, std::string> probe(const char *netdev=0);  // retrieve a list of all Vbias boards that respond to a broadcast query
    static const std::string  get_hostMACaddr(const char *netdev=0);  // get the ethernet MAC address of host interface
+   static std::map<unsigned char, StatusSnapshot> snapshot_all(const char *netdev=0, int expected_count=0);  // status of all Vbias boards from one broadcast query
+   static void select_transport(const std::string &transport);  // "pcap" (default), "afpacket" or "loopback", for network devices opened after this call
+   static void set_ramp_profile(const RampProfile &profile);      // profile of ramps started after this call
+   static void set_rampdown_profile(const RampProfile &profile);  // profile for channels ramping down to 0V, in ramps started after this call
+   static RampProfile get_ramp_profile();       // profile of ramps, except channels going to 0V
+   static RampProfile get_rampdown_profile();   // profile for channels ramping down to 0V
    virtual const unsigned char get_Geoaddr();   // get the backplane slot address of this board
    virtual const unsigned char *get_MACaddr();  // get the ethernet MAC address of this board
 
+   virtual StatusSnapshot get_status();  // all status readings of the board, decoded from one S-packet
    virtual double get_Tchip();         // board temperature from T sensor chip (C)
    virtual double get_pos5Vpower();    // +5V power level (V)
    virtual double get_neg5Vpower();    // -5V power level (V)
@@ -64,60 +139,162 @@ class TAGMcontroller {
                                        // and return captured data in response to getV()
    virtual void passthru_voltages();   // reset saved voltages from last latch_voltages()
                                        // and have each getV() request fresh data from board
+   virtual void latch_readings();      // latch_status() and latch_voltages() together,
+                                       // in a single round trip to a remote server
+   virtual bool is_status_latched();   // true if a status reading is latched
+   virtual bool is_voltages_latched(); // true if a reading of the demand voltages is latched
 
    virtual double getV(unsigned int chan);          // voltage of channel reported by board (V)
-   virtual double getVnew(unsigned int chan);       // voltage of channel to be set in next ramp (V)
+   virtual double getVnew(unsigned int chan);       // voltage of channel to be set in next ramp (V), 0 if none was set
    virtual void setV(unsigned int chan, double V);  // assign voltage of channel to be set in next ramp (V)
-   virtual const unsigned char *get_last_packet();  // return a pointer to a read-only buffer containing the last packet received from the board
+   virtual void setV_many(unsigned int mask, const double V[32]);  // assign voltages of all channels in mask to be set in next ramp (V)
+   virtual const unsigned char *get_last_packet();  // return a pointer to a read-only buffer containing the last packet received from the board,
+                                                    // which can change while another thread talks to the board
+   int copy_last_packet(unsigned char packet[270]);  // copy out the last packet received from the board, return its length
+   virtual double get_last_rtt();                   // round-trip time of the last completed request/response exchange (s)
+   virtual double get_last_rx_time();               // time the last response from the board was received, on the monotonic clock (s)
+   virtual unsigned int get_channel_retries(unsigned int chan);  // times channel was resent after a read-back mismatch
+   virtual void clear_channel_retries();            // zero the read-back mismatch counts of all channels
 
    virtual bool ramp();                // push the new voltages to the board, if any
    virtual bool reset();               // send a hard reset to the board
 
+   static bool ramp_all(std::map<unsigned char, TAGMcontroller*> &boards,
+                        unsigned char *failed_geoaddr=0);  // ramp all boards in lockstep
+   static bool ramp_all_broadcast(std::map<unsigned char, TAGMcontroller*> &boards,
+                                  unsigned char *failed_geoaddr=0);  // same, with shared levels stepped by broadcast
+
+   typedef std::function<void(int)> async_callback;  // called with the result of an async request
+   virtual std::future<int> fetch_status_async(async_callback done=0);    // start fetch_status(), result 0 or -1
+   virtual std::future<int> fetch_voltages_async(async_callback done=0);  // start fetch_voltages(), result 0 or -1
+   virtual std::future<int> set_voltages_async(unsigned int mask,
+                                               const unsigned int values[32],
+                                               async_callback done=0);    // start setting DAC values in mask, result 0 or -1
+   virtual std::future<int> ramp_async(async_callback done=0);    // start ramp(), result 0 on success or -1
+   virtual std::future<int> reset_async(async_callback done=0);   // start reset(), result 0 on success or -1
+
  protected:
+   struct ethernet_session {
+      TAGMtransport *transport;    // capture handle shared by all boards on device
+      std::string device;          // name of network interface, eg. "eth0"
+      std::string hostMAC;         // ethernet MAC address of host interface
+      unsigned char hostMACaddr[6];  // same, parsed once when the session is opened
+      int refcount;                // number of open references to this session
+      std::map<std::string, TAGMcontroller*> boards;  // registered boards by MAC
+      std::mutex lock;             // guards transport, boards and the board mailboxes
+   };
+
    unsigned char fGeoaddr;
    unsigned char fSrcMACaddr[6];
    unsigned char fDestMACaddr[6];
-   unsigned int fLastStatus[17];
+   StatusSnapshot fLastStatus;
    unsigned int fLastVoltages[32];
    unsigned char fLastPacket[270];
-   std::map<unsigned int, unsigned int> fNextVoltages;
+   double fLastRTT;
+   double fLastRxTime;
+   unsigned int fNextVoltages[32];   // DAC values staged for the next ramp
+   unsigned int fNextMask;           // channels with a value staged in fNextVoltages
 
-   static std::map<unsigned char, std::string> probe(pcap_t *fp, std::string hostMAC);
+   static std::map<unsigned char, std::string> probe(ethernet_session *session);
+   static std::map<unsigned char, StatusSnapshot> snapshot_all(ethernet_session *session, int expected_count);
 
    int set_voltages(unsigned int mask, unsigned int values[32]);
+   void send_voltages(unsigned int mask, unsigned int values[32]);
+   void prepare_voltages(unsigned int mask, unsigned int values[32]);
+   int receive_voltages();
    int fetch_voltages();
    int fetch_status();
+   bool reset_card();
    bool fVoltages_latched;
    bool fStatus_latched;
 
    TAGMcontroller();               // stripped down protected constructor for derived classes
 
+   struct async_job;               // async request in the I/O thread, see TAGMcontroller.cc
+   struct ramp_pacer;              // steps a ramp at the rates of the ramp profiles, see TAGMcontroller.cc
+   void cancel_async();            // withdraw async requests before the board goes away
+   static double fDAC_Vref;        // Vref of DAC on frontend Vbias boards (V)
+
  private:
-   pcap_t *fEthernet_fp;           // pointer to ethernet file descriptor
-   std::string fEthernet_device;   // name of pcap interface, eg. "eth0"
-   int fEthernet_timeout;          // network response timeout (ms)
+   static std::map<std::string, ethernet_session*> fEthernet_sessions;
+   static std::mutex fEthernet_sessions_lock;  // guards fEthernet_sessions
+
+   std::recursive_mutex fExchange; // held by the thread talking to this board
+
+   ethernet_session *fSession;     // shared capture session on fEthernet_device
+   std::string fEthernet_device;   // name of network interface, eg. "eth0"
+   struct mail {
+      double rx_time;              // monotonic time the packet was received (s)
+      int len;                     // length of packet (bytes)
+      unsigned char packet[270];
+   };
+   mail fMailbox[16];              // ring of packets from this board routed here by others
+   int fMailFirst;                 // slot of the oldest packet in fMailbox
+   int fMailCount;                 // number of packets waiting in fMailbox
+   unsigned char fMailPacket[270]; // last packet taken out of fMailbox
+   unsigned char fQueryTemplate[64];  // Q-packet to this board, prebuilt by build_templates()
+   unsigned char fResetTemplate[64];  // R-packet to this board, prebuilt by build_templates()
+   unsigned char fPacketTemplate[20]; // header of P-packet to this board, prebuilt by build_templates()
+   double fPacketRxTime;           // monotonic time the packet last taken by next_packet() was received (s)
+   unsigned char fRequestPacket[84]; // last P-packet from prepare_voltages()
+   unsigned int fRequestMask;      // channel mask of fRequestPacket
+   unsigned int fRequestMismatch;  // channels whose read-back disagreed with fRequestPacket
+   unsigned int fChannelRetries[32]; // resends after read-back mismatch, by channel
+   bool fResetting;                // reset() is in progress
+   double fRequestSent;            // monotonic time fRequestPacket was sent (s)
    static double fADC_Vref;        // Vref of ADC on frontend Vbias boards (V)
-   static double fDAC_Vref;        // Vref of DAC on frontend Vbias boards (V)
    static double fDACdiode_Vf;     // Vf for DAC diode frontend Vbias boards (V)
    static double fDACdiode_Tref;   // Tref for DAC diode frontend Vbias boards (C)
    static double fDACdiode_Tcoef;  // Tcoef for DAC diode frontend Vbias boards (V/degC)
    static double fTcoef_therm[5];  // polynomial coefficients of thermister response
+   static RampProfile fRampProfile;      // profile of ramps, except channels going to 0V
+   static RampProfile fRampdownProfile;  // profile for channels ramping down to 0V
 
-   typedef void (*pcap_handler)(unsigned char *user, 
-                                const struct pcap_pkthdr *h,
-                                const u_char *bytes);
-   static void packet_reader(unsigned char *user,
-                             const struct pcap_pkthdr *h,
-                             const u_char *bytes);
-
-   void open_network_device(int timeout_ms);
-   void configure_network_filters();
+   static std::string fTransport;  // "pcap", "afpacket" or "loopback"
 
-   static void log_packet(std::string msg,
+   static void packet_reader(unsigned char *user,
+                             const unsigned char *bytes, int len);
+   static bool route_packet(ethernet_session *session,
+                            TAGMcontroller *receiver,
+                            const unsigned char *bytes, int len);
+   static void send_requests(TAGMcontroller *const boards[], int count);
+   static bool broadcast_census(std::vector<TAGMcontroller*> &group);
+
+   static ethernet_session *open_session(const std::string &netdev);
+   static void close_session(ethernet_session *session);
+
+   struct async_engine;
+   static async_engine fAsync;     // state of the I/O thread serving async requests
+
+   std::future<int> submit_async(async_job *job);
+   bool async_pending();
+   static void async_main();
+   static void async_send(std::vector<async_job*> &jobs);
+   static void async_receive(ethernet_session *session, double deadline);
+   static void async_accept(async_job *job, const unsigned char *packet_data,
+                            double rx_time);
+   static void async_step(async_job *job, const unsigned char *packet_data);
+   static void async_exchange(async_job *job, char reqtype,
+                              unsigned int mask=0,
+                              const unsigned int *values=0);
+   static void async_retry(async_job *job, const char *reason);
+   static void async_finish(async_job *job, int result);
+
+   void open_network_device();
+   void register_board();
+   void build_templates();
+   void format_request(unsigned char *packet, char reqtype,
+                       unsigned int mask=0, const unsigned int *values=0);
+   void accept_response(const unsigned char *packet_data, double t_sent);
+   int flush_packets(char reqtype);
+   int next_packet(const unsigned char **packet_data, double deadline);
+
+   static void log_packet(const char *msg,
+                          const unsigned char *packet=0,
+                          const unsigned char *refpacket=0);
+   static void log_packet(const std::string &msg,
                           const unsigned char *packet=0,
                           const unsigned char *refpacket=0);
-   static std::ofstream logfile;
-   static long int max_logfile_size;
 };
 
 inline const unsigned char TAGMcontroller::get_Geoaddr() {
@@ -128,145 +305,213 @@ inline const unsigned char *TAGMcontroller::get_MACaddr() {
    return fDestMACaddr;
 }
 
-inline double TAGMcontroller::get_Tchip() {         // board temperature from T sensor chip (C)
+inline TAGMcontroller::StatusSnapshot TAGMcontroller::get_status() {
+   // all status readings of the board, decoded from one S-packet
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
    if (! fStatus_latched)
       fetch_status();
-   return fLastStatus[0]*0.25;
+   return fLastStatus;
+}
+
+inline double TAGMcontroller::get_Tchip() {         // board temperature from T sensor chip (C)
+   return get_status().get_Tchip();
 }
 
 inline double TAGMcontroller::get_pos5Vpower() {    // +5V power level (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[3]*1.005 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_pos5Vpower();
 }
 
 inline double TAGMcontroller::get_neg5Vpower() {    // -5V power level (V)
-   double R1 = 100e3;
-   double R2 = 33.2e3;
-   double pos5V = get_pos5Vpower();
-   double Vlevel = fLastStatus[1]*1.001 * 2*fADC_Vref/(1 << 12);
-   return Vlevel*(R1+R2)/R2 - pos5V*R1/R2;
+   return get_status().get_neg5Vpower();
 }
 
 inline double TAGMcontroller::get_pos3_3Vpower() {  // +3.3V power level (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[2]*1.005 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_pos3_3Vpower();
 }
 
 inline double TAGMcontroller::get_pos1_2Vpower() {  // +1.2V power level (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[4]*1.005 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_pos1_2Vpower();
 }
 
 inline double TAGMcontroller::get_Vsumref_1() {     // SUMREF from preamp 1 (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[13]*1.005 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_Vsumref_1();
 }
 
 inline double TAGMcontroller::get_Vsumref_2() {     // SUMREF from preamp 2 (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[10]*1.005 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_Vsumref_2();
 }
 
 inline double TAGMcontroller::get_Vgainmode() {     // GAINMODE shared by both preamps (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[11]*2.018 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_Vgainmode();
 }
 
 inline int TAGMcontroller::get_gainmode() {         // =0 (low) or =1 (high) or -1 (undefined)
-   double Vgain = get_Vgainmode();
-   return (Vgain > 4.9 && Vgain < 5.1)? 0 :
-          (Vgain > 9.9 && Vgain < 10.1)? 1 : -1;
+   return get_status().get_gainmode();
 }
 
 inline double TAGMcontroller::get_Vtherm_1() {      // thermister voltage on preamp 1 (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[16]*1.005 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_Vtherm_1();
 }
 
 inline double TAGMcontroller::get_Vtherm_2() {      // thermister voltage on preamp 2 (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[12]*1.005 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_Vtherm_2();
 }
 
 inline double TAGMcontroller::get_Tpreamp_1() {     // thermister temperature on preamp 1 (C)
-   double Vtherm = get_Vtherm_1();
-   bool latched = fStatus_latched;
-   fStatus_latched = true;
-   double pos5V = get_pos5Vpower();
-   fStatus_latched = latched;
-   double logVtherm = log(100*(pos5V-Vtherm)/Vtherm);
-   return  ((((fTcoef_therm[4])*logVtherm +
-               fTcoef_therm[3])*logVtherm +
-               fTcoef_therm[2])*logVtherm +
-               fTcoef_therm[1])*logVtherm +
-               fTcoef_therm[0];
+   return get_status().get_Tpreamp_1();
 }
 
 inline double TAGMcontroller::get_Tpreamp_2() {     // thermister temperature on preamp 2 (C)
-   double Vtherm = get_Vtherm_2();
-   bool latched = fStatus_latched;
-   fStatus_latched = true;
-   double pos5V = get_pos5Vpower();
-   fStatus_latched = latched;
-   double logVtherm = log(100*(pos5V-Vtherm)/Vtherm);
-   return  ((((fTcoef_therm[4])*logVtherm +
-               fTcoef_therm[3])*logVtherm +
-               fTcoef_therm[2])*logVtherm +
-               fTcoef_therm[1])*logVtherm +
-               fTcoef_therm[0];
+   return get_status().get_Tpreamp_2();
 }
 
 inline double TAGMcontroller::get_VDAChealth() {    // DAC channel 31 read-back level (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[15]*40.5 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_VDAChealth();
 }
 
 inline double TAGMcontroller::get_VDACdiode() {     // DAC thermal diode voltage (V)
-   if (! fStatus_latched)
-      fetch_status();
-   return fLastStatus[14]*1.005 * 2*fADC_Vref/(1 << 12);
+   return get_status().get_VDACdiode();
 }
 
 inline double TAGMcontroller::get_TDAC() {          // DAC internal temperature reading (C)
-   double Vdiode = get_VDACdiode();
-   bool latched = fStatus_latched;
-   fStatus_latched = true;
-   double pos5V = get_pos5Vpower();
-   fStatus_latched = latched;
-   return fDACdiode_Tref + (pos5V - Vdiode - fDACdiode_Vf)/fDACdiode_Tcoef;
+   return get_status().get_TDAC();
+}
+
+inline unsigned char TAGMcontroller::StatusSnapshot::get_Geoaddr() const {
+   return fGeoaddr;
+}
+
+inline const unsigned char *TAGMcontroller::StatusSnapshot::get_MACaddr() const {
+   return fMACaddr;
+}
+
+inline const unsigned int *TAGMcontroller::StatusSnapshot::get_status_words() const {
+   return fStatus;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_Tchip() const {
+   return fTchip;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_pos5Vpower() const {
+   return fPos5Vpower;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_neg5Vpower() const {
+   return fNeg5Vpower;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_pos3_3Vpower() const {
+   return fPos3_3Vpower;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_pos1_2Vpower() const {
+   return fPos1_2Vpower;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_Vsumref_1() const {
+   return fVsumref_1;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_Vsumref_2() const {
+   return fVsumref_2;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_Vgainmode() const {
+   return fVgainmode;
+}
+
+inline int TAGMcontroller::StatusSnapshot::get_gainmode() const {
+   return fGainmode;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_Vtherm_1() const {
+   return fVtherm_1;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_Vtherm_2() const {
+   return fVtherm_2;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_Tpreamp_1() const {
+   return fTpreamp_1;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_Tpreamp_2() const {
+   return fTpreamp_2;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_VDAChealth() const {
+   return fVDAChealth;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_VDACdiode() const {
+   return fVDACdiode;
+}
+
+inline double TAGMcontroller::StatusSnapshot::get_TDAC() const {
+   return fTDAC;
+}
+
+inline TAGMcontroller::RampProfile TAGMcontroller::get_ramp_profile() {
+   // profile of ramps, except channels going to 0V
+   return fRampProfile;
+}
+
+inline TAGMcontroller::RampProfile TAGMcontroller::get_rampdown_profile() {
+   // profile for channels ramping down to 0V
+   return fRampdownProfile;
 }
 
 inline void TAGMcontroller::latch_status() {       // capture board status in state variables
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
    if (fetch_status() == 0)
       fStatus_latched = true;
 }
 
 inline void TAGMcontroller::passthru_status() {
    // reset saved state from last latch_levels()
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
    fStatus_latched = false;
 }
 
 inline void TAGMcontroller::latch_voltages() {
    // capture board's demand voltages in state variables
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
    if (fetch_voltages() == 0)
       fVoltages_latched = true;
 }
 
 inline void TAGMcontroller::passthru_voltages() {
    // reset saved voltages from last latch_voltages()
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
    fVoltages_latched = false;
 }
 
+inline void TAGMcontroller::latch_readings() {
+   // capture board status and demand voltages in state variables
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
+   if (fetch_status() == 0)
+      fStatus_latched = true;
+   if (fetch_voltages() == 0)
+      fVoltages_latched = true;
+}
+
+inline bool TAGMcontroller::is_status_latched() {
+   // true if a status reading is latched, false if the last
+   // latch_status() got no response or passthru_status() was called
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
+   return fStatus_latched;
+}
+
+inline bool TAGMcontroller::is_voltages_latched() {
+   // same for the demand voltages
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
+   return fVoltages_latched;
+}
+
 inline double TAGMcontroller::getV(unsigned int chan) {          // voltage of channel reported by board (V)
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
    if (! fVoltages_latched)
       fetch_voltages();
    if (chan < 32)
@@ -276,15 +521,31 @@ inline double TAGMcontroller::getV(unsigned int chan) {          // voltage of c
 }
 
 inline double TAGMcontroller::getVnew(unsigned int chan) {       // voltage of channel to be set in next ramp (V)
-   if (chan < 32)
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
+   if (chan < 32 && (fNextMask & (1 << chan)))
       return fNextVoltages[chan] * (50*fDAC_Vref/(1 << 14));
    else
       return 0;
 }
 
 inline void TAGMcontroller::setV(unsigned int chan, double V) {  // assign voltage of channel to be set in next ramp (V)
-   if (chan < 32)
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
+   if (chan < 32) {
       fNextVoltages[chan] = int(V * (1 << 14) / (50*fDAC_Vref) + 0.5);
+      fNextMask |= (1 << chan);
+   }
+}
+
+inline void TAGMcontroller::setV_many(unsigned int mask, const double V[32]) {
+   // assign voltages of all channels in mask to be set in next ramp (V),
+   // the other channels keep whatever was staged for them before
+   double codes_per_volt = (1 << 14) / (50*fDAC_Vref);
+   std::lock_guard<std::recursive_mutex> lock(fExchange);
+   for (int chan=0; chan < 32; ++chan) {
+      if (mask & (1 << chan))
+         fNextVoltages[chan] = int(V[chan] * codes_per_volt + 0.5);
+   }
+   fNextMask |= mask;
 }
 
 inline int TAGMcontroller::fetch_voltages() {
@@ -298,4 +559,28 @@ inline const unsigned char *TAGMcontroller::get_last_packet() {
    return fLastPacket;
 }
 
+inline double TAGMcontroller::get_last_rtt() {
+   // round-trip time of the last completed
+   // request/response exchange with the board (s)
+   return fLastRTT;
+}
+
+inline double TAGMcontroller::get_last_rx_time() {
+   // time the last response from the board was received,
+   // on the monotonic clock, 0 if there has been none (s)
+   return fLastRxTime;
+}
+
+inline unsigned int TAGMcontroller::get_channel_retries(unsigned int chan) {
+   // number of times channel was sent again because the
+   // value read back from the board disagreed with the request
+   return (chan < 32)? fChannelRetries[chan] : 0;
+}
+
+inline void TAGMcontroller::clear_channel_retries() {
+   // zero the read-back mismatch counts of all channels
+   for (int chan=0; chan < 32; ++chan)
+      fChannelRetries[chan] = 0;
+}
+
 #endif
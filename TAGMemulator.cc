@@ -0,0 +1,276 @@
+//
+// Class implementation: TAGMemulator
+//
+// Purpose: software model of a crate of Vbias control boards for the
+//          GlueX tagger microscope readout electronics
+//
+
+#include "TAGMemulator.h"
+#include "TAGMcontroller.h"
+
+#include <stdexcept>
+
+#include <string.h>
+#include <stdio.h>
+
+// DAC output step on the boards, 3.3V reference with x50 gain
+#define DAC_VOLTS_PER_CODE (50 * 3.3 / (1 << 14))
+
+typedef double (TAGMcontroller::StatusSnapshot::*status_getter)() const;
+
+// Find the ADC reading in status word slot that makes getter read back
+// target, given the other status words, by bisection between lo and hi.
+// This keeps the emulated readings consistent with the calibration
+// that TAGMcontroller applies to the real ones.
+static unsigned int adc_word(unsigned int status[17], int slot,
+                             status_getter getter, double target,
+                             unsigned int lo=0, unsigned int hi=4095)
+{
+   status[slot] = lo;
+   double vlo = (TAGMcontroller::StatusSnapshot(status).*getter)();
+   status[slot] = hi;
+   double vhi = (TAGMcontroller::StatusSnapshot(status).*getter)();
+   bool rising = (vhi > vlo);
+   while (hi - lo > 1) {
+      unsigned int mid = (lo + hi) / 2;
+      status[slot] = mid;
+      double v = (TAGMcontroller::StatusSnapshot(status).*getter)();
+      if ((v < target) == rising)
+         lo = mid;
+      else
+         hi = mid;
+   }
+   status[slot] = lo;
+   double dlo = (TAGMcontroller::StatusSnapshot(status).*getter)() - target;
+   status[slot] = hi;
+   double dhi = (TAGMcontroller::StatusSnapshot(status).*getter)() - target;
+   status[slot] = (dlo * dlo < dhi * dhi)? lo : hi;
+   return status[slot];
+}
+
+TAGMemulator::TAGMemulator(int nboards, unsigned char first_geoaddr)
+ : fLatency(0),
+   fJitter(0),
+   fLoss(0),
+   fCorrupt(0),
+   fRandom(1),
+   fRequests(0),
+   fResponses(0),
+   fLost(0),
+   fCorrupted(0)
+{
+   populate(nboards, first_geoaddr);
+}
+
+TAGMemulator::~TAGMemulator()
+{
+}
+
+void TAGMemulator::configure(const std::string &options)
+{
+   // Parse a comma-separated list of key=value options, as described
+   // in TAGMemulator.h, and rebuild the crate of boards accordingly.
+   // Any DAC levels set before the call are lost.
+
+   int nboards = fBoards.size();
+   unsigned int first_geoaddr = (nboards > 0)? fBoards[0].geoaddr : 0x8e;
+   std::size_t start = 0;
+   while (start < options.size()) {
+      std::size_t end = options.find(",", start);
+      if (end == options.npos)
+         end = options.size();
+      std::string option(options.substr(start, end - start));
+      start = end + 1;
+      if (option.size() == 0)
+         continue;
+      std::size_t eq = option.find("=");
+      std::string key(option.substr(0, eq));
+      std::string value((eq == option.npos)? "" : option.substr(eq + 1));
+      double number = 0;
+      char junk;
+      int good;
+      if (key == "geoaddr")
+         good = (sscanf(value.c_str(), "%x%c", &first_geoaddr, &junk) == 1 &&
+                 first_geoaddr < 0x100);
+      else
+         good = (sscanf(value.c_str(), "%lf%c", &number, &junk) == 1 &&
+                 number >= 0);
+      if (good && key == "boards" && number <= 0x100)
+         nboards = (int)number;
+      else if (good && key == "latency")
+         fLatency = number * 1e-6;
+      else if (good && key == "jitter")
+         fJitter = number * 1e-6;
+      else if (good && key == "loss" && number <= 1)
+         fLoss = number;
+      else if (good && key == "corrupt" && number <= 1)
+         fCorrupt = number;
+      else if (good && key == "seed")
+         fRandom.seed((unsigned int)number);
+      else if (! good || key != "geoaddr") {
+         char errmsg[99];
+         sprintf(errmsg, "TAGMemulator::configure error: "
+                         "bad option \"%.40s\"", option.c_str());
+         throw std::runtime_error(errmsg);
+      }
+   }
+   populate(nboards, first_geoaddr);
+}
+
+void TAGMemulator::populate(int nboards, unsigned char first_geoaddr)
+{
+   // Fill the crate with nboards boards with all DACs at zero, each
+   // one with its own supply levels and temperatures, scattered about
+   // the readings of a healthy board at room temperature.
+
+   typedef TAGMcontroller::StatusSnapshot snap;
+   std::normal_distribution<double> gauss(0, 1);
+   fBoards.clear();
+   for (int i=0; i < nboards; ++i) {
+      board b;
+      b.geoaddr = first_geoaddr + i;
+      unsigned char MACaddr[6] = {0x02, 0, 0, 0, 0, b.geoaddr};
+      memcpy(b.MACaddr, MACaddr, 6);
+      for (int chan=0; chan < 32; ++chan)
+         b.DAC[chan] = 0;
+      unsigned int *status = b.status;
+      for (int word=0; word < 17; ++word)
+         status[word] = 0;
+      double Tchip = 30.0 + 1.5 * gauss(fRandom);
+      adc_word(status, 0, &snap::get_Tchip, Tchip);
+      adc_word(status, 3, &snap::get_pos5Vpower, 5.0 + 0.02 * gauss(fRandom));
+      adc_word(status, 1, &snap::get_neg5Vpower, -5.0 + 0.02 * gauss(fRandom));
+      adc_word(status, 2, &snap::get_pos3_3Vpower, 3.3 + 0.01 * gauss(fRandom));
+      adc_word(status, 4, &snap::get_pos1_2Vpower, 1.2 + 0.005 * gauss(fRandom));
+      adc_word(status, 13, &snap::get_Vsumref_1, 2.0 + 0.01 * gauss(fRandom));
+      adc_word(status, 10, &snap::get_Vsumref_2, 2.0 + 0.01 * gauss(fRandom));
+      adc_word(status, 16, &snap::get_Tpreamp_1, 25.0 + gauss(fRandom),
+               1, status[3] - 1);
+      adc_word(status, 12, &snap::get_Tpreamp_2, 25.0 + gauss(fRandom),
+               1, status[3] - 1);
+      adc_word(status, 14, &snap::get_TDAC, Tchip + 0.5 * gauss(fRandom));
+      fBoards.push_back(b);
+   }
+}
+
+void TAGMemulator::status_words(const board &b, unsigned int status[17])
+{
+   // readings of the board at rest with one count of noise on each
+   // ADC channel, except for the two ADC channels that monitor the
+   // outputs of DAC channels 30 and 31
+
+   static const int adc_slots[] = {1, 2, 3, 4, 10, 12, 13, 14, 16};
+   typedef TAGMcontroller::StatusSnapshot snap;
+   memcpy(status, b.status, sizeof(b.status));
+   adc_word(status, 11, &snap::get_Vgainmode,
+            b.DAC[30] * DAC_VOLTS_PER_CODE);
+   adc_word(status, 15, &snap::get_VDAChealth,
+            b.DAC[31] * DAC_VOLTS_PER_CODE);
+   std::uniform_int_distribution<int> noise(-1, 1);
+   for (unsigned int i=0; i < sizeof(adc_slots) / sizeof(int); ++i) {
+      int word = status[adc_slots[i]] + noise(fRandom);
+      status[adc_slots[i]] = (word < 0)? 0 : (word > 4095)? 4095 : word;
+   }
+}
+
+double TAGMemulator::response_delay()
+{
+   // time taken by a board to answer, never negative
+
+   if (fJitter == 0)
+      return fLatency;
+   std::normal_distribution<double> delay(fLatency, fJitter);
+   double t = delay(fRandom);
+   return (t > 0)? t : 0;
+}
+
+int TAGMemulator::respond(const unsigned char *request, int len,
+                          std::vector<response> &responses)
+{
+   // Let every board that is addressed by the request act on it,
+   // appending their response packets to responses, apart from any
+   // that are lost. Requests that are too short or of unknown type
+   // are ignored, like the firmware.
+
+   if (len < 16)
+      return 0;
+   char reqtype = request[15];
+   if (reqtype == 'P' && len < 84)
+      return 0;
+   else if (reqtype != 'Q' && reqtype != 'P' && reqtype != 'R')
+      return 0;
+   bool broadcast = true;
+   for (int i=0; i < 6; ++i) {
+      if (request[i] != 0xff)
+         broadcast = false;
+   }
+
+   int acted = 0;
+   int count = 0;
+   std::uniform_real_distribution<double> uniform(0, 1);
+   for (unsigned int n=0; n < fBoards.size(); ++n) {
+      board &b = fBoards[n];
+      if (! broadcast && memcmp(request, b.MACaddr, 6) != 0)
+         continue;
+      else if (request[14] != 0xff && request[14] != b.geoaddr)
+         continue;
+
+      if (reqtype == 'R') {
+         for (int chan=0; chan < 32; ++chan)
+            b.DAC[chan] = 0;
+      }
+      else if (reqtype == 'P') {
+         unsigned int mask = request[16] + (request[17] << 8) +
+                             (request[18] << 16) + (request[19] << 24);
+         for (int chan=0; chan < 32; ++chan) {
+            if (mask & (1 << chan))
+               b.DAC[chan] = (request[2*chan+20] << 8) + request[2*chan+21];
+         }
+      }
+
+      response resp;
+      resp.len = (reqtype == 'P')? 84 : 64;
+      unsigned char *packet = resp.packet;
+      memset(packet, 0, resp.len);
+      for (int i=0; i < 6; ++i) {
+         packet[i] = request[i+6];
+         packet[i+6] = b.MACaddr[i];
+      }
+      packet[12] = 0;
+      packet[13] = (reqtype == 'P')? 70 : 50;
+      packet[14] = b.geoaddr;
+      if (reqtype == 'P') {
+         packet[15] = 'D';
+         for (int chan=0; chan < 32; ++chan) {
+            packet[2*chan+16] = (b.DAC[chan] >> 8) & 0xff;
+            packet[2*chan+17] = b.DAC[chan] & 0xff;
+         }
+      }
+      else {
+         packet[15] = 'S';
+         unsigned int status[17];
+         status_words(b, status);
+         for (int i=0; i < 17; ++i) {
+            packet[2*i+16] = (status[i] >> 8) & 0xff;
+            packet[2*i+17] = status[i] & 0xff;
+         }
+      }
+      acted = 1;
+      if (fLoss > 0 && uniform(fRandom) < fLoss) {
+         ++fLost;
+         continue;
+      }
+      else if (fCorrupt > 0 && uniform(fRandom) < fCorrupt) {
+         std::uniform_int_distribution<int> bit(16 * 8, resp.len * 8 - 1);
+         int flip = bit(fRandom);
+         packet[flip / 8] ^= 1 << (flip % 8);
+         ++fCorrupted;
+      }
+      resp.delay = response_delay();
+      responses.push_back(resp);
+      ++fResponses;
+      ++count;
+   }
+   fRequests += acted;
+   return count;
+}
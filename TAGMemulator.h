@@ -0,0 +1,123 @@
+//
+// Class TAGMemulator
+//
+// Purpose: software model of a crate of Vbias control boards for the
+//          GlueX tagger microscope readout electronics
+//
+// Each emulated board has a geoaddr, an ethernet MAC address, and
+// the 32 DAC set points of a real board, and answers the Q/S, P/D
+// and R packets of the board protocol the way the firmware does.
+// Its S-packets report supply levels and temperatures that scatter
+// from board to board around their nominal values, with +/-1 count
+// of ADC noise on every reading, and the gainmode and DAC health
+// levels read back from DAC channels 30 and 31. Used for testing and
+// benchmarking the protocol code without hardware, either in-process
+// through TAGMloopback or on a network device with emulateVbias.
+//
+// The boards can be made to misbehave in a reproducible way, by
+// setting the options below with configure(), as a comma-separated
+// list of key=value pairs, eg. "latency=300,jitter=50,loss=0.01":
+//    boards=<n>        - number of boards in the crate (18)
+//    geoaddr=<0xHH>    - geoaddr of the first board (0x8e)
+//    latency=<us>      - mean delay from request to response (0)
+//    jitter=<us>       - rms spread of the response delay (0)
+//    loss=<p>          - probability that a response is lost (0)
+//    corrupt=<p>       - probability that a response has one bit
+//                        flipped in its data words (0)
+//    seed=<n>          - seed of the random number generator (1)
+// A lost response is only lost on the way back, the board still
+// acts on the request, as happens when a frame is dropped on the
+// return path of the real network.
+//
+
+#ifndef TAGMEMULATOR_H
+#define TAGMEMULATOR_H
+
+#include <string>
+#include <vector>
+#include <random>
+
+class TAGMemulator {
+ public:
+   TAGMemulator(int nboards=18, unsigned char first_geoaddr=0x8e);
+   virtual ~TAGMemulator();
+
+   struct response {
+      double delay;                // seconds from request to response
+      int len;                     // length of response frame (bytes)
+      unsigned char packet[84];    // response frame
+   };
+
+   void configure(const std::string &options);  // set options from "key=value,..." list
+   int respond(const unsigned char *request, int len,
+               std::vector<response> &responses);  // append the responses of all boards to request, return their number
+   int get_board_count();                    // number of emulated boards
+   const unsigned char *get_MACaddr(int board);  // MAC address of emulated board
+   unsigned int get_DAC(int board, int chan);    // present DAC set point of channel on board
+
+   unsigned long get_request_count();    // requests acted on by any board
+   unsigned long get_response_count();   // responses handed back
+   unsigned long get_lost_count();       // responses lost on purpose
+   unsigned long get_corrupt_count();    // responses corrupted on purpose
+
+ protected:
+   struct board {
+      unsigned char geoaddr;
+      unsigned char MACaddr[6];
+      unsigned int DAC[32];
+      unsigned int status[17];   // status words of this board at rest
+   };
+   std::vector<board> fBoards;
+
+   double fLatency;      // mean response delay (s)
+   double fJitter;       // rms spread of response delay (s)
+   double fLoss;         // probability of a lost response
+   double fCorrupt;      // probability of a corrupted response
+   std::mt19937 fRandom;
+
+   unsigned long fRequests;
+   unsigned long fResponses;
+   unsigned long fLost;
+   unsigned long fCorrupted;
+
+   void populate(int nboards, unsigned char first_geoaddr);
+   void status_words(const board &b, unsigned int status[17]);
+   double response_delay();
+};
+
+inline int TAGMemulator::get_board_count() {
+   // number of emulated boards
+   return fBoards.size();
+}
+
+inline const unsigned char *TAGMemulator::get_MACaddr(int board) {
+   // MAC address of emulated board
+   return fBoards[board].MACaddr;
+}
+
+inline unsigned int TAGMemulator::get_DAC(int board, int chan) {
+   // present DAC set point of channel on board
+   return fBoards[board].DAC[chan];
+}
+
+inline unsigned long TAGMemulator::get_request_count() {
+   // requests acted on by any board
+   return fRequests;
+}
+
+inline unsigned long TAGMemulator::get_response_count() {
+   // responses handed back
+   return fResponses;
+}
+
+inline unsigned long TAGMemulator::get_lost_count() {
+   // responses lost on purpose
+   return fLost;
+}
+
+inline unsigned long TAGMemulator::get_corrupt_count() {
+   // responses corrupted on purpose
+   return fCorrupted;
+}
+
+#endif
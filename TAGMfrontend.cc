@@ -0,0 +1,379 @@
+//
+// Class implementation: TAGMfrontend
+//
+// Purpose: represents the whole set of Vbias control boards that read
+//          out the fibers of the GlueX tagger microscope
+//
+
+#include "TAGMfrontend.h"
+#include "TAGMcommunicator.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+TAGMfrontend::TAGMfrontend(const std::string &configfile)
+ : fConfigfile(configfile)
+{
+   memset(fTable, 0, sizeof(fTable));
+   load_config();
+}
+
+TAGMfrontend::~TAGMfrontend()
+{
+   detach_boards();
+}
+
+void TAGMfrontend::load_config()
+{
+   // Read the fiber table from the config file, one line per fiber
+   // starting with a space, all other lines are comments.
+
+   std::ifstream fin(fConfigfile.c_str());
+   if (!fin.good()) {
+      char errmsg[299];
+      sprintf(errmsg, "TAGMfrontend::load_config error: "
+                      "cannot open config file %s",
+              fConfigfile.c_str());
+      throw std::runtime_error(errmsg);
+   }
+   int lineno = 0;
+   std::string line;
+   while (std::getline(fin, line)) {
+      ++lineno;
+      if (line.size() == 0 || line[0] != ' ')
+         continue;
+      unsigned int geoaddr;
+      unsigned int chan;
+      int col, row;
+      double thresh_V;
+      double pixelcap_pF;
+      double meanyield_pix;
+      if (sscanf(line.c_str(), " %x %u %d %d %lf %lf %lf", &geoaddr, &chan,
+                 &col, &row, &thresh_V, &pixelcap_pF, &meanyield_pix) != 7)
+      {
+         continue;
+      }
+      if (col < 1 || col > kMaxColumn || row < 1 || row > kMaxRow ||
+          geoaddr == 0 || geoaddr > 0xff || chan > 31)
+      {
+         char errmsg[299];
+         sprintf(errmsg, "TAGMfrontend::load_config error: "
+                         "fiber out of range at line %d of %s",
+                 lineno, fConfigfile.c_str());
+         throw std::runtime_error(errmsg);
+      }
+      fiber &info = fTable[col][row];
+      info.geoaddr = geoaddr;
+      info.chan = chan;
+      info.thresh_V = thresh_V;
+      info.pixelcap_pF = pixelcap_pF;
+      info.meanyield_pix = meanyield_pix;
+   }
+}
+
+void TAGMfrontend::attach_boards(const char *netdev)
+{
+   // Create a controller for every board named in the config table,
+   // on the local network device netdev.
+
+   attach_boards(netdev, get_columns(), get_rows());
+}
+
+void TAGMfrontend::attach_boards(const char *netdev,
+                                 const std::vector<int> &columns,
+                                 const std::vector<int> &rows)
+{
+   // Create a controller on the local network device netdev for every
+   // board that reads out a fiber in the selection of columns x rows.
+
+   attach([netdev](unsigned char geoaddr) {
+             return new TAGMcontroller(geoaddr, netdev);
+          }, columns, rows);
+}
+
+void TAGMfrontend::attach_remote_boards(const std::string &server)
+{
+   // Create a communicator for every board named in the config table,
+   // driven through the TAGMremotectrl daemon on server.
+
+   attach_remote_boards(server, get_columns(), get_rows());
+}
+
+void TAGMfrontend::attach_remote_boards(const std::string &server,
+                                        const std::vector<int> &columns,
+                                        const std::vector<int> &rows)
+{
+   // Create a communicator driven through the TAGMremotectrl daemon on
+   // server for every board that reads out a selected fiber.
+
+   attach([&server](unsigned char geoaddr) {
+             return new TAGMcommunicator(geoaddr, server);
+          }, columns, rows);
+}
+
+void TAGMfrontend::attach(std::function<TAGMcontroller*(unsigned char)> make_board,
+                          const std::vector<int> &columns,
+                          const std::vector<int> &rows)
+{
+   // Replace the attached boards by one made by make_board for every
+   // board with a fiber in the selection, all or none of them.
+
+   detach_boards();
+   try {
+      for (unsigned int c=0; c < columns.size(); ++c) {
+         for (unsigned int r=0; r < rows.size(); ++r) {
+            const fiber *info = lookup(columns[c], rows[r]);
+            if (info && fBoards.find(info->geoaddr) == fBoards.end())
+               fBoards[info->geoaddr] = make_board(info->geoaddr);
+         }
+      }
+   }
+   catch (const std::runtime_error &err) {
+      detach_boards();
+      throw;
+   }
+}
+
+void TAGMfrontend::detach_boards()
+{
+   std::map<unsigned char, TAGMcontroller*>::iterator iter;
+   for (iter = fBoards.begin(); iter != fBoards.end(); ++iter)
+      delete iter->second;
+   fBoards.clear();
+}
+
+std::vector<int> TAGMfrontend::get_columns() const
+{
+   // columns with at least one fiber in the config, in increasing order
+
+   std::vector<int> columns;
+   for (int col=1; col <= kMaxColumn; ++col) {
+      for (int row=1; row <= kMaxRow; ++row) {
+         if (fTable[col][row].geoaddr) {
+            columns.push_back(col);
+            break;
+         }
+      }
+   }
+   return columns;
+}
+
+std::vector<int> TAGMfrontend::get_rows() const
+{
+   // rows with at least one fiber in the config, in increasing order
+
+   std::vector<int> rows;
+   for (int row=1; row <= kMaxRow; ++row) {
+      for (int col=1; col <= kMaxColumn; ++col) {
+         if (fTable[col][row].geoaddr) {
+            rows.push_back(row);
+            break;
+         }
+      }
+   }
+   return rows;
+}
+
+TAGMcontroller *TAGMfrontend::get_board(unsigned char geoaddr)
+{
+   std::map<unsigned char, TAGMcontroller*>::iterator iter;
+   iter = fBoards.find(geoaddr);
+   return (iter == fBoards.end())? 0 : iter->second;
+}
+
+void TAGMfrontend::setV(int column, int row, double V)
+{
+   // stage the level of one fiber for the next ramp (V)
+
+   const fiber *info = lookup(column, row);
+   TAGMcontroller *board = (info)? get_board(info->geoaddr) : 0;
+   if (board == 0) {
+      char errmsg[99];
+      sprintf(errmsg, "TAGMfrontend::setV error: "
+                      "no board attached for fiber at column %d, row %d",
+              column, row);
+      throw std::runtime_error(errmsg);
+   }
+   board->setV(info->chan, V);
+}
+
+int TAGMfrontend::setV(const std::vector<int> &columns,
+                       const std::vector<int> &rows, double V)
+{
+   // stage the same level for every fiber in the selection (V)
+
+   return setV(columns, rows,
+               [V](int, int, const fiber &) { return V; });
+}
+
+int TAGMfrontend::setV(const std::vector<int> &columns,
+                       const std::vector<int> &rows,
+                       level_function level)
+{
+   // Stage level(column,row,info) for every fiber in the selection of
+   // columns x rows that is present in the config. The levels for each
+   // board are collected first and handed over in a single setV_many(),
+   // and those of boards behind a remote server all in one message.
+   // Returns the number of fibers staged.
+
+   std::map<unsigned char, TAGMcommunicator::setpoints> staged;
+   int count = 0;
+   for (unsigned int c=0; c < columns.size(); ++c) {
+      for (unsigned int r=0; r < rows.size(); ++r) {
+         const fiber *info = lookup(columns[c], rows[r]);
+         if (info == 0)
+            continue;
+         if (get_board(info->geoaddr) == 0) {
+            char errmsg[99];
+            sprintf(errmsg, "TAGMfrontend::setV error: "
+                            "no board attached at geoaddr = %2.2x",
+                    info->geoaddr);
+            throw std::runtime_error(errmsg);
+         }
+         TAGMcommunicator::setpoints &stage = staged[info->geoaddr];   // starts out zeroed
+         stage.V[info->chan] = level(columns[c], rows[r], *info);
+         stage.mask |= (1 << info->chan);
+         ++count;
+      }
+   }
+   if (! TAGMcommunicator::setV_many_all(fBoards, staged, 0, &fLastError))
+      throw std::runtime_error(fLastError);
+   return count;
+}
+
+double TAGMfrontend::getV(int column, int row)
+{
+   // voltage of the fiber reported by its board (V), from the readings
+   // latched by read_all_voltages() if there are any
+
+   const fiber *info = lookup(column, row);
+   TAGMcontroller *board = (info)? get_board(info->geoaddr) : 0;
+   if (board == 0) {
+      char errmsg[99];
+      sprintf(errmsg, "TAGMfrontend::getV error: "
+                      "no board attached for fiber at column %d, row %d",
+              column, row);
+      throw std::runtime_error(errmsg);
+   }
+   return board->getV(info->chan);
+}
+
+bool TAGMfrontend::for_all_boards(std::function<bool(TAGMcontroller*)> op,
+                                  unsigned char *failed_geoaddr)
+{
+   // Apply op to every attached board, each in its own thread so that
+   // the exchanges with all of the boards overlap. Boards are safe to
+   // share between threads, and threads driving different boards on
+   // the same network device take turns on the capture handle. Returns
+   // false if op threw or returned false for any board.
+
+   std::vector<TAGMcontroller*> boards;
+   std::map<unsigned char, TAGMcontroller*>::iterator iter;
+   for (iter = fBoards.begin(); iter != fBoards.end(); ++iter)
+      boards.push_back(iter->second);
+   std::vector<std::string> errors(boards.size());
+   std::vector<std::thread> workers;
+   for (unsigned int b=0; b < boards.size(); ++b) {
+      workers.push_back(std::thread([&, b]() {
+         try {
+            if (! op(boards[b])) {
+               char errmsg[99];
+               snprintf(errmsg, sizeof(errmsg), "TAGMfrontend error: "
+                        "no response from Vbias board at geoaddr = %2.2x",
+                        boards[b]->get_Geoaddr());
+               errors[b] = errmsg;
+            }
+         }
+         catch (const std::runtime_error &err) {
+            errors[b] = err.what();
+            if (errors[b].size() == 0)
+               errors[b] = "unknown error";
+         }
+      }));
+   }
+   for (unsigned int b=0; b < workers.size(); ++b)
+      workers[b].join();
+
+   for (unsigned int b=0; b < boards.size(); ++b) {
+      if (errors[b].size() > 0) {
+         fLastError = errors[b];
+         if (failed_geoaddr)
+            *failed_geoaddr = boards[b]->get_Geoaddr();
+         return false;
+      }
+   }
+   return true;
+}
+
+bool TAGMfrontend::read_all_voltages(unsigned char *failed_geoaddr)
+{
+   // latch the demand voltages of all boards, all of them at once
+
+   return for_all_boards([](TAGMcontroller *board) {
+                            board->latch_voltages();
+                            return board->is_voltages_latched();
+                         }, failed_geoaddr);
+}
+
+bool TAGMfrontend::read_all_status(unsigned char *failed_geoaddr)
+{
+   // latch the status readings of all boards, all of them at once
+
+   return for_all_boards([](TAGMcontroller *board) {
+                            board->latch_status();
+                            return board->is_status_latched();
+                         }, failed_geoaddr);
+}
+
+bool TAGMfrontend::read_all(unsigned char *failed_geoaddr)
+{
+   // Latch the status and demand voltages of all boards together. The
+   // readings of boards behind a remote server are all brought over in
+   // a single round trip, the local boards are read all at once.
+
+   if (fBoards.size() > 0 &&
+       dynamic_cast<TAGMcommunicator*>(fBoards.begin()->second))
+   {
+      return TAGMcommunicator::latch_readings_all(fBoards, failed_geoaddr,
+                                                  &fLastError);
+   }
+   return for_all_boards([](TAGMcontroller *board) {
+                            board->latch_readings();
+                            return board->is_status_latched() &&
+                                   board->is_voltages_latched();
+                         }, failed_geoaddr);
+}
+
+void TAGMfrontend::passthru_all()
+{
+   // drop the latched readings, so that the next reads go to the boards
+
+   std::map<unsigned char, TAGMcontroller*>::iterator iter;
+   for (iter = fBoards.begin(); iter != fBoards.end(); ++iter) {
+      iter->second->passthru_status();
+      iter->second->passthru_voltages();
+   }
+}
+
+std::map<unsigned char, TAGMcontroller::StatusSnapshot> TAGMfrontend::get_all_status()
+{
+   // status of every board by geoaddr, from the readings latched by
+   // read_all_status() if there are any
+
+   std::map<unsigned char, TAGMcontroller::StatusSnapshot> snapshots;
+   std::map<unsigned char, TAGMcontroller*>::iterator iter;
+   for (iter = fBoards.begin(); iter != fBoards.end(); ++iter)
+      snapshots[iter->first] = iter->second->get_status();
+   return snapshots;
+}
+
+bool TAGMfrontend::ramp_all(unsigned char *failed_geoaddr)
+{
+   // ramp all boards to their staged levels in lockstep, stepping
+   // the levels they share by broadcast
+
+   return TAGMcontroller::ramp_all_broadcast(fBoards, failed_geoaddr);
+}
@@ -0,0 +1,153 @@
+//
+// Class TAGMfrontend
+//
+// Purpose: represents the whole set of Vbias control boards that read
+//          out the fibers of the GlueX tagger microscope
+//
+// The microscope consists of 510 fibers arranged in 102 columns x 5
+// rows, each read out by a sipm on one channel of one of the Vbias
+// boards. The mapping from (column,row) to (geoaddr,channel), together
+// with the threshold, pixel capacitance and yield of each sipm, is
+// read from a setVbias_fulldetector-*.conf file (see note 3 at the top
+// of setVbias.cc for the format) into a dense table indexed by column
+// and row, so that looking up a fiber costs no more than an array
+// access. The table reaches beyond the 102x5 fibers of the detector
+// to hold the spare channels on board 0x9f that the calibration
+// configs list as columns 103-110, rows 1-5 and 10-11.
+//
+// Once the table is loaded, attach_boards() creates a TAGMcontroller
+// for every board named in the config, or attach_remote_boards() a
+// TAGMcommunicator that talks to the boards through the TAGMremotectrl
+// daemon on a server. Given a selection of columns and rows, only the
+// boards that read out the selected fibers are attached. The boards
+// are owned by the frontend and deleted with it. The bulk operations then work on all of the boards at once:
+//
+//  setV        - stages levels for the fibers in a selection of rows
+//                and columns, collecting the channels of each board
+//                and handing them over to the board in one setV_many(),
+//                or for boards behind a remote server all of them in
+//                a single message to the server
+//  read_all_voltages, read_all_status
+//              - latch the demand voltages or the status of every board,
+//                with the exchanges to all boards in flight at the same
+//                time, one thread per board; afterwards getV() and
+//                get_status() return the latched readings
+//  read_all    - latches both at once, which for boards attached through
+//                a remote server takes a single round trip to the server
+//  ramp_all    - ramps all boards to their staged levels in lockstep
+//                with TAGMcontroller::ramp_all_broadcast(), so that
+//                parking the detector at one level and unparking it
+//                again step all boards together by broadcast
+//
+// A failing board does not hold up the rest. The bulk read methods
+// return false if any board failed or did not answer, with the geoaddr
+// of the first one in *failed_geoaddr and its error message in
+// get_last_error().
+//
+
+#ifndef TAGMFRONTEND_H
+#define TAGMFRONTEND_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "TAGMcontroller.h"
+
+class TAGMfrontend {
+ public:
+   enum {
+      kColumns = 102,       // fiber columns in the detector
+      kRows = 5,            // fiber rows in the detector
+      kMaxColumn = 110,     // highest column number in a config, with spares
+      kMaxRow = 11          // highest row number in a config, with spares
+   };
+
+   struct fiber {
+    // one entry of the config table, geoaddr=0 where there is no fiber
+      unsigned char geoaddr;   // Vbias board reading out this fiber
+      unsigned int chan;       // channel on the board (0-31)
+      double thresh_V;         // Vbias threshold of the sipm (V)
+      double pixelcap_pF;      // sipm pixel capacitance (pF/pixel)
+      double meanyield_pix;    // mean yield for an axial MIP (pixel/hit/V)
+   };
+
+   typedef std::function<double(int column, int row,
+                                const fiber &info)> level_function;
+
+   TAGMfrontend(const std::string &configfile);
+   ~TAGMfrontend();
+
+   void attach_boards(const char *netdev=0);            // create a TAGMcontroller for every board in the config
+   void attach_boards(const char *netdev,
+                      const std::vector<int> &columns,
+                      const std::vector<int> &rows);    // same, only for the boards of the selected fibers
+   void attach_remote_boards(const std::string &server); // same with TAGMcommunicator, server := <hostname>[:port][::netdev]
+   void attach_remote_boards(const std::string &server,
+                             const std::vector<int> &columns,
+                             const std::vector<int> &rows);  // same, only for the boards of the selected fibers
+
+   const fiber &get_fiber(int column, int row) const;   // config entry of fiber, geoaddr=0 if none
+   std::vector<int> get_columns() const;                // columns present in the config, in order
+   std::vector<int> get_rows() const;                   // rows present in the config, in order
+   std::map<unsigned char, TAGMcontroller*> &get_boards();  // attached boards by geoaddr
+   TAGMcontroller *get_board(unsigned char geoaddr);    // attached board, 0 if none
+   const std::string &get_last_error() const;           // message from the last board that failed
+
+   void setV(int column, int row, double V);            // stage level of fiber for the next ramp (V)
+   int setV(const std::vector<int> &columns,
+            const std::vector<int> &rows, double V);    // stage level of all selected fibers, return count
+   int setV(const std::vector<int> &columns,
+            const std::vector<int> &rows,
+            level_function level);                      // stage level(column,row,info) of all selected fibers, return count
+   double getV(int column, int row);                    // voltage of fiber reported by its board (V)
+
+   bool read_all_voltages(unsigned char *failed_geoaddr=0);  // latch the demand voltages of all boards
+   bool read_all_status(unsigned char *failed_geoaddr=0);    // latch the status of all boards
+   bool read_all(unsigned char *failed_geoaddr=0);           // latch the status and demand voltages of all boards
+   void passthru_all();                                  // drop latched readings of all boards
+   std::map<unsigned char, TAGMcontroller::StatusSnapshot> get_all_status();  // latched status by geoaddr
+   bool ramp_all(unsigned char *failed_geoaddr=0);       // ramp all boards to their staged levels
+
+ protected:
+   fiber fTable[kMaxColumn + 1][kMaxRow + 1];  // config entries by [column][row]
+   std::string fConfigfile;
+   std::map<unsigned char, TAGMcontroller*> fBoards;
+   std::string fLastError;
+
+   void load_config();
+   void attach(std::function<TAGMcontroller*(unsigned char)> make_board,
+               const std::vector<int> &columns,
+               const std::vector<int> &rows);
+   void detach_boards();
+   bool for_all_boards(std::function<bool(TAGMcontroller*)> op,
+                       unsigned char *failed_geoaddr);
+   const fiber *lookup(int column, int row) const;
+};
+
+inline const TAGMfrontend::fiber &TAGMfrontend::get_fiber(int column, int row) const {
+   // config entry of fiber, geoaddr=0 if none
+   static const fiber none = {0, 0, 0, 0, 0};
+   const fiber *info = lookup(column, row);
+   return (info)? *info : none;
+}
+
+inline std::map<unsigned char, TAGMcontroller*> &TAGMfrontend::get_boards() {
+   return fBoards;
+}
+
+inline const std::string &TAGMfrontend::get_last_error() const {
+   return fLastError;
+}
+
+inline const TAGMfrontend::fiber *TAGMfrontend::lookup(int column, int row) const {
+   // table entry of fiber at (column,row), 0 if there is none
+   if (column < 1 || column > kMaxColumn || row < 1 || row > kMaxRow)
+      return 0;
+   else if (fTable[column][row].geoaddr == 0)
+      return 0;
+   return &fTable[column][row];
+}
+
+#endif
@@ -0,0 +1,84 @@
+//
+// Class implementation: TAGMloopback
+//
+// Purpose: in-process transport that connects TAGMcontroller to a set
+//          of emulated Vbias control boards instead of a network device
+//
+
+#include "TAGMloopback.h"
+#include <stdexcept>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+TAGMloopback::TAGMloopback(const std::string &)
+ : fEmulator(new TAGMemulator())
+{
+   fHostMAC = LOOPBACK_HOST_MAC;
+   fResponses.reserve(64);
+   fPending.reserve(64);
+   if (getenv("TAGM_EMULATOR")) {
+      try {
+         fEmulator->configure(getenv("TAGM_EMULATOR"));
+      }
+      catch (const std::runtime_error &err) {
+         delete fEmulator;
+         throw;
+      }
+   }
+}
+
+TAGMloopback::~TAGMloopback()
+{
+   delete fEmulator;
+}
+
+int TAGMloopback::send(const unsigned char *frames[], const int lens[],
+                       int count)
+{
+   double now = monotonic_clock();
+   fResponses.clear();
+   for (int i=0; i < count; ++i)
+      fEmulator->respond(frames[i], lens[i], fResponses);
+   for (unsigned int i=0; i < fResponses.size(); ++i) {
+      pending_frame pending;
+      pending.due = now + fResponses[i].delay;
+      pending.len = fResponses[i].len;
+      memcpy(pending.frame, fResponses[i].packet, pending.len);
+      std::vector<pending_frame>::iterator iter = fPending.end();
+      while (iter != fPending.begin() && (iter - 1)->due > pending.due)
+         --iter;
+      fPending.insert(iter, pending);
+   }
+   return 0;
+}
+
+int TAGMloopback::receive(const unsigned char **frame, int *len,
+                          double deadline)
+{
+   // Return the next response from the emulated boards once it is
+   // due, or a timeout at the deadline if none is due by then. When
+   // there is nothing at all left to come back, the timeout is
+   // returned right away instead of waiting for the deadline.
+
+   if (fPending.size() == 0)
+      return 0;
+   pending_frame &next = fPending.front();
+   double due = (next.due < deadline)? next.due : deadline;
+   double wait_s = due - monotonic_clock();
+   if (wait_s > 0) {
+      struct timespec delay;
+      delay.tv_sec = (time_t)wait_s;
+      delay.tv_nsec = (long)((wait_s - delay.tv_sec) * 1e9);
+      while (nanosleep(&delay, &delay) != 0);
+   }
+   if (next.due > deadline)
+      return 0;
+   fRxTime = next.due;
+   memcpy(fFrame, next.frame, next.len);
+   *len = next.len;
+   *frame = fFrame;
+   fPending.erase(fPending.begin());
+   return 1;
+}
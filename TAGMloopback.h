@@ -0,0 +1,60 @@
+//
+// Class TAGMloopback
+//
+// Purpose: in-process transport that connects TAGMcontroller to a set
+//          of emulated Vbias control boards instead of a network device
+//
+// Every frame sent through the loopback is handed straight to a
+// TAGMemulator, and the responses of the emulated boards are queued
+// up to be received when they fall due, so the protocol code can be
+// exercised without root access, a network device or any hardware.
+// The emulated boards are configured from the env variable
+// TAGM_EMULATOR, eg. TAGM_EMULATOR="latency=300,loss=0.01", with
+// the options listed in TAGMemulator.h. Since nothing can arrive
+// except the responses already queued, receive() returns a timeout
+// at once when the queue is empty, so lost responses cost no time.
+// The queue is kept in storage that is reused from one request to
+// the next, so the emulated boards answer without allocating memory
+// once the queue has grown to the largest burst of responses.
+//
+
+#ifndef TAGMLOOPBACK_H
+#define TAGMLOOPBACK_H
+
+#include "TAGMtransport.h"
+#include "TAGMemulator.h"
+
+#include <vector>
+
+#define LOOPBACK_HOST_MAC "02:00:00:00:01:00"
+
+class TAGMloopback : public TAGMtransport {
+ public:
+   TAGMloopback(const std::string &netdev);
+   ~TAGMloopback();
+
+   using TAGMtransport::send;
+   int send(const unsigned char *frames[], const int lens[], int count);
+   int receive(const unsigned char **frame, int *len, double deadline);
+
+   TAGMemulator *get_emulator();   // the emulated boards behind the loopback
+
+ private:
+   struct pending_frame {
+      double due;                  // monotonic time the response falls due (s)
+      int len;                     // length of frame (bytes)
+      unsigned char frame[84];
+   };
+
+   TAGMemulator *fEmulator;
+   std::vector<TAGMemulator::response> fResponses;  // responses to the frames last sent
+   std::vector<pending_frame> fPending;  // responses not yet received, in order of due time
+   unsigned char fFrame[84];             // frame last returned by receive()
+};
+
+inline TAGMemulator *TAGMloopback::get_emulator() {
+   // the emulated boards behind the loopback
+   return fEmulator;
+}
+
+#endif
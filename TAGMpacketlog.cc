@@ -0,0 +1,398 @@
+//
+// Class implementation: TAGMpacketlog
+//
+// Purpose: background logger of the packets exchanged with the Vbias
+//          control boards of the GlueX tagger microscope
+//
+
+#include "TAGMpacketlog.h"
+#include <sstream>
+#include <ctime>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define PACKETLOG_POLL_US 2000
+
+long int TAGMpacketlog::max_logfile_size = 100000000;
+
+static double clock_seconds(clockid_t clock)
+{
+   struct timespec now;
+   clock_gettime(clock, &now);
+   return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void close_packetlog()
+{
+   TAGMpacketlog::get_log()->close();
+}
+
+TAGMpacketlog::TAGMpacketlog()
+ : fHead(0),
+   fTail(0),
+   fDropped(0),
+   fDroppedNoted(0),
+   fStopping(false),
+   fLogfile(-1),
+   fLogfileSize(0),
+   fLogfileBroken(false)
+{
+   fRing = new record[kRingSize];
+   for (unsigned long pos=0; pos < kRingSize; ++pos)
+      fRing[pos].sequence.store(pos, std::memory_order_relaxed);
+   fWriter = std::thread(&TAGMpacketlog::writer_main, this);
+   atexit(close_packetlog);
+}
+
+TAGMpacketlog::~TAGMpacketlog()
+{
+   close();
+   delete [] fRing;
+}
+
+TAGMpacketlog *TAGMpacketlog::get_log()
+{
+   // The logger is never deleted, so that records can still be posted
+   // by static objects that are destroyed after the exit handler has
+   // written out the ring; those records are dropped.
+
+   static TAGMpacketlog *log = new TAGMpacketlog();
+   return log;
+}
+
+bool TAGMpacketlog::post(const char *msg, const unsigned char *packet,
+                         const unsigned char *refpacket)
+{
+   // Claim the next slot in the ring, copy the record into it, and
+   // then hand it over to the writer by advancing its sequence number.
+   // Several threads may post at once; the slot is claimed by whoever
+   // wins the compare-exchange on fHead.
+
+   double now = clock_seconds(CLOCK_MONOTONIC);
+   if (fStopping) {
+      ++fDropped;
+      return false;
+   }
+   unsigned long pos = fHead.load(std::memory_order_relaxed);
+   record *slot;
+   while (true) {
+      slot = &fRing[pos & (kRingSize - 1)];
+      unsigned long seq = slot->sequence.load(std::memory_order_acquire);
+      long int diff = (long int)(seq - pos);
+      if (diff == 0) {
+         if (fHead.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed))
+            break;
+      }
+      else if (diff < 0) {
+         ++fDropped;
+         return false;
+      }
+      else {
+         pos = fHead.load(std::memory_order_relaxed);
+      }
+   }
+
+   slot->time = now;
+   slot->msglen = strnlen(msg, kMaxMessage);
+   memcpy(slot->msg, msg, slot->msglen);
+   slot->packetlen = 0;
+   slot->reflen = 0;
+   if (packet) {
+      slot->packetlen = frame_length(packet);
+      memcpy(slot->packet, packet, slot->packetlen);
+      if (refpacket && packet[15] == 'D') {
+         slot->reflen = frame_length(refpacket);
+         memcpy(slot->refpacket, refpacket, slot->reflen);
+      }
+   }
+   slot->sequence.store(pos + 1, std::memory_order_release);
+   return true;
+}
+
+void TAGMpacketlog::close()
+{
+   // Write out whatever is left in the ring and stop the writer
+   // thread. Records posted after this are dropped.
+
+   if (fStopping.exchange(true))
+      return;
+   if (fWriter.joinable())
+      fWriter.join();
+   if (fLogfile >= 0)
+      ::close(fLogfile);
+   fLogfile = -1;
+}
+
+int TAGMpacketlog::frame_length(const unsigned char *packet)
+{
+   // Number of bytes of the frame to keep, from its 802.3 length
+   // field, enough for the header and type fields of any frame and no
+   // more than the longest packet of the board protocol.
+
+   int len = 14 + (packet[12] << 8) + packet[13];
+   if (len < 20)
+      return 20;
+   else if (len > kMaxFrame)
+      return kMaxFrame;
+   return len;
+}
+
+void TAGMpacketlog::writer_main()
+{
+   while (! fStopping) {
+      if (drain() == 0)
+         usleep(PACKETLOG_POLL_US);
+   }
+   drain();
+}
+
+int TAGMpacketlog::drain()
+{
+   // Collect all of the records that are ready in the ring, and append
+   // them to the log file with one write. Returns the number of records
+   // taken from the ring.
+
+   int count = 0;
+   fBatch.clear();
+   while (true) {
+      record *slot = &fRing[fTail & (kRingSize - 1)];
+      if (slot->sequence.load(std::memory_order_acquire) != fTail + 1)
+         break;
+      add_record(slot->time, slot->msg, slot->msglen,
+                 slot->packet, slot->packetlen,
+                 slot->refpacket, slot->reflen);
+      slot->sequence.store(fTail + kRingSize, std::memory_order_release);
+      ++fTail;
+      ++count;
+   }
+   unsigned long dropped = fDropped;
+   if (dropped > fDroppedNoted) {
+      char msg[99];
+      sprintf(msg, "TAGMpacketlog::post error: ring full, "
+                   "%lu records dropped", dropped - fDroppedNoted);
+      add_record(clock_seconds(CLOCK_MONOTONIC), msg, strlen(msg), 0, 0, 0, 0);
+      fDroppedNoted = dropped;
+   }
+   if (fBatch.size() == 0)
+      return count;
+
+   if (fLogfile >= 0 && fLogfileSize > max_logfile_size) {
+      ::close(fLogfile);
+      fLogfile = -1;
+      rename(PACKETLOG_FILE, PACKETLOG_FILE ".old");
+   }
+   if (fLogfile < 0 && ! open_logfile())
+      return count;
+   const char *buf = fBatch.data();
+   std::size_t left = fBatch.size();
+   while (left > 0) {
+      ssize_t written = write(fLogfile, buf, left);
+      if (written < 0 && errno == EINTR)
+         continue;
+      else if (written <= 0)
+         break;
+      buf += written;
+      left -= written;
+   }
+   fLogfileSize += fBatch.size() - left;
+   return count;
+}
+
+bool TAGMpacketlog::open_logfile()
+{
+   // Open the log file for appending and write the file header, which
+   // gives the offset of the wall clock from the monotonic clock that
+   // stamps the records. A failure to open is reported only once. The
+   // file lives in a world-writable directory, so a symlink or a file
+   // that another local user owns or can write is not used.
+
+   struct stat st;
+   fLogfile = open(PACKETLOG_FILE, O_WRONLY | O_APPEND | O_CREAT |
+                                   O_NOFOLLOW | O_CLOEXEC, 0644);
+   if (fLogfile >= 0 &&
+       (fstat(fLogfile, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (st.st_uid != 0 && st.st_uid != geteuid()) ||
+        (st.st_mode & (S_IWGRP | S_IWOTH))))
+   {
+      ::close(fLogfile);
+      fLogfile = -1;
+   }
+   if (fLogfile < 0) {
+      if (! fLogfileBroken) {
+         std::cerr << "TAGMpacketlog::open_logfile error: "
+                   << "cannot open logfile " << PACKETLOG_FILE
+                   << ", packets will not be logged" << std::endl;
+      }
+      fLogfileBroken = true;
+      return false;
+   }
+   fLogfileBroken = false;
+   fLogfileSize = st.st_size;
+   double offset = clock_seconds(CLOCK_REALTIME) -
+                   clock_seconds(CLOCK_MONOTONIC);
+   std::string header(PACKETLOG_MAGIC);
+   header.append((const char*)&offset, sizeof(offset));
+   fBatch.insert(0, header);
+   return true;
+}
+
+void TAGMpacketlog::add_record(double time, const char *msg, int msglen,
+                               const unsigned char *packet, int packetlen,
+                               const unsigned char *refpacket, int reflen)
+{
+   unsigned short lens[3] = {(unsigned short)msglen,
+                             (unsigned short)packetlen,
+                             (unsigned short)reflen};
+   fBatch.append((const char*)&time, sizeof(time));
+   fBatch.append((const char*)lens, sizeof(lens));
+   if (msglen > 0)
+      fBatch.append(msg, msglen);
+   if (packetlen > 0)
+      fBatch.append((const char*)packet, packetlen);
+   if (reflen > 0)
+      fBatch.append((const char*)refpacket, reflen);
+}
+
+void TAGMpacketlog::print_record(std::ostream &out, double walltime,
+                                 const std::string &msg,
+                                 const unsigned char *packet,
+                                 const unsigned char *refpacket)
+{
+   // Print one record in the format of the text log that was written
+   // by earlier versions of TAGMcontroller.
+
+   time_t rawtime = (time_t)walltime;
+   struct tm * timeinfo;
+   char timebuffer[80];
+   timeinfo = localtime(&rawtime);
+   strftime(timebuffer, sizeof(timebuffer),"%d-%m-%Y %H:%M:%S", timeinfo);
+   std::string timestr(timebuffer);
+   if (packet == 0) {
+      out << timestr << " " << msg << std::endl;
+      return;
+   }
+
+   int geoaddr = packet[14];
+   char destaddr[30];
+   char srcaddr[30];
+   if (geoaddr == 0xff) {
+      sprintf(destaddr, "0xff (broadcast)");
+      sprintf(srcaddr, "0x?? (%02x:%02x:%02x:%02x:%02x:%02x)",
+              packet[6], packet[7], packet[8],
+              packet[9], packet[10], packet[11]);
+   }
+   else {
+      sprintf(destaddr, "0x%02x (%02x:%02x:%02x:%02x:%02x:%02x)",
+              geoaddr, packet[0], packet[1], packet[2],
+              packet[3], packet[4], packet[5]);
+      sprintf(srcaddr, "0x%02x (%02x:%02x:%02x:%02x:%02x:%02x)",
+              geoaddr, packet[6], packet[7], packet[8],
+              packet[9], packet[10], packet[11]);
+   }
+   char type = packet[15];
+   if (type == 'R') {
+      out << timestr << " " << msg << std::endl
+          << "  request packet type R (hard reset)"
+          << " to card " << destaddr << std::endl;
+   }
+   else if (type == (char)0xd5) {
+      out << timestr << " " << msg << std::endl
+          << "  request packet type R' (soft reset)"
+          << " to card " << destaddr << std::endl;
+   }
+   else if (type == 'Q') {
+      out << timestr << " " << msg << std::endl
+          << "  request packet type Q (card state)"
+          << " to card " << destaddr << std::endl;
+   }
+   else if (type == 'S') {
+      out << timestr << " " << msg << std::endl
+          << "  response packet type S (card state)"
+          << " from card " << srcaddr << std::endl;
+      int tempval = (packet[16] << 8) + packet[17];
+      double tempC = tempval * 0.25;
+      out << "    temperature = " << tempC << " C" << std::endl;
+      for (int i=0; i < 16; ++i) {
+         char a[30];
+         sprintf(a, "    adc[%x]=0x%03x", i,
+                      packet[19 + i*2] + (packet[18 + i*2] & 0xf));
+         out << a;
+         if (i % 4 == 3)
+            out << std::endl;
+      }
+   }
+   else if (type == 'P') {
+      out << timestr << " " << msg << std::endl
+          << "  request packet type P (set/get Vbias values)"
+          << " to card " << destaddr << std::endl;
+      long int mask = packet[16] + (packet[17] << 8) +
+                      (packet[18] << 16) + (packet[19] << 24);
+      int n=0;
+      std::stringstream updates;
+      for (int i=0; i < 32; ++i) {
+         if (mask & (1 << i)) {
+            char a[30];
+            sprintf(a, "    V[%02x]=0x%04x", i,
+                    (packet[20 +i*2] << 8) + packet[21 + i*2]);
+            updates << a;
+            if (n % 4 == 3)
+               updates << std::endl;
+            ++n;
+         }
+      }
+      out << "    " << n << " updated values requested" << std::endl;
+      if (n > 0) {
+         out << updates.str();
+         if (n % 4 != 0)
+            out << std::endl;
+      }
+   }
+   else if (type == 'D') {
+      out << timestr << " " << msg << std::endl
+          << "  response packet type D (Vbias readback)"
+          << " from card " << srcaddr;
+      long int mask = 0;
+      if (refpacket) {
+         mask = refpacket[16] + (refpacket[17] << 8) +
+                (refpacket[18] << 16) + (refpacket[19] << 24);
+         char a[30];
+         sprintf(a, ", using write mask 0x%08x", (unsigned int)mask);
+         out << a;
+      }
+      out << std::endl;
+      for (int i=0; i < 32; ++i) {
+         char a[30];
+         unsigned int V = (packet[16 +i*2] << 8) + packet[17 + i*2];
+         sprintf(a, "    V[%02x]=0x%04x", i, V);
+         out << a;
+         if (refpacket) {
+            unsigned int Vref = (refpacket[20 +i*2] << 8) + refpacket[21 + i*2];
+            if (mask & (1 << i)) {
+               if (V == Vref)
+                  out << "(good)";
+               else
+                  out << "(BAD!)";
+            }
+         }
+         if (i % 4 == 3)
+            out << std::endl;
+      }
+   }
+   else {
+      out << "  unrecognized packet received from " << srcaddr
+          << " to " << destaddr << std::endl;
+      for (int i=0; i < 8; ++i) {
+         char a[30];
+         sprintf(a, "    0x04%x", packet[12 + i]);
+         out << a;
+      }
+      out << std::endl;
+   }
+}
@@ -0,0 +1,109 @@
+//
+// Class TAGMpacketlog
+//
+// Purpose: background logger of the packets exchanged with the Vbias
+//          control boards of the GlueX tagger microscope
+//
+// Records are posted by TAGMcontroller on every send and receive, and
+// kept as compact binary records in /tmp/TAGMcontroller.plog, which is
+// rotated to /tmp/TAGMcontroller.plog.old when it grows too large.
+// Posting a record only copies the message text, the raw frame and a
+// monotonic timestamp into a slot of a fixed ring, without taking any
+// lock, so it never waits on formatting or on the filesystem. A
+// background thread drains the ring to the log file every few ms,
+// appending each batch of records with a single write, so that the
+// logs of several processes sharing the file do not get mixed up
+// within a record. When the ring is full the record is dropped, and
+// a note of how many were lost is written to the log in their place.
+// Records still in the ring when the process is killed by a signal
+// are lost.
+//
+// The binary log is turned back into the familiar human-readable dump
+// of the S/P/D/R packets by decodeVbiaslog, using print_record().
+//
+// Log file layout, all numbers in host byte order:
+//    file header   - 8 byte magic "TAGMplog", then a double that gives
+//                    the wall clock time minus the monotonic time (s),
+//                    written each time a process opens the file
+//    each record   - double monotonic time (s), then unsigned shorts
+//                    for the lengths of the message, the frame and the
+//                    reference frame, followed by their bytes
+//
+
+#ifndef TAGMPACKETLOG_H
+#define TAGMPACKETLOG_H
+
+#include <string>
+#include <iostream>
+#include <atomic>
+#include <thread>
+
+#define PACKETLOG_FILE "/tmp/TAGMcontroller.plog"
+#define PACKETLOG_MAGIC "TAGMplog"
+
+class TAGMpacketlog {
+ public:
+   static TAGMpacketlog *get_log();   // logger shared by the process
+
+   bool post(const char *msg, const unsigned char *packet=0,
+             const unsigned char *refpacket=0);  // queue a record, false if dropped
+   void close();                      // write out the ring, then stop the writer thread
+
+   unsigned long get_dropped_count();  // records dropped on a full ring
+
+   static int frame_length(const unsigned char *packet);   // bytes of frame to keep
+   static void print_record(std::ostream &out, double walltime,
+                            const std::string &msg,
+                            const unsigned char *packet=0,
+                            const unsigned char *refpacket=0);  // human-readable dump
+
+   static long int max_logfile_size;
+
+ private:
+   TAGMpacketlog();
+   ~TAGMpacketlog();
+
+   enum {
+      kRingSize = 4096,     // slots in the ring, a power of 2
+      kMaxMessage = 200,    // longest message text kept
+      kMaxFrame = 84        // longest frame kept, a P or D packet
+   };
+
+   struct record {
+      std::atomic<unsigned long> sequence;   // ring position this slot holds
+      double time;
+      unsigned short msglen;
+      unsigned short packetlen;
+      unsigned short reflen;
+      char msg[kMaxMessage];
+      unsigned char packet[kMaxFrame];
+      unsigned char refpacket[kMaxFrame];
+   };
+   record *fRing;
+
+   std::atomic<unsigned long> fHead;        // next position to be posted
+   unsigned long fTail;                     // next position to be written
+   std::atomic<unsigned long> fDropped;     // records dropped, ring full
+   unsigned long fDroppedNoted;             // drops already noted in the log
+   std::atomic<bool> fStopping;
+   std::thread fWriter;
+
+   int fLogfile;                            // file descriptor, -1 if not open
+   long int fLogfileSize;
+   bool fLogfileBroken;                     // open failed, already reported
+   std::string fBatch;                      // records waiting to be written
+
+   void writer_main();
+   int drain();
+   bool open_logfile();
+   void add_record(double time, const char *msg, int msglen,
+                   const unsigned char *packet, int packetlen,
+                   const unsigned char *refpacket, int reflen);
+};
+
+inline unsigned long TAGMpacketlog::get_dropped_count() {
+   // records dropped on a full ring
+   return fDropped;
+}
+
+#endif
@@ -0,0 +1,302 @@
+//
+// Class implementation: TAGMpacketring
+//
+// Purpose: raw ethernet transport to the GlueX tagger microscope
+//          Vbias control boards built directly on a Linux AF_PACKET
+//          socket, as an alternative to the libpcap capture handle
+//
+
+#include "TAGMpacketring.h"
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#define RING_BLOCK_SIZE (1 << 16)
+#define RING_BLOCK_COUNT 16
+#define RING_FRAME_SIZE 2048
+#define RING_RETIRE_TIMEOUT_MS 1
+
+TAGMpacketring::TAGMpacketring(const std::string &netdev,
+                               const std::string &packet_types)
+ : fSocket(-1),
+   fRing(0),
+   fBlockSize(RING_BLOCK_SIZE),
+   fBlockCount(RING_BLOCK_COUNT),
+   fBlockIndex(0),
+   fBlock(0),
+   fPacket(0),
+   fPacketsLeft(0)
+{
+   fHostMAC = interface_MAC(netdev);
+   fPacketTypes = packet_types;
+   char errmsg[199];
+   fIfindex = if_nametoindex(netdev.c_str());
+   if (fIfindex == 0) {
+      sprintf(errmsg, "TAGMpacketring::TAGMpacketring error: "
+                      "no such network device %s", netdev.c_str());
+      throw std::runtime_error(errmsg);
+   }
+   fSocket = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+   if (fSocket < 0) {
+      sprintf(errmsg, "TAGMpacketring::TAGMpacketring error: "
+                      "unable to open a packet socket on %s, "
+                      "maybe you need root permission? %s",
+              netdev.c_str(), strerror(errno));
+      throw std::runtime_error(errmsg);
+   }
+   try {
+      attach_filter();
+
+      int version = TPACKET_V3;
+      if (setsockopt(fSocket, SOL_PACKET, PACKET_VERSION,
+                     &version, sizeof(version)) != 0)
+      {
+         sprintf(errmsg, "TAGMpacketring::TAGMpacketring error: "
+                         "kernel does not support TPACKET_V3, %s",
+                 strerror(errno));
+         throw std::runtime_error(errmsg);
+      }
+      struct tpacket_req3 req;
+      memset(&req, 0, sizeof(req));
+      req.tp_block_size = fBlockSize;
+      req.tp_block_nr = fBlockCount;
+      req.tp_frame_size = RING_FRAME_SIZE;
+      req.tp_frame_nr = fBlockSize * fBlockCount / RING_FRAME_SIZE;
+      req.tp_retire_blk_tov = RING_RETIRE_TIMEOUT_MS;
+      if (setsockopt(fSocket, SOL_PACKET, PACKET_RX_RING,
+                     &req, sizeof(req)) != 0)
+      {
+         sprintf(errmsg, "TAGMpacketring::TAGMpacketring error: "
+                         "unable to set up the receive ring, %s",
+                 strerror(errno));
+         throw std::runtime_error(errmsg);
+      }
+      void *ring = mmap(0, fBlockSize * fBlockCount, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fSocket, 0);
+      if (ring == MAP_FAILED) {
+         sprintf(errmsg, "TAGMpacketring::TAGMpacketring error: "
+                         "unable to map the receive ring, %s",
+                 strerror(errno));
+         throw std::runtime_error(errmsg);
+      }
+      fRing = (unsigned char*)ring;
+
+      struct sockaddr_ll addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sll_family = AF_PACKET;
+      addr.sll_protocol = htons(ETH_P_ALL);
+      addr.sll_ifindex = fIfindex;
+      if (bind(fSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+         sprintf(errmsg, "TAGMpacketring::TAGMpacketring error: "
+                         "unable to bind packet socket to %s, %s",
+                 netdev.c_str(), strerror(errno));
+         throw std::runtime_error(errmsg);
+      }
+#ifdef PACKET_IGNORE_OUTGOING
+      // the filter drops them anyway, but save the kernel the copy
+      int ignore = 1;
+      setsockopt(fSocket, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+                 &ignore, sizeof(ignore));
+#endif
+   }
+   catch (const std::runtime_error &err) {
+      if (fRing)
+         munmap(fRing, fBlockSize * fBlockCount);
+      close(fSocket);
+      throw;
+   }
+}
+
+TAGMpacketring::~TAGMpacketring()
+{
+   if (fRing)
+      munmap(fRing, fBlockSize * fBlockCount);
+   if (fSocket >= 0)
+      close(fSocket);
+}
+
+static sock_filter bpf_stmt(unsigned short code, unsigned int k)
+{
+   sock_filter insn = BPF_STMT(code, k);
+   return insn;
+}
+
+static sock_filter bpf_jump(unsigned short code, unsigned int k,
+                            unsigned char jt, unsigned char jf)
+{
+   sock_filter insn = BPF_JUMP(code, k, jt, jf);
+   return insn;
+}
+
+void TAGMpacketring::attach_filter()
+{
+   // Classic BPF equivalent of the pcap filter expression
+   //    ether[12:2] <= 1500 and (ether[15] = <type> or ...)
+   //       and not ether src <hostMAC>
+   // written out by hand, so the ring needs nothing from libpcap.
+
+   unsigned int mac[6];
+   if (sscanf(fHostMAC.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x",
+              &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
+   {
+      throw std::runtime_error("TAGMpacketring::attach_filter error: "
+                               "invalid host MAC address");
+   }
+   unsigned int mac_hi = (mac[0] << 24) + (mac[1] << 16) +
+                         (mac[2] << 8) + mac[3];
+   unsigned int mac_lo = (mac[4] << 8) + mac[5];
+   int ntypes = fPacketTypes.size();
+   int host = 3 + ntypes;         // first instruction of the source check
+   int drop = host + 4;
+   int accept = drop + 1;
+   std::vector<sock_filter> code;
+   code.push_back(bpf_stmt(BPF_LD + BPF_H + BPF_ABS, 12));        // length field
+   code.push_back(bpf_jump(BPF_JMP + BPF_JGT + BPF_K, 1500,
+                           drop - 2, 0));                         // ethertype, drop
+   code.push_back(bpf_stmt(BPF_LD + BPF_B + BPF_ABS, 15));        // packet type
+   for (int i=0; i < ntypes; ++i) {
+      int next = 3 + i + 1;
+      code.push_back(bpf_jump(BPF_JMP + BPF_JEQ + BPF_K,
+                              (unsigned char)fPacketTypes[i], host - next,
+                              (i + 1 < ntypes)? 0 : drop - next));  // none, drop
+   }
+   code.push_back(bpf_stmt(BPF_LD + BPF_W + BPF_ABS, 6));         // src MAC 0..3
+   code.push_back(bpf_jump(BPF_JMP + BPF_JEQ + BPF_K, mac_hi,
+                           0, accept - (host + 2)));              // not host, accept
+   code.push_back(bpf_stmt(BPF_LD + BPF_H + BPF_ABS, 10));        // src MAC 4..5
+   code.push_back(bpf_jump(BPF_JMP + BPF_JEQ + BPF_K, mac_lo,
+                           0, accept - (host + 4)));              // host, drop
+   code.push_back(bpf_stmt(BPF_RET + BPF_K, 0));                  // drop
+   code.push_back(bpf_stmt(BPF_RET + BPF_K, 0x40000));            // accept
+   struct sock_fprog prog;
+   prog.len = code.size();
+   prog.filter = &code[0];
+   if (setsockopt(fSocket, SOL_SOCKET, SO_ATTACH_FILTER,
+                  &prog, sizeof(prog)) != 0)
+   {
+      char errmsg[199];
+      sprintf(errmsg, "TAGMpacketring::attach_filter error: "
+                      "socket filter refuses to load, %s",
+              strerror(errno));
+      throw std::runtime_error(errmsg);
+   }
+}
+
+int TAGMpacketring::send(const unsigned char *frames[],
+                         const int lens[], int count)
+{
+   // Hand all of the frames to the kernel in as few sendmmsg() calls
+   // as it will take, normally just one. Return 0 on success, or -1.
+
+   struct iovec iov[count];
+   struct mmsghdr msgs[count];
+   memset(msgs, 0, sizeof(msgs));
+   for (int i=0; i < count; ++i) {
+      iov[i].iov_base = (void*)frames[i];
+      iov[i].iov_len = lens[i];
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+   int sent = 0;
+   while (sent < count) {
+      int res = sendmmsg(fSocket, msgs + sent, count - sent, 0);
+      if (res < 0 && errno == EINTR) {
+         continue;
+      }
+      else if (res <= 0) {
+         snprintf(fErrbuf, sizeof(fErrbuf), "send: %s", strerror(errno));
+         return -1;
+      }
+      sent += res;
+   }
+   return 0;
+}
+
+int TAGMpacketring::receive(const unsigned char **frame, int *len,
+                            double deadline)
+{
+   // Return the next frame in the ring, waiting until deadline for one
+   // to arrive. Return value has the same meaning as for pcap_next_ex().
+
+   while (1) {
+      if (fBlock == 0) {
+         tpacket_block_desc *block;
+         block = (tpacket_block_desc*)(fRing + fBlockIndex * fBlockSize);
+         __sync_synchronize();
+         if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+            int res = wait(deadline);
+            if (res <= 0)
+               return res;
+            continue;
+         }
+         fBlock = block;
+         fPacketsLeft = block->hdr.bh1.num_pkts;
+         fPacket = (tpacket3_hdr*)((unsigned char*)block +
+                                   block->hdr.bh1.offset_to_first_pkt);
+      }
+      else if (fPacketsLeft == 0) {
+         release_block();
+      }
+      else {
+         *frame = (unsigned char*)fPacket + fPacket->tp_mac;
+         *len = fPacket->tp_snaplen;
+         fRxTime = monotonic_from_wallclock(fPacket->tp_sec,
+                                            fPacket->tp_nsec);
+         fPacket = (tpacket3_hdr*)((unsigned char*)fPacket +
+                                   fPacket->tp_next_offset);
+         fPacketsLeft--;
+         return 1;
+      }
+   }
+}
+
+void TAGMpacketring::release_block()
+{
+   // give the block we have finished reading back to the kernel
+
+   __sync_synchronize();
+   fBlock->hdr.bh1.block_status = TP_STATUS_KERNEL;
+   fBlock = 0;
+   fBlockIndex = (fBlockIndex + 1) % fBlockCount;
+}
+
+int TAGMpacketring::wait(double deadline)
+{
+   // Block until the kernel hands over the next block of the ring,
+   // or else until the deadline passes. Returns 1 if the socket is
+   // readable, 0 on timeout, and -1 if the wait itself fails.
+
+   struct pollfd pfd;
+   pfd.fd = fSocket;
+   pfd.events = POLLIN | POLLERR;
+   while (1) {
+      double wait_s = deadline - monotonic_clock();
+      if (wait_s <= 0)
+         return 0;
+      struct timespec timeout;
+      timeout.tv_sec = (time_t)wait_s;
+      timeout.tv_nsec = (long)((wait_s - timeout.tv_sec) * 1e9);
+      pfd.revents = 0;
+      int res = ppoll(&pfd, 1, &timeout, 0);
+      if (res > 0) {
+         return 1;
+      }
+      else if (res < 0 && errno != EINTR) {
+         snprintf(fErrbuf, sizeof(fErrbuf), "poll: %s", strerror(errno));
+         return -1;
+      }
+   }
+}
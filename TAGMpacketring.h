@@ -0,0 +1,53 @@
+//
+// Class TAGMpacketring
+//
+// Purpose: raw ethernet transport to the GlueX tagger microscope
+//          Vbias control boards built directly on a Linux AF_PACKET
+//          socket, as an alternative to the libpcap capture handle
+//
+// Frames are received through a TPACKET_V3 memory-mapped ring, and
+// handed to the caller in place without copying. Each frame returned
+// by receive() remains valid until the next call to receive(), when
+// the block that holds it may be given back to the kernel. Frames
+// are transmitted in batches with a single sendmmsg() system call.
+// The same kernel filter as for the pcap handle is installed on the
+// socket: only 802.3 frames (length field <= 1500) that were not sent
+// from the host interface itself are captured.
+//
+// Requires root permission (CAP_NET_RAW) on the host, like libpcap.
+//
+
+#ifndef TAGMPACKETRING_H
+#define TAGMPACKETRING_H
+
+#include "TAGMtransport.h"
+
+struct tpacket_block_desc;
+struct tpacket3_hdr;
+
+class TAGMpacketring : public TAGMtransport {
+ public:
+   TAGMpacketring(const std::string &netdev, const std::string &packet_types);
+   ~TAGMpacketring();
+
+   using TAGMtransport::send;
+   int send(const unsigned char *frames[], const int lens[], int count);
+   int receive(const unsigned char **frame, int *len, double deadline);
+
+ private:
+   int fSocket;                    // AF_PACKET socket bound to netdev
+   int fIfindex;                   // interface index of netdev
+   unsigned char *fRing;           // memory-mapped RX ring
+   unsigned int fBlockSize;        // bytes per ring block
+   unsigned int fBlockCount;       // number of blocks in ring
+   unsigned int fBlockIndex;       // index of the next block to read
+   tpacket_block_desc *fBlock;     // block being read, 0 if none
+   tpacket3_hdr *fPacket;          // next packet to read in fBlock
+   unsigned int fPacketsLeft;      // packets not yet read in fBlock
+
+   int wait(double deadline);
+   void release_block();
+   void attach_filter();
+};
+
+#endif
@@ -0,0 +1,187 @@
+//
+// Class implementation: TAGMpcap
+//
+// Purpose: raw ethernet transport to the GlueX tagger microscope
+//          Vbias control boards through a libpcap capture handle
+//
+
+#include "TAGMpcap.h"
+#include <stdexcept>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#define CAPTURE_TIMEOUT_MS 1
+#define CAPTURE_SNAPLEN 100
+#define CAPTURE_BUFFER_BYTES (1 << 21)
+
+TAGMpcap::TAGMpcap(const std::string &netdev,
+                   const std::string &packet_types)
+ : fTstampUnit(1e-6)
+{
+   fHostMAC = interface_MAC(netdev);
+   fPacketTypes = packet_types;
+   char errbuf[PCAP_ERRBUF_SIZE];
+   fp = pcap_create(netdev.c_str(), errbuf);
+   if (fp == 0) {
+      char errmsg[160];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMpcap::TAGMpcap error: "
+               "unable to open the ethernet adapter, "
+               "maybe you need root permission to open %.40s?\n",
+               netdev.c_str());
+      throw std::runtime_error(errmsg);
+   }
+   try {
+      configure_capture(netdev);
+      pcap_setnonblock(fp, 1, errbuf);
+      configure_network_filters();
+   }
+   catch (const std::runtime_error &err) {
+      pcap_close(fp);
+      throw;
+   }
+}
+
+TAGMpcap::~TAGMpcap()
+{
+   pcap_close(fp);
+}
+
+void TAGMpcap::configure_capture(const std::string &netdev)
+{
+   // Set the options of the capture handle and activate it. Immediate
+   // mode is what makes the response times good to a few us, and the
+   // CAPTURE_TIMEOUT_MS read timeout only matters if it is not there.
+   // Nanosecond time stamps are asked for, but microseconds will do.
+
+   pcap_set_snaplen(fp, CAPTURE_SNAPLEN);
+   pcap_set_promisc(fp, 1);
+   pcap_set_timeout(fp, CAPTURE_TIMEOUT_MS);
+   pcap_set_immediate_mode(fp, 1);
+   pcap_set_buffer_size(fp, CAPTURE_BUFFER_BYTES);
+   pcap_set_tstamp_precision(fp, PCAP_TSTAMP_PRECISION_NANO);
+   int res = pcap_activate(fp);
+   if (res < 0) {
+      char errmsg[256];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMpcap::configure_capture error: "
+               "unable to activate capture on %.40s, %.100s, "
+               "maybe you need root permission?\n",
+               netdev.c_str(), (res == PCAP_ERROR)? pcap_geterr(fp) :
+                                                    pcap_statustostr(res));
+      throw std::runtime_error(errmsg);
+   }
+   if (pcap_get_tstamp_precision(fp) == PCAP_TSTAMP_PRECISION_NANO)
+      fTstampUnit = 1e-9;
+}
+
+void TAGMpcap::configure_network_filters()
+{
+   // Vbias packets use the 802.3 length field in place of an ethertype,
+   // followed by the geoaddr and the packet type, 'S' or 'D' for the
+   // responses of the boards. Everything else on the segment, such as
+   // spanning tree and other LLC frames from the switches, is dropped
+   // in the kernel, together with the copies of our own outgoing frames.
+
+   std::string filter_string("ether[12:2] <= 1500 and (");
+   for (unsigned int i=0; i < fPacketTypes.size(); ++i) {
+      char term[30];
+      snprintf(term, sizeof(term), "%sether[15] = 0x%2.2x",
+               (i > 0)? " or " : "", (unsigned char)fPacketTypes[i]);
+      filter_string += term;
+   }
+   filter_string += ") and not ether src " + fHostMAC;
+   struct bpf_program pcap_filter_program;
+   int res = pcap_compile(fp, &pcap_filter_program,
+                          filter_string.c_str(), 1, PCAP_NETMASK_UNKNOWN);
+   if (res != 0) {
+      throw std::runtime_error("TAGMpcap::configure_network_filters"
+                               " error: pcap filter refuses to compile.");
+   }
+   res = pcap_setfilter(fp, &pcap_filter_program);
+   if (res != 0) {
+      throw std::runtime_error("TAGMpcap::configure_network_filters"
+                               " error: pcap filter refuses to load.");
+   }
+   pcap_freecode(&pcap_filter_program);
+}
+
+int TAGMpcap::send(const unsigned char *frames[], const int lens[], int count)
+{
+   // libpcap has no batch transmit, one system call per frame
+
+   for (int i=0; i < count; ++i) {
+      if (pcap_sendpacket(fp, frames[i], lens[i]) != 0) {
+         snprintf(fErrbuf, sizeof(fErrbuf), "%s", pcap_geterr(fp));
+         return -1;
+      }
+   }
+   return 0;
+}
+
+int TAGMpcap::receive(const unsigned char **frame, int *len, double deadline)
+{
+   // Wait until deadline for the next frame captured on the handle.
+   // Return value has the same meaning as for pcap_next_ex(), and the
+   // frame is only valid until the next call. A failure of the wait
+   // itself is an error, not a timeout, see geterr() for the cause.
+
+   pcap_pkthdr *header;
+   int resp = pcap_next_ex(fp, &header, frame);
+   while (resp == 0) {
+      int ready = wait_for_packet(deadline);
+      if (ready < 0)
+         return -1;
+      else if (ready == 0)
+         break;
+      resp = pcap_next_ex(fp, &header, frame);
+   }
+   if (resp < 0) {
+      snprintf(fErrbuf, sizeof(fErrbuf), "%s", pcap_geterr(fp));
+   }
+   else if (resp > 0) {
+      *len = header->caplen;
+      fRxTime = monotonic_from_wallclock(header->ts.tv_sec,
+                   (long)(header->ts.tv_usec * (fTstampUnit * 1e9)));
+   }
+   return resp;
+}
+
+int TAGMpcap::wait_for_packet(double deadline)
+{
+   // Block until a packet is ready to be read from the capture handle,
+   // or else until the deadline passes. Returns 1 if it is readable,
+   // 0 on timeout, and -1 if the wait itself fails, with the cause in
+   // fErrbuf. In immediate mode the descriptor becomes readable as soon
+   // as a packet arrives.
+
+   int fd = pcap_get_selectable_fd(fp);
+   if (fd < 0) {
+      snprintf(fErrbuf, sizeof(fErrbuf), "capture handle has no"
+               " selectable file descriptor");
+      return -1;
+   }
+   struct pollfd pfd;
+   pfd.fd = fd;
+   pfd.events = POLLIN;
+   while (1) {
+      double wait_s = deadline - monotonic_clock();
+      if (wait_s <= 0)
+         return 0;
+      struct timespec timeout;
+      timeout.tv_sec = (time_t)wait_s;
+      timeout.tv_nsec = (long)((wait_s - timeout.tv_sec) * 1e9);
+      pfd.revents = 0;
+      int res = ppoll(&pfd, 1, &timeout, 0);
+      if (res > 0)
+         return 1;
+      else if (res < 0 && errno != EINTR) {
+         snprintf(fErrbuf, sizeof(fErrbuf), "poll: %s", strerror(errno));
+         return -1;
+      }
+   }
+}
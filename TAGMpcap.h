@@ -0,0 +1,46 @@
+//
+// Class TAGMpcap
+//
+// Purpose: raw ethernet transport to the GlueX tagger microscope
+//          Vbias control boards through a libpcap capture handle
+//
+// The capture handle is set up with pcap_create() in immediate mode,
+// so each frame is handed over as soon as it arrives instead of being
+// held back to fill a buffer, with a kernel buffer sized to take the
+// responses from a full crate, and with nanosecond time stamps where
+// the platform offers them. It is left in non-blocking mode, with a
+// kernel filter that drops everything but 802.3 frames not sent by the
+// host itself. Waits for a response are done with ppoll() on the
+// selectable file descriptor of the handle.
+//
+// Requires the PCAP library, and root permission on the host.
+//
+
+#ifndef TAGMPCAP_H
+#define TAGMPCAP_H
+
+#include "TAGMtransport.h"
+
+extern "C" {
+#include <pcap.h>
+}
+
+class TAGMpcap : public TAGMtransport {
+ public:
+   TAGMpcap(const std::string &netdev, const std::string &packet_types);
+   ~TAGMpcap();
+
+   using TAGMtransport::send;
+   int send(const unsigned char *frames[], const int lens[], int count);
+   int receive(const unsigned char **frame, int *len, double deadline);
+
+ private:
+   pcap_t *fp;                     // capture handle on netdev
+   double fTstampUnit;             // seconds per tick of the fraction in time stamps
+
+   void configure_capture(const std::string &netdev);
+   void configure_network_filters();
+   int wait_for_packet(double deadline);
+};
+
+#endif
@@ -16,6 +16,25 @@
 //    are supported. The quotes are not a part of the literal message. All
 //    requests must be terminated with a newline character.
 //
+//    Any request that acts on a single board can name the board in front
+//    of it, as in "@<address>[::<netdev>] <request>", with the <address>
+//    and <netdev> given as for select below, eg. "@0x8e::eth0 getV 3".
+//    An addressed request acts on that board alone, and leaves the board
+//    selected on the connection as it was. Clients that address each of
+//    their requests need never select a board, and can go from board to
+//    board without paying for a select round trip.
+//
+//    A request can also carry a tag in front of it, as in
+//    "#<tag> @<address>[::<netdev>] <request>", where <tag> is any word
+//    the client chooses, and the response then starts with "#<tag> ".
+//    Tagged requests addressed to a board do not wait for each other:
+//    they are served in parallel and each one is answered as soon as it
+//    is done, so the responses can come back in a different order than
+//    the requests went out. Requests to the same board are still served
+//    in the order they were sent. All other requests are served in
+//    order, after everything sent before them has been answered and
+//    before anything sent after them is started.
+//
 //    *) "probe" - responds with a list of all Vbias boards that respond
 //       to a broadcast query.
 //    *) "select <address> [<netdev>]" - selects a particular front-end board
@@ -29,6 +48,9 @@
 //       selected board, or "none" if select has not been issued yet.
 //    *) "get_Geoaddr" - reports the geographical address of the currently
 //       selected board, or "none" if select has not been issued yet.
+//    *) "get_status" - reports the geoaddr and MAC address of the board and
+//                      the 17 raw status words of one S-packet in hex, from
+//                      which all of the status readings below can be decoded
 //    *) "get_Tchip" - reports the board temperature from T sensor chip (C)
 //    *) "get_pos5Vpower" - reports the +5V power level (V)
 //    *) "get_neg5Vpower" - reports the -5V power level (V)
@@ -45,6 +67,16 @@
 //    *) "get_VDAChealth" - reports the DAC channel 31 read-back level (V)
 //    *) "get_VDACdiode" - reports the DAC temperature diode voltage (V)
 //    *) "get_TDAC" - reports the DAC internal temperature reading (C)
+//    *) "get_readings" - reads the status and the voltages of the board
+//                        afresh, and reports them on one line: the fields
+//                        of get_status followed by the 32 voltages of
+//                        getV, so that a client can latch all readings
+//                        of the board in a single round trip
+//    *) "get_readings_all <address>[,<address>...] [<netdev>]" - reports
+//                        the same for every board in the list, one line
+//                        per board in the order given, with the exchanges
+//                        to all boards in flight at the same time; a board
+//                        that fails gets its error message on its line
 //    *) "latch_status" - capture board status in state variables and return
 //                          captured data in response to get_XXX()
 //    *) "passthru_status" - reset saved state from last latch_levels() and
@@ -58,10 +90,35 @@
 //                          in next ramp (V)
 //    *) "setV <chan> <V>" - );  // assign voltage <V> to channel <chan> to be
 //                           set in next ramp (V)
+//    *) "setV_many <mask>:<V>[,<V>...]" - assign voltages to all channels
+//                          set in the hexadecimal channel mask <mask> to be
+//                          set in next ramp (V), one value per channel in
+//                          increasing order of channel number
+//    *) "setV_many_all <address>:<mask>:<V>[,<V>...] [...] [<netdev>]" -
+//                          the same for every board in the list, so that
+//                          a client can stage the levels of all its boards
+//                          in a single message; the response has one line
+//                          per board in the order given, either "ok" or
+//                          the error message for that board
 //    *) "get_last_packet" - reports the last packet received from the board
 //    *) "ramp" - push the new voltages to the board, if any
 //    *) "reset" - send a hard reset to the board, if selected, otherwise
 //                 send the hard reset to all boards in the frontend.
+//
+// 2) Any number of clients may be connected at the same time. One thread
+//    watches all of the connections with epoll and hands each complete
+//    request to a pool of worker threads, so that a slow exchange with
+//    the frontend for one client does not hold up the others. Each
+//    connection has its own selected board, if it uses select at all,
+//    so that one client never redirects the requests of another one.
+//    Requests for the same board take turns while requests for different
+//    boards run together.
+//    Requests on one connection are served one at a time, in order,
+//    unless they are tagged as described above.
+// 3) A client that has been idle longer than the idle timeout (-i, in s)
+//    is disconnected, and so is one that starts a request and does not
+//    finish it within the request timeout (-t, in s), so that a stuck or
+//    vanished client cannot tie up the daemon.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -71,27 +128,238 @@
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
+#include <vector>
+#include <thread>
+#include <deque>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 
 #include <TAGMcontroller.h>
 
+#define MAX_REQUEST_SIZE 65535  // room for a setV_many_all of all boards
+#define MAX_REQUESTS_IN_FLIGHT 64  // tagged requests served at once per client
+#define MAX_OUTPUT_BACKLOG 1000000  // unread response bytes per client
+
 int listener_port = 5692;  // default listener port, you choose!
 int listener_socket;
-int listener_fd;
+int worker_count = 8;             // threads serving requests
+double idle_timeout = 3600;       // disconnect clients idle this long (s)
+double request_timeout = 10;      // time allowed to send one request (s)
 char *default_netdev = 0;
-TAGMcontroller *Vboard;
-std::map<std::string, TAGMcontroller*> Vboards;
+struct board_entry {
+   TAGMcontroller *board;        // 0 until the board has been connected
+   std::mutex opening;           // held while the board is being connected
+   board_entry() : board(0) {}
+};
+std::map<std::string, board_entry> Vboards;
+std::map<TAGMcontroller*, std::mutex> Vboard_locks;
+std::mutex Vboards_lock;          // protects Vboards and Vboard_locks
+
+std::mutex &board_lock(TAGMcontroller *board)
+{
+   // requests for the same board hold this while they are served
+
+   std::lock_guard<std::mutex> lock(Vboards_lock);
+   return Vboard_locks[board];
+}
 
-std::string process_request(const char* request)
+TAGMcontroller *open_board(const char *addr, const char *netdev,
+                           std::string &error)
 {
+   // Look up the board at address on netdev among those selected before,
+   // or else connect to it. Returns 0 with a message in error on failure.
+   // Connecting runs the discovery, which can take seconds if the board
+   // is not there, so it is done holding only the entry for this board;
+   // requests for other boards go on meanwhile.
+
+   unsigned char geoaddr;
+   unsigned char macaddr[6];
+   if (addr == 0)
+      addr = "";
+   std::string boardId(addr);
+   if (netdev != 0) {
+      boardId += "::";
+      boardId += netdev;
+   }
+   std::unique_lock<std::mutex> lock(Vboards_lock);
+   board_entry &entry = Vboards[boardId];
+   if (entry.board != 0)
+      return entry.board;
+   lock.unlock();
+
+   std::lock_guard<std::mutex> opening(entry.opening);
+   lock.lock();
+   if (entry.board != 0)
+      return entry.board;
+   lock.unlock();
+   TAGMcontroller *board;
+   if (sscanf(addr, "0x%2hhx", &geoaddr) == 1) {
+      try {
+         board = new TAGMcontroller(geoaddr, netdev);
+      }
+      catch (const std::runtime_error &err) {
+         error = std::string(err.what()) + "\n";
+         return 0;
+      }
+   }
+   else if (sscanf(addr, "%2.2hhx.%2.2hhx.%2.2hhx.%2.2hhx.%2.2hhx.%2.2hhx", 
+                   &macaddr[0], &macaddr[1], &macaddr[2],
+                   &macaddr[3], &macaddr[4], &macaddr[5]) == 6)
+   {
+      try {
+         board = new TAGMcontroller(macaddr, netdev);
+      }
+      catch (const std::runtime_error &err) {
+         error = std::string(err.what()) + "\n";
+         return 0;
+      }
+   }
+   else {
+      std::stringstream response;
+      response << "TAGMremotectrl error - "
+               << "invalid address " << addr << std::endl;
+      error = response.str();
+      return 0;
+   }
+   lock.lock();
+   entry.board = board;
+   return board;
+}
+
+std::string format_status(TAGMcontroller::StatusSnapshot &status)
+{
+   // geoaddr and MAC address of the board, and its 17 raw status words
+
+   std::stringstream response;
+   const unsigned char *macaddr = status.get_MACaddr();
+   char hexb[30];
+   sprintf(hexb, "0x%2.2x %2.2x.%2.2x.%2.2x.%2.2x.%2.2x.%2.2x",
+           status.get_Geoaddr(), macaddr[0], macaddr[1],
+           macaddr[2], macaddr[3], macaddr[4], macaddr[5]);
+   response << hexb;
+   const unsigned int *words = status.get_status_words();
+   for (int i=0; i < 17; ++i) {
+      sprintf(hexb, " %4.4x", words[i]);
+      response << hexb;
+   }
+   return response.str();
+}
+
+std::string format_readings(TAGMcontroller *board)
+{
+   // Read the status and voltages of board afresh and report them on
+   // one line, leaving the board passing requests through afterwards.
+
+   std::stringstream response;
+   board->passthru_status();
+   board->passthru_voltages();
+   try {
+      board->latch_readings();
+      TAGMcontroller::StatusSnapshot status = board->get_status();
+      response << format_status(status);
+      for (int chan=0; chan < 32; ++chan)
+         response << " " << board->getV(chan);
+   }
+   catch (const std::runtime_error &err) {
+      board->passthru_status();
+      board->passthru_voltages();
+      return std::string(err.what()) + "\n";
+   }
+   board->passthru_status();
+   board->passthru_voltages();
+   response << std::endl;
+   return response.str();
+}
+
+std::string stage_setpoints(TAGMcontroller *board, const char *spec)
+{
+   // Stage the voltages in spec := <mask>:<V>[,<V>...] on board for the
+   // next ramp, after checking that there is one value for every channel
+   // in the mask. Responds with "ok" or an error message on one line.
+
+   unsigned int mask;
+   int nchar = 0;
+   if (spec == 0 || sscanf(spec, "%x:%n", &mask, &nchar) != 1 || nchar == 0) {
+      std::stringstream response;
+      response << "TAGMremotectrl error - "
+               << "invalid setpoints " << ((spec)? spec : "") << std::endl;
+      return response.str();
+   }
+   double V[32];
+   const char *arg = spec + nchar;
+   for (int chan=0; chan < 32; ++chan) {
+      if ((mask & (1 << chan)) == 0)
+         continue;
+      char *end;
+      V[chan] = strtod(arg, &end);
+      if (end == arg || (*end != ',' && *end != 0)) {
+         std::stringstream response;
+         response << "TAGMremotectrl error - "
+                  << "invalid voltage for channel " << chan
+                  << " in setpoints " << spec << std::endl;
+         return response.str();
+      }
+      arg = (*end == ',')? end + 1 : end;
+   }
+   if (*arg != 0) {
+      std::stringstream response;
+      response << "TAGMremotectrl error - "
+               << "more voltages than channels in setpoints "
+               << spec << std::endl;
+      return response.str();
+   }
+   try {
+      board->setV_many(mask, V);
+   }
+   catch (const std::runtime_error &err) {
+      return std::string(err.what()) + "\n";
+   }
+   return std::string("ok\n");
+}
+
+std::string process_request(const char* request, TAGMcontroller *&selected)
+{
+   // Serve one request from a client whose selected board is selected,
+   // or for the board named in front of the request if there is one.
+   // Workers serve requests side by side, hence strtok_r.
+
    char mesg[strlen(request) + 2];
    strcpy(mesg, request);
-   char *req = strtok(mesg, " ");
-   if (req && strcmp(req, "probe") == 0) {
-      const char *netdev = strtok(0, " ");
+   char *saveptr;
+   char *req = strtok_r(mesg, " ", &saveptr);
+   TAGMcontroller *Vboard = selected;
+   if (req && req[0] == '@') {
+      char *addr = req + 1;
+      char *netdev = strstr(addr, "::");
+      if (netdev != 0) {
+         *netdev = 0;
+         netdev += 2;
+      }
+      if (netdev == 0 || strlen(netdev) == 0)
+         netdev = default_netdev;
+      std::string error;
+      Vboard = open_board(addr, netdev, error);
+      if (Vboard == 0)
+         return error;
+      req = strtok_r(0, " ", &saveptr);
+   }
+   if (req == 0) {
+      return std::string("TAGMremotectrl error - empty request\n");
+   }
+   else if (strcmp(req, "probe") == 0) {
+      const char *netdev = strtok_r(0, " ", &saveptr);
       if (netdev == 0 || strlen(netdev) == 0)
          netdev = default_netdev;
       std::map<unsigned char, std::string> boardlist;
@@ -110,7 +378,7 @@ std::string process_request(const char* request)
       return response.str();
    }
    else if (strcmp(req, "get_hostMACaddr") == 0) {
-      const char *netdev = strtok(0, " ");
+      const char *netdev = strtok_r(0, " ", &saveptr);
       if (netdev == 0 || strlen(netdev) == 0)
          netdev = default_netdev;
       TAGMcontroller *ctrl = Vboard;
@@ -126,7 +394,11 @@ std::string process_request(const char* request)
    }
    else if (strcmp(req, "reset") == 0) {
       TAGMcontroller *ctrl = Vboard;
-      if (ctrl == 0) {
+      std::unique_lock<std::mutex> serial;
+      if (ctrl != 0) {
+         serial = std::unique_lock<std::mutex>(board_lock(ctrl));
+      }
+      else {
          try {
             ctrl = new TAGMcontroller((unsigned char)0xff);
          }
@@ -154,54 +426,90 @@ std::string process_request(const char* request)
       return std::string("ok\n");
    }
    else if (strcmp(req, "select") == 0) {
-      unsigned char geoaddr;
-      unsigned char macaddr[6];
-      char *addr = strtok(0, " ");
-      char *netdev = strtok(0, " ");
+      char *addr = strtok_r(0, " ", &saveptr);
+      char *netdev = strtok_r(0, " ", &saveptr);
       if (netdev == 0 || strlen(netdev) == 0)
          netdev = default_netdev;
-      std::string boardId(addr);
-      if (netdev != 0) {
-         boardId += "::";
-         boardId += netdev;
-      }
-      if (Vboards.find(boardId) != Vboards.end()) {
-         Vboard = Vboards[boardId];
-      }
-      else if (sscanf(addr, "0x%2hhx", &geoaddr) == 1) {
-         try {
-            Vboard = new TAGMcontroller(geoaddr, netdev);
-         }
-         catch (const std::runtime_error &err) {
-            Vboard = 0;
-            return std::string(err.what()) + "\n";
-         }
-      }
-      else if (sscanf(addr, "%2.2hhx.%2.2hhx.%2.2hhx.%2.2hhx.%2.2hhx.%2.2hhx", 
-                      &macaddr[0], &macaddr[1], &macaddr[2],
-                      &macaddr[3], &macaddr[4], &macaddr[5]) == 6)
+      std::string error;
+      selected = open_board(addr, netdev, error);
+      if (selected == 0)
+         return error;
+      return std::string("ok\n");
+   }
+   else if (strcmp(req, "get_readings_all") == 0) {
+      char *addrlist = strtok_r(0, " ", &saveptr);
+      char *netdev = strtok_r(0, " ", &saveptr);
+      if (netdev == 0 || strlen(netdev) == 0)
+         netdev = default_netdev;
+      if (addrlist == 0) {
+         return std::string("TAGMremotectrl error - "
+                            "no boards listed in get_readings_all\n");
+      }
+      std::vector<TAGMcontroller*> boards;
+      std::vector<std::string> lines;
+      char *savelist;
+      for (char *addr = strtok_r(addrlist, ",", &savelist); addr;
+           addr = strtok_r(0, ",", &savelist))
       {
-         try {
-            Vboard = new TAGMcontroller(macaddr, netdev);
+         std::string error;
+         boards.push_back(open_board(addr, netdev, error));
+         lines.push_back(error);
+      }
+      std::vector<std::thread> workers;
+      for (unsigned int b=0; b < boards.size(); ++b) {
+         if (boards[b] == 0)
+            continue;
+         workers.push_back(std::thread([&, b]() {
+            std::lock_guard<std::mutex> serial(board_lock(boards[b]));
+            lines[b] = format_readings(boards[b]);
+         }));
+      }
+      for (unsigned int w=0; w < workers.size(); ++w)
+         workers[w].join();
+      std::string response;
+      for (unsigned int b=0; b < lines.size(); ++b)
+         response += lines[b];
+      return response;
+   }
+   else if (strcmp(req, "setV_many_all") == 0) {
+      std::vector<char*> blocks;
+      char *netdev = default_netdev;
+      for (char *arg = strtok_r(0, " ", &saveptr); arg;
+           arg = strtok_r(0, " ", &saveptr))
+      {
+         if (strchr(arg, ':'))
+            blocks.push_back(arg);
+         else if (strlen(arg) > 0)
+            netdev = arg;
+      }
+      if (blocks.size() == 0) {
+         return std::string("TAGMremotectrl error - "
+                            "no boards listed in setV_many_all\n");
+      }
+      std::string response;
+      for (unsigned int b=0; b < blocks.size(); ++b) {
+         char *spec = strchr(blocks[b], ':');
+         *spec++ = 0;
+         std::string error;
+         TAGMcontroller *board = open_board(blocks[b], netdev, error);
+         if (board == 0) {
+            response += error;
          }
-         catch (const std::runtime_error &err) {
-            Vboard = 0;
-            return std::string(err.what()) + "\n";
+         else {
+            std::lock_guard<std::mutex> serial(board_lock(board));
+            response += stage_setpoints(board, spec);
          }
       }
-      else {
-         std::stringstream response;
-         response << "TAGMremotectrl error - "
-                  << "invalid address " << addr << std::endl;
-         return response.str();
-      }
-      Vboards[boardId] = Vboard;
-      return std::string("ok\n");
+      return response;
    }
    else if (Vboard == 0) {
       return std::string("TAGMremotectrl error - no board selected\n");
    }
-   else if (strcmp(req, "get_MACaddr") == 0) {
+
+   // the rest act on the selected board, one request at a time
+
+   std::lock_guard<std::mutex> serial(board_lock(Vboard));
+   if (strcmp(req, "get_MACaddr") == 0) {
       const unsigned char *macaddr = Vboard->get_MACaddr();
       std::stringstream response;
       for (int i=0; i<6; ++i) {
@@ -218,6 +526,20 @@ std::string process_request(const char* request)
       sprintf(hexb, "0x%2.2x\n", geoaddr);
       return std::string(hexb);
    }
+   else if (strcmp(req, "get_status") == 0) {
+      std::stringstream response;
+      try {
+         TAGMcontroller::StatusSnapshot status = Vboard->get_status();
+         response << format_status(status) << std::endl;
+      }
+      catch (const std::runtime_error &err) {
+         return std::string(err.what()) + "\n";
+      }
+      return response.str();
+   }
+   else if (strcmp(req, "get_readings") == 0) {
+      return format_readings(Vboard);
+   }
    else if (strcmp(req, "get_Tchip") == 0) {
       std::stringstream response;
       try {
@@ -409,7 +731,7 @@ std::string process_request(const char* request)
    else if (strcmp(req, "getV") == 0) {
       std::stringstream response;
       unsigned int chan;
-      const char *arg = strtok(0, " ");
+      const char *arg = strtok_r(0, " ", &saveptr);
       if (arg && sscanf(arg, "%u", &chan) == 1) {
          try {
             response << Vboard->getV(chan) << std::endl;
@@ -427,7 +749,7 @@ std::string process_request(const char* request)
    else if (strcmp(req, "getVnew") == 0) {
       std::stringstream response;
       unsigned int chan;
-      const char *arg = strtok(0, " ");
+      const char *arg = strtok_r(0, " ", &saveptr);
       if (arg && sscanf(arg, "%u", &chan) == 1) {
          try {
             response << Vboard->getVnew(chan) << std::endl;
@@ -446,8 +768,8 @@ std::string process_request(const char* request)
       std::stringstream response;
       unsigned int chan;
       double V;
-      const char *arg1 = strtok(0, " ");
-      const char *arg2 = strtok(0, " ");
+      const char *arg1 = strtok_r(0, " ", &saveptr);
+      const char *arg2 = strtok_r(0, " ", &saveptr);
       if (arg1 == 0 || sscanf(arg1, "%u", &chan) != 1) {
          response << "TAGMremotectrl error - "
                   << "invalid channel " << arg1 << std::endl;
@@ -467,6 +789,9 @@ std::string process_request(const char* request)
       }
       return response.str();
    }
+   else if (strcmp(req, "setV_many") == 0) {
+      return stage_setpoints(Vboard, strtok_r(0, " ", &saveptr));
+   }
    else if (strcmp(req, "get_last_packet") == 0) {
       std::stringstream response;
       const unsigned char *pkt = Vboard->get_last_packet();
@@ -500,37 +825,454 @@ std::string process_request(const char* request)
    return std::string("unbelievable!\n");
 }
 
+
+struct client_connection;
+
+struct client_request {
+   client_connection *conn;
+   std::string request;        // request text, without tag
+   std::string tag;            // "#<tag>" for a tagged request, else empty
+   std::string board;          // "@<address>..." of an addressed request
+   bool in_order;              // served after all before it, alone
+   std::string response;
+};
+
+struct client_connection {
+   int fd;
+   std::string input;          // bytes received, not yet parsed
+   std::string output;         // response bytes not yet sent
+   std::deque<client_request*> waiting;  // parsed requests not yet served
+   std::set<std::string> boards_busy;  // addressed boards with a request being served
+   TAGMcontroller *Vboard;     // board selected on this connection
+   int inflight;               // requests being served by workers
+   bool in_order;              // the request being served is an in-order one
+   bool closing;               // client went away while requests were in flight
+   bool eof;                   // client has sent its last request
+   double last_active;         // time of the last request or response (s)
+   double request_start;       // time the pending request began, or 0 (s)
+};
+
+std::map<int, client_connection*> clients;
+int epoll_fd;
+int done_fd;                   // eventfd raised when a worker finishes
+
+std::deque<client_request*> work_queue;
+std::deque<client_request*> done_queue;
+std::mutex queue_lock;
+std::condition_variable work_ready;
+
+double now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void serve_requests()
+{
+   // Worker thread: serve requests from the work queue and hand the
+   // responses back to the main thread through the done queue. Only
+   // in-order requests touch the selected board of the connection, and
+   // they are never served together with another from the same client.
+
+   for (;;) {
+      client_request *work;
+      {
+         std::unique_lock<std::mutex> lock(queue_lock);
+         while (work_queue.size() == 0)
+            work_ready.wait(lock);
+         work = work_queue.front();
+         work_queue.pop_front();
+      }
+      TAGMcontroller *unselected = 0;
+      TAGMcontroller *&selected = (work->in_order)? work->conn->Vboard
+                                                  : unselected;
+      try {
+         work->response = process_request(work->request.c_str(), selected);
+      }
+      catch (const std::exception &err) {
+         work->response = std::string(err.what()) + "\n";
+      }
+      if (work->tag.size() > 0)
+         work->response = work->tag + " " + work->response;
+      {
+         std::lock_guard<std::mutex> lock(queue_lock);
+         done_queue.push_back(work);
+      }
+      uint64_t one = 1;
+      if (write(done_fd, &one, sizeof(one)) != sizeof(one))
+         perror("TAGMremotectrl error - cannot signal main thread");
+   }
+}
+
+void close_client(client_connection *conn, const char *reason)
+{
+   printf("closing connection on fd %d, %s\n", conn->fd, reason);
+   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+   close(conn->fd);
+   clients.erase(conn->fd);
+   for (unsigned int i=0; i < conn->waiting.size(); ++i)
+      delete conn->waiting[i];
+   delete conn;
+}
+
+void drop_client(client_connection *conn, const char *reason)
+{
+   // close the connection now, or else as soon as the workers
+   // have finished with the requests they are serving for it
+
+   if (conn->inflight > 0) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+      conn->closing = true;
+   }
+   else {
+      close_client(conn, reason);
+   }
+}
+
+bool release_client(client_connection *conn)
+{
+   // Close the connection of a client that has sent its last request,
+   // once everything it asked for has been answered and sent off.
+   // Returns true if the connection is gone.
+
+   if (conn->eof && conn->inflight == 0 && conn->waiting.size() == 0 &&
+       conn->output.size() == 0)
+   {
+      close_client(conn, "client disconnected");
+      return true;
+   }
+   return false;
+}
+
+bool flush_output(client_connection *conn)
+{
+   // Send as much of the pending output as the socket takes, and watch
+   // for it to drain if some is left. Returns false if the client is gone.
+
+   while (conn->output.size() > 0) {
+      int nbytes = send(conn->fd, conn->output.data(), conn->output.size(),
+                        MSG_NOSIGNAL);
+      if (nbytes > 0)
+         conn->output.erase(0, nbytes);
+      else if (nbytes < 0 && errno == EINTR)
+         continue;
+      else if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         break;
+      else
+         return false;
+   }
+   struct epoll_event ev;
+   ev.events = 0;
+   if (! conn->eof)
+      ev.events |= EPOLLIN;
+   if (conn->output.size() > 0)
+      ev.events |= EPOLLOUT;
+   ev.data.fd = conn->fd;
+   epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+   return true;
+}
+bool parse_requests(client_connection *conn)
+{
+   // Move the complete requests received from the client to its waiting
+   // list, splitting off the tag and noting the board addressed if any.
+   // Returns false if the client is to be disconnected for sending an
+   // oversized request. The time allowed to send a request counts from
+   // the end of the last one, so that a client streaming requests with
+   // one always partly received is not timed out.
+
+   bool consumed = false;
+   std::size_t eol;
+   while ((eol = conn->input.find('\n')) != conn->input.npos) {
+      consumed = true;
+      client_request *req = new client_request;
+      req->conn = conn;
+      req->request = conn->input.substr(0, eol);
+      conn->input.erase(0, eol + 1);
+      if (req->request.size() > 0 && req->request[0] == '#') {
+         std::size_t end = req->request.find(' ');
+         req->tag = req->request.substr(0, end);
+         req->request.erase(0, (end == req->request.npos)? end : end + 1);
+      }
+      if (req->request.size() > 0 && req->request[0] == '@')
+         req->board = req->request.substr(0, req->request.find(' '));
+      req->in_order = (req->tag.size() == 0 || req->board.size() == 0);
+      conn->waiting.push_back(req);
+   }
+   if (conn->input.size() == 0)
+      conn->request_start = 0;
+   else if (conn->input.size() > MAX_REQUEST_SIZE)
+      return false;
+   else if (consumed)
+      conn->request_start = now();
+   return true;
+}
+
+void dispatch_requests(client_connection *conn)
+{
+   // Hand the waiting requests from the client to the workers, as many
+   // as can be served now. A tagged request addressed to a board goes
+   // as soon as the last one for the same board is done, so requests
+   // for different boards are served in parallel and answered as they
+   // finish. Any other request waits for everything before it to be
+   // answered, and holds up everything after it until it is answered.
+   // Nothing more is started while responses are piling up unread.
+
+   if (conn->closing)
+      return;
+   std::size_t next = 0;
+   while (next < conn->waiting.size() && ! conn->in_order &&
+          conn->inflight < MAX_REQUESTS_IN_FLIGHT &&
+          conn->output.size() < MAX_OUTPUT_BACKLOG)
+   {
+      client_request *req = conn->waiting[next];
+      if (req->in_order) {
+         if (next > 0 || conn->inflight > 0)
+            break;
+         conn->in_order = true;
+      }
+      else if (conn->boards_busy.count(req->board) > 0) {
+         ++next;
+         continue;
+      }
+      else {
+         conn->boards_busy.insert(req->board);
+      }
+      conn->waiting.erase(conn->waiting.begin() + next);
+      conn->inflight++;
+      conn->last_active = now();
+      {
+         std::lock_guard<std::mutex> lock(queue_lock);
+         work_queue.push_back(req);
+      }
+      work_ready.notify_one();
+   }
+}
+
+void accept_clients()
+{
+   for (;;) {
+      struct sockaddr_in clientaddr;
+      socklen_t clientaddr_len = sizeof(clientaddr);
+      int fd = accept4(listener_socket, (sockaddr*)&clientaddr,
+                       &clientaddr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+         // we may break out of accept if the system call
+         // was interrupted. In this case, loop back and try again
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept failed");
+         return;
+      }
+      int nodelay = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+      client_connection *conn = new client_connection;
+      conn->fd = fd;
+      conn->Vboard = 0;
+      conn->inflight = 0;
+      conn->in_order = false;
+      conn->closing = false;
+      conn->eof = false;
+      conn->last_active = now();
+      conn->request_start = 0;
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+         perror("TAGMremotectrl error - cannot watch new connection");
+         close(fd);
+         delete conn;
+         continue;
+      }
+      clients[fd] = conn;
+      printf("just got a new connection from %s on fd %d\n",
+             inet_ntoa(clientaddr.sin_addr), fd);
+   }
+}
+
+void read_client(client_connection *conn, uint32_t events)
+{
+   // Take in what the client has sent and start on the requests in it.
+   // A client that shuts down its sending side still gets the answers
+   // to all the requests it sent before, then the connection is closed.
+
+   char buffer[4096];
+   while (! conn->eof) {
+      int nbytes = read(conn->fd, buffer, sizeof(buffer));
+      if (nbytes > 0) {
+         if (conn->input.size() == 0)
+            conn->request_start = now();
+         conn->input.append(buffer, nbytes);
+         continue;
+      }
+      else if (nbytes < 0 && errno == EINTR) {
+         continue;
+      }
+      else if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         break;
+      }
+      else if (nbytes < 0) {
+         drop_client(conn, "client disconnected");
+         return;
+      }
+      conn->eof = true;
+   }
+   if (! parse_requests(conn)) {
+      drop_client(conn, "request too long");
+      return;
+   }
+   if (conn->eof) {
+      if (events & (EPOLLHUP | EPOLLERR)) {
+         // gone for good, nobody is left to read the answers
+         drop_client(conn, "client disconnected");
+         return;
+      }
+      conn->input.clear();
+      conn->request_start = 0;
+      if (! flush_output(conn)) {
+         drop_client(conn, "client disconnected");
+         return;
+      }
+   }
+   dispatch_requests(conn);
+   release_client(conn);
+}
+
+void finish_requests()
+{
+   // Pass the responses from the workers back to their clients, and
+   // start on the next requests from each client if it has sent any.
+
+   uint64_t count;
+   if (read(done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      perror("TAGMremotectrl error - cannot read worker signal");
+   std::deque<client_request*> done;
+   {
+      std::lock_guard<std::mutex> lock(queue_lock);
+      done.swap(done_queue);
+   }
+   for (unsigned int i=0; i < done.size(); ++i) {
+      client_request *req = done[i];
+      client_connection *conn = req->conn;
+      conn->inflight--;
+      if (req->in_order)
+         conn->in_order = false;
+      else
+         conn->boards_busy.erase(req->board);
+      if (conn->closing) {
+         if (conn->inflight == 0)
+            close_client(conn, "client disconnected");
+         delete req;
+         continue;
+      }
+      conn->output += req->response;
+      conn->output += '\0';
+      conn->last_active = now();
+      delete req;
+      if (! flush_output(conn)) {
+         drop_client(conn, "client disconnected");
+         continue;
+      }
+      dispatch_requests(conn);
+      release_client(conn);
+   }
+}
+
+void expire_clients()
+{
+   // disconnect clients that have been idle too long, or are
+   // taking too long to send the request they have started
+
+   double t = now();
+   std::vector<client_connection*> expired;
+   std::vector<const char*> reasons;
+   std::map<int, client_connection*>::iterator iter;
+   for (iter = clients.begin(); iter != clients.end(); ++iter) {
+      client_connection *conn = iter->second;
+      if (conn->inflight > 0 || conn->waiting.size() > 0)
+         continue;
+      else if (conn->request_start > 0 &&
+               t - conn->request_start > request_timeout)
+      {
+         expired.push_back(conn);
+         reasons.push_back("request timed out");
+      }
+      else if (conn->input.size() == 0 && t - conn->last_active > idle_timeout)
+      {
+         expired.push_back(conn);
+         reasons.push_back("idle timeout");
+      }
+   }
+   for (unsigned int i=0; i < expired.size(); ++i)
+      close_client(expired[i], reasons[i]);
+}
+
+void usage()
+{
+   std::cerr << "Usage: TAGMremotectrl [-p <port>] [-w <workers>]"
+             << " [-i <idle_timeout>] [-t <request_timeout>]"
+             << " [<network_device>]"
+             << std::endl
+             << " where <port> is the listening port"
+             << " through which clients will connect to this daemon,"
+             << std::endl
+             << " <workers> is the number of requests that can be"
+             << " served at the same time (default " << worker_count << "),"
+             << std::endl
+             << " <idle_timeout> is the time in seconds after which an"
+             << " idle client is disconnected (default " << idle_timeout
+             << "),"
+             << std::endl
+             << " <request_timeout> is the time in seconds a client has"
+             << " to send a request once it starts (default "
+             << request_timeout << "),"
+             << std::endl
+             << " and <network_device> is the name of the NIC" 
+             << " connecting to the TAGM frontend, eg. eth0"
+             << std::endl;
+   exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-   default_netdev = (char*)malloc(strlen(DEFAULT_NETWORK_DEVICE));
+   default_netdev = (char*)malloc(strlen(DEFAULT_NETWORK_DEVICE) + 1);
    strcpy(default_netdev, DEFAULT_NETWORK_DEVICE);
    for (int iarg = 1; iarg < argc; ++iarg) {
-      if (strcmp(argv[iarg], "-p") == 0 &&
-          sscanf(argv[++iarg], "%d", &listener_port) == 1)
+      if (strcmp(argv[iarg], "-p") == 0 && iarg + 1 < argc &&
+          sscanf(argv[iarg + 1], "%d", &listener_port) == 1)
       {
          ++iarg;
       }
-      else if (strcmp(argv[iarg], "-?") == 0 ||
-               strcmp(argv[iarg], "-h") == 0 ||
-               strcmp(argv[iarg], "--help") == 0 ||
-               argv[iarg][0] == '-' || argc - iarg > 2)
+      else if (strcmp(argv[iarg], "-w") == 0 && iarg + 1 < argc &&
+               sscanf(argv[iarg + 1], "%d", &worker_count) == 1 &&
+               worker_count > 0)
       {
-         std::cerr << "Usage: TAGMremotectrl [-p <port>] [<network_device>]"
-                   << std::endl
-                   << " where <port> is the listening port"
-                   << " through which clients will connect to this daemon"
-                   << std::endl
-                   << " and <network_device> is the name of the NIC" 
-                   << " connecting to the TAGM frontend, eg. eth0"
-                   << std::endl;
-         exit(1);
+         ++iarg;
+      }
+      else if (strcmp(argv[iarg], "-i") == 0 && iarg + 1 < argc &&
+               sscanf(argv[iarg + 1], "%lf", &idle_timeout) == 1)
+      {
+         ++iarg;
+      }
+      else if (strcmp(argv[iarg], "-t") == 0 && iarg + 1 < argc &&
+               sscanf(argv[iarg + 1], "%lf", &request_timeout) == 1)
+      {
+         ++iarg;
+      }
+      else if (argv[iarg][0] == '-' || iarg + 1 < argc) {
+         usage();
       }
       else {
          default_netdev = (char *)malloc(strlen(argv[iarg]) + 1);
          strcpy(default_netdev, argv[iarg]);
       }
    }
-   Vboard = 0;
+
+   // a client that disconnects before its response is sent
+   // must not take the daemon down with it
+   signal(SIGPIPE, SIG_IGN);
+   setvbuf(stdout, 0, _IOLBF, 0);
 
    // open a listening tcp port and wait for incoming connections
 
@@ -540,6 +1282,8 @@ int main(int argc, char *argv[])
       perror(errmesg);
       exit(1);
    }
+   int reuse = 1;
+   setsockopt(listener_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
    struct sockaddr_in myaddr;
    memset((char *)&myaddr, 0, sizeof(myaddr));
    myaddr.sin_family = AF_INET;
@@ -554,51 +1298,65 @@ int main(int argc, char *argv[])
       perror(errmesg);
       exit(1);
    }
-   if (listen(listener_socket, 0) < 0) {
+   if (listen(listener_socket, SOMAXCONN) < 0) {
       char errmesg[100];
       sprintf(errmesg, "Cannot listen on port %d", listener_port);
       perror(errmesg);
       exit(1);
    }
-   
+   fcntl(listener_socket, F_SETFL, fcntl(listener_socket, F_GETFL) | O_NONBLOCK);
+
+   epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (epoll_fd < 0 || done_fd < 0) {
+      perror("Cannot set up the event loop");
+      exit(1);
+   }
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.fd = listener_socket;
+   epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener_socket, &ev);
+   ev.events = EPOLLIN;
+   ev.data.fd = done_fd;
+   epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_fd, &ev);
+
+   for (int w=0; w < worker_count; ++w)
+      std::thread(serve_requests).detach();
+
+   printf("waiting for clients to connect on port %d...\n", listener_port);
    for (;;) {
-      printf("waiting for a client to connect...\n");
-      struct sockaddr_in clientaddr;
-      socklen_t clientaddr_len = sizeof(clientaddr);
-      while ((listener_fd = accept(listener_socket, 
-                                   (sockaddr*)&clientaddr, 
-                                   &clientaddr_len)) < 0)
-      {
-         // we may break out of accept if the system call
-         // was interrupted. In this case, loop back and try again
-         if ((errno != ECHILD) && (errno != ERESTART) && (errno != EINTR)) {
-            perror("accept failed");
-            exit(1);
-         }
+      struct epoll_event events[64];
+      int nevents = epoll_wait(epoll_fd, events, 64, 1000);
+      if (nevents < 0 && errno != EINTR) {
+         perror("epoll_wait failed");
+         exit(1);
       }
-      printf("just got a new connection, waiting for messages.\n");
-
-      for (;;) {
-         int request_len;
-         int buffer_size = 999;
-         char request[buffer_size];
-         char *buffer = request;
-         while (int nbytes = read(listener_fd, buffer, buffer_size)) {
-            buffer_size -= nbytes;
-            buffer += nbytes;
-            if (buffer[-1] == '\n') {
-               buffer[-1] = 0;
-               break;
-            }
+      for (int i=0; i < nevents; ++i) {
+         int fd = events[i].data.fd;
+         if (fd == listener_socket) {
+            accept_clients();
+            continue;
          }
-         if (buffer == request) {
-            break;
+         else if (fd == done_fd) {
+            finish_requests();
+            continue;
          }
-         else {
-            std::string response = process_request(request);
-            write(listener_fd, response.c_str(), response.size() + 1);
+         std::map<int, client_connection*>::iterator iter = clients.find(fd);
+         if (iter == clients.end())
+            continue;
+         client_connection *conn = iter->second;
+         if (events[i].events & EPOLLOUT) {
+            if (! flush_output(conn)) {
+               drop_client(conn, "client disconnected");
+               continue;
+            }
+            dispatch_requests(conn);
+            if (release_client(conn))
+               continue;
          }
+         if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            read_client(conn, events[i].events);
       }
+      expire_clients();
    }
-   close(listener_fd);
 }
@@ -0,0 +1,125 @@
+//
+// Class implementation: TAGMtransport
+//
+// Purpose: abstract raw ethernet transport between the host and the
+//          Vbias control boards of the GlueX tagger microscope
+//
+
+#include "TAGMtransport.h"
+#include "TAGMpcap.h"
+#include "TAGMpacketring.h"
+#include "TAGMloopback.h"
+#include <stdexcept>
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+
+TAGMtransport::TAGMtransport()
+ : fRxTime(0)
+{
+   fErrbuf[0] = 0;
+}
+
+TAGMtransport::~TAGMtransport()
+{
+}
+
+TAGMtransport *TAGMtransport::open(const std::string &transport,
+                                   const std::string &netdev,
+                                   const std::string &packet_types)
+{
+   if (transport == "pcap")
+      return new TAGMpcap(netdev, packet_types);
+   else if (transport == "afpacket")
+      return new TAGMpacketring(netdev, packet_types);
+   else if (transport == "loopback")
+      return new TAGMloopback(netdev);
+   char errmsg[160];
+   snprintf(errmsg, sizeof(errmsg),
+            "TAGMtransport::open error: "
+            "unknown transport %.40s", transport.c_str());
+   throw std::runtime_error(errmsg);
+}
+
+double TAGMtransport::monotonic_clock()
+{
+   // Time in seconds on the monotonic clock, used for
+   // turning response timeouts into absolute deadlines.
+
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+double TAGMtransport::monotonic_from_wallclock(long sec, long nsec)
+{
+   // Kernel receive time stamps are taken on the wall clock, so they
+   // are shifted by the present offset between the two clocks. This is
+   // good to a few us as long as the wall clock is not being stepped.
+
+   struct timespec wall, mono;
+   clock_gettime(CLOCK_REALTIME, &wall);
+   clock_gettime(CLOCK_MONOTONIC, &mono);
+   return (sec - wall.tv_sec) + (nsec - wall.tv_nsec) * 1e-9 +
+          mono.tv_sec + mono.tv_nsec * 1e-9;
+}
+
+std::string TAGMtransport::interface_MAC(const std::string &netdev)
+{
+   // return the MAC address of host interface netdev encoded as a string
+
+   struct ifreq ifr;
+   if (netdev.size() < sizeof(ifr.ifr_name)) {
+      memcpy(ifr.ifr_name, netdev.c_str(), netdev.size());
+      ifr.ifr_name[netdev.size()] = 0;
+   }
+   else {
+      char errmsg[160];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMtransport::interface_MAC error: "
+               "interface name %.40s is too long "
+               "for host MAC address lookup method.",
+               netdev.c_str());
+      throw std::runtime_error(errmsg);
+   }
+
+   int fd = socket(AF_UNIX,SOCK_DGRAM,0);
+   if (fd == -1) {
+      char errmsg[160];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMtransport::interface_MAC error: "
+               "failed to open ethernet socket on device %.40s.",
+               netdev.c_str());
+      throw std::runtime_error(errmsg);
+   }
+   if (ioctl(fd,SIOCGIFHWADDR,&ifr) == -1) {
+      int temp_errno = errno;
+      close(fd);
+      throw std::runtime_error(strerror(temp_errno));
+   }
+   close(fd);
+   if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+      char errmsg[160];
+      snprintf(errmsg, sizeof(errmsg),
+               "TAGMtransport::interface_MAC error: "
+               "%.40s is not an ethernet interface.",
+               netdev.c_str());
+      throw std::runtime_error(errmsg);
+   }
+   char MACaddr[25];
+   sprintf(MACaddr, "%2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x",
+           (unsigned char)ifr.ifr_hwaddr.sa_data[0],
+           (unsigned char)ifr.ifr_hwaddr.sa_data[1],
+           (unsigned char)ifr.ifr_hwaddr.sa_data[2],
+           (unsigned char)ifr.ifr_hwaddr.sa_data[3],
+           (unsigned char)ifr.ifr_hwaddr.sa_data[4],
+           (unsigned char)ifr.ifr_hwaddr.sa_data[5]);
+   return std::string(MACaddr);
+}
@@ -0,0 +1,78 @@
+//
+// Class TAGMtransport
+//
+// Purpose: abstract raw ethernet transport between the host and the
+//          Vbias control boards of the GlueX tagger microscope
+//
+// TAGMcontroller formats the Q/S, P/D and R packets of the board
+// protocol, and hands them to a transport to be sent out and to
+// capture the responses. Three implementations are provided,
+// selected by name when a network device is opened:
+//    "pcap"     - libpcap capture handle (TAGMpcap, the default)
+//    "afpacket" - Linux AF_PACKET socket with mmap'ed receive ring
+//                 (TAGMpacketring)
+//    "loopback" - in-process connection to a set of simulated boards
+//                 (TAGMloopback), needs no root access or hardware
+// Every transport delivers only 802.3 frames (length field <= 1500)
+// of the packet types asked for when it was opened, 'S' and 'D' for
+// the responses of the boards by default, that were not sent by the
+// host itself, and records the time each
+// one was received, taken from the kernel time stamp where there is
+// one, converted to the monotonic clock used for deadlines.
+//
+
+#ifndef TAGMTRANSPORT_H
+#define TAGMTRANSPORT_H
+
+#include <string>
+
+class TAGMtransport {
+ public:
+   virtual ~TAGMtransport();
+
+   static TAGMtransport *open(const std::string &transport,
+                              const std::string &netdev,
+                              const std::string &packet_types="SD");  // create transport of the named kind on netdev
+   static std::string interface_MAC(const std::string &netdev);  // MAC address of host interface netdev
+   static double monotonic_clock();    // time base for receive deadlines (s)
+   static double monotonic_from_wallclock(long sec, long nsec);  // convert a kernel time stamp to the monotonic clock (s)
+
+   virtual const std::string &get_hostMAC();  // MAC address the host sends from
+   virtual int send(const unsigned char *frames[],
+                    const int lens[], int count) = 0;   // transmit count frames, return 0 or -1
+   int send(const unsigned char *frame, int len);       // transmit one frame, return 0 or -1
+   virtual int receive(const unsigned char **frame, int *len,
+                       double deadline) = 0;            // next frame before deadline, return 1, 0 on timeout, or -1
+   virtual const char *geterr();       // text of the last error
+   double get_rx_time();               // time the last frame from receive() arrived, on the monotonic clock (s)
+
+ protected:
+   TAGMtransport();
+
+   std::string fHostMAC;           // MAC address of host, eg. "00:1b:21:3c:4d:5e"
+   std::string fPacketTypes;       // packet types (byte 15) let through, eg. "SD"
+   char fErrbuf[256];              // text of the last error
+   double fRxTime;                 // monotonic time the last frame was received (s)
+};
+
+inline int TAGMtransport::send(const unsigned char *frame, int len) {
+   // transmit one frame, return 0 or -1
+   return send(&frame, &len, 1);
+}
+
+inline const std::string &TAGMtransport::get_hostMAC() {
+   // MAC address the host sends from
+   return fHostMAC;
+}
+
+inline double TAGMtransport::get_rx_time() {
+   // time the last frame from receive() arrived, on the monotonic clock (s)
+   return fRxTime;
+}
+
+inline const char *TAGMtransport::geterr() {
+   // text of the last error
+   return fErrbuf;
+}
+
+#endif
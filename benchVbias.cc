@@ -0,0 +1,278 @@
+//
+// benchVbias - command-line tool to measure the latency of request/response
+//              exchanges with a single SiPM bias control card, addressed
+//              by geoaddr. Experts only, the -R option resets the card!
+//
+// version: october 17, 2026
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <math.h>
+
+#include <TAGMcontroller.h>
+#include <TAGMcommunicator.h>
+#include <TAGMtransport.h>
+
+std::string server;
+std::string transport(getenv("TAGM_TRANSPORT")? getenv("TAGM_TRANSPORT")
+                                               : "pcap");
+int repeat_count = 100;
+int do_reset = 0;
+int do_reopen = 0;
+
+// Every heap allocation made by the thread that runs the exchanges is
+// counted, to check that the exchanges themselves allocate nothing.
+static thread_local unsigned long allocations = 0;
+
+void *operator new(std::size_t size)
+{
+   ++allocations;
+   void *ptr = malloc((size > 0)? size : 1);
+   if (ptr == 0)
+      throw std::bad_alloc();
+   return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+   free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+   free(ptr);
+}
+
+void usage()
+{
+   std::cerr << "Usage: benchVbias [-n <count>] [-R] [-L] [-O] "
+             << "<0xHH>[@[<hostname>[:<port>]::][netdev]]"
+             << std::endl
+             << " where <0xHH> is the 8-bit geographic address" << std::endl
+             << " of the desired Vbias card in hex notation, " << std::endl
+             << " and <netdev> is the network device (eg. eth0)" << std::endl
+             << " that communicates with the TAGM frontend." << std::endl
+             << " If <netdev> is on another machine that is" << std::endl
+             << " running the TAGMremotectrl daemon then that" << std::endl
+             << " can be specified by including the <hostname>" << std::endl
+             << " and <port> fields on the command line as shown." << std::endl
+             << "Options:" << std::endl
+             << " -n <count>: number of exchanges of each kind to time,"
+             << " default 100" << std::endl
+             << " -R : also time reset(), which drops all Vbias levels"
+             << " on the card to zero!" << std::endl
+             << " -L : time the exchanges against simulated cards on the"
+             << " loopback transport" << std::endl
+             << " -O : also open and close a capture handle on <netdev>"
+             << " around every" << std::endl
+             << "      timed exchange, for comparison with the cost of"
+             << " reopening it per request" << std::endl;
+   exit(1);
+}
+
+double elapsed_us(const struct timespec &t0, const struct timespec &t1)
+{
+   return (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) * 1e-3;
+}
+
+double percentile(std::vector<double> &sorted, double p)
+{
+   // nearest-rank percentile of an ascending list of samples
+   int n = sorted.size();
+   int rank = (int)ceil(p / 100 * n);
+   return sorted[(rank > 0)? rank - 1 : 0];
+}
+
+void report(const char *what, std::vector<double> t_us)
+{
+   char line[120];
+   if (t_us.size() == 0) {
+      sprintf(line, "%-16s      no samples", what);
+   }
+   else {
+      std::sort(t_us.begin(), t_us.end());
+      sprintf(line, "%-16s %6d %10.1f %10.1f %10.1f %10.1f %10.1f",
+              what, (int)t_us.size(), t_us[0], percentile(t_us, 50),
+              percentile(t_us, 90), percentile(t_us, 99), t_us.back());
+   }
+   std::cout << line << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+   int iarg;
+   for (iarg = 1; iarg < argc && argv[iarg][0] == '-'; ++iarg) {
+      if (strcmp(argv[iarg], "-n") == 0 && iarg + 1 < argc &&
+          sscanf(argv[iarg + 1], "%d", &repeat_count) == 1)
+      {
+         ++iarg;
+      }
+      else if (strcmp(argv[iarg], "-R") == 0) {
+         do_reset = 1;
+      }
+      else if (strcmp(argv[iarg], "-L") == 0) {
+         TAGMcontroller::select_transport("loopback");
+         transport = "loopback";
+      }
+      else if (strcmp(argv[iarg], "-O") == 0) {
+         do_reopen = 1;
+      }
+      else {
+         usage();
+      }
+   }
+   if (iarg != argc - 1)
+      usage();
+
+   int geoaddr;
+   std::string arg1(argv[iarg]);
+   std::size_t delim = arg1.find("@");
+   if (sscanf(arg1.substr(0, delim).c_str(), "%x", &geoaddr) != 1) {
+      usage();
+   }
+   const char *netdev = 0;
+   std::string arg1dev;
+   if (delim != arg1.npos) {
+      arg1dev = arg1.substr(delim + 1);
+      if (arg1dev.find(":") == arg1dev.npos) {
+         if (arg1dev.size() > 0)
+            netdev = arg1dev.c_str();
+      }
+      else {
+         server = arg1dev;
+      }
+   }
+
+   if (do_reopen && server.size() > 0) {
+      std::cerr << "benchVbias error: -O needs a local netdev" << std::endl;
+      exit(1);
+   }
+   std::string reopen_netdev((netdev != 0)? netdev : DEFAULT_NETWORK_DEVICE);
+
+   TAGMcontroller *ctrl;
+   struct timespec t0, t1, c0, c1;
+   std::vector<double> t_construct, t_status, t_voltages, t_reset;
+   std::vector<double> rtt_QS, rtt_PD;
+   std::vector<double> cpu_status, cpu_voltages;
+   t_status.reserve(repeat_count);
+   t_voltages.reserve(repeat_count);
+   rtt_QS.reserve(repeat_count);
+   rtt_PD.reserve(repeat_count);
+   cpu_status.reserve(repeat_count);
+   cpu_voltages.reserve(repeat_count);
+   unsigned long allocs_status = 0;
+   unsigned long allocs_voltages = 0;
+   try {
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      if (server.size() == 0) {
+         ctrl = new TAGMcontroller((unsigned char)geoaddr, netdev);
+      }
+      else {
+         ctrl = new TAGMcommunicator((unsigned char)geoaddr, server);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      t_construct.push_back(elapsed_us(t0, t1));
+
+      // fetch_status(): one Q-packet out, one S-packet back
+      for (int i=0; i < repeat_count; ++i) {
+         ctrl->passthru_status();
+         unsigned long allocs = allocations;
+         clock_gettime(CLOCK_MONOTONIC, &t0);
+         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0);
+         if (do_reopen)
+            delete TAGMtransport::open(transport, reopen_netdev);
+         ctrl->latch_status();
+         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c1);
+         clock_gettime(CLOCK_MONOTONIC, &t1);
+         allocs_status += allocations - allocs;
+         t_status.push_back(elapsed_us(t0, t1));
+         cpu_status.push_back(elapsed_us(c0, c1));
+         rtt_QS.push_back(ctrl->get_last_rtt() * 1e6);
+      }
+
+      // set_voltages(): one P-packet out, one D-packet back
+      for (int i=0; i < repeat_count; ++i) {
+         ctrl->passthru_voltages();
+         unsigned long allocs = allocations;
+         clock_gettime(CLOCK_MONOTONIC, &t0);
+         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0);
+         if (do_reopen)
+            delete TAGMtransport::open(transport, reopen_netdev);
+         ctrl->latch_voltages();
+         clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c1);
+         clock_gettime(CLOCK_MONOTONIC, &t1);
+         allocs_voltages += allocations - allocs;
+         t_voltages.push_back(elapsed_us(t0, t1));
+         cpu_voltages.push_back(elapsed_us(c0, c1));
+         rtt_PD.push_back(ctrl->get_last_rtt() * 1e6);
+      }
+
+      // reset(): R/S, then Q/S, then P/D exchanges
+      for (int i=0; do_reset && i < repeat_count; ++i) {
+         clock_gettime(CLOCK_MONOTONIC, &t0);
+         if (! ctrl->reset()) {
+            std::cerr << "Error returned by reset() method for board at "
+                      << std::hex << geoaddr << std::endl;
+            exit(4);
+         }
+         clock_gettime(CLOCK_MONOTONIC, &t1);
+         t_reset.push_back(elapsed_us(t0, t1));
+      }
+   }
+   catch (const std::runtime_error &err) {
+      std::cerr << err.what() << std::endl;
+      exit(5);
+   }
+
+   std::cout << std::endl
+             << "Exchange latencies with Vbias board "
+             << std::hex << geoaddr << std::dec << " (us):"
+             << std::endl
+             << "request           count        min        p50"
+             << "        p90        p99        max" << std::endl
+             << "------------------------------------------------"
+             << "------------------------------" << std::endl;
+   report("constructor", t_construct);
+   report("fetch_status", t_status);
+   report("set_voltages", t_voltages);
+   if (do_reset)
+      report("reset", t_reset);
+   std::cout << std::endl
+             << "Round-trip times from request sent to response"
+             << " received (us):" << std::endl
+             << "exchange          count        min        p50"
+             << "        p90        p99        max" << std::endl
+             << "------------------------------------------------"
+             << "------------------------------" << std::endl;
+   report("Q/S", rtt_QS);
+   report("P/D", rtt_PD);
+   std::cout << std::endl
+             << "CPU time spent by the calling thread per exchange (us):"
+             << std::endl
+             << "request           count        min        p50"
+             << "        p90        p99        max" << std::endl
+             << "------------------------------------------------"
+             << "------------------------------" << std::endl;
+   report("fetch_status", cpu_status);
+   report("set_voltages", cpu_voltages);
+   if (repeat_count > 0) {
+      char line[120];
+      std::cout << std::endl
+                << "Heap allocations per exchange:" << std::endl;
+      sprintf(line, "%-16s %10.2f", "fetch_status",
+              allocs_status / (double)repeat_count);
+      std::cout << line << std::endl;
+      sprintf(line, "%-16s %10.2f", "set_voltages",
+              allocs_voltages / (double)repeat_count);
+      std::cout << line << std::endl;
+   }
+   std::cout << std::endl;
+   delete ctrl;
+}
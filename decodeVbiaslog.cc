@@ -0,0 +1,117 @@
+//
+// decodeVbiaslog - command-line tool to print the binary packet log kept
+//                  by the Vbias utilities and the TAGMremotectrl daemon
+//                  in the human-readable form of the old text log.
+//
+// version: october 17, 2026
+
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <vector>
+
+#include <TAGMpacketlog.h>
+
+void usage()
+{
+   std::cerr << "Usage: decodeVbiaslog [<logfile> ...]" << std::endl
+             << " where each <logfile> is a packet log written by the"
+             << std::endl
+             << " TAGMcontroller class, default " << PACKETLOG_FILE
+             << std::endl
+             << " (the one before it was rotated is "
+             << PACKETLOG_FILE << ".old)." << std::endl
+             << " The files are printed to stdout in the order given."
+             << std::endl;
+   exit(1);
+}
+
+int decode(const char *filename)
+{
+   // Print every record in the log file, converting the monotonic
+   // time stamps to wall clock time with the offset from the most
+   // recent file header. Returns 0 on success, nonzero if the file
+   // could not be read or is not a packet log.
+
+   std::ifstream logfile(filename, std::ios_base::binary);
+   if (!logfile) {
+      std::cerr << "decodeVbiaslog error: cannot open " << filename
+                << std::endl;
+      return 1;
+   }
+   const int magic_len = strlen(PACKETLOG_MAGIC);
+   bool have_header = false;
+   double offset = 0;
+   std::vector<char> msg;
+   std::vector<unsigned char> packet;
+   std::vector<unsigned char> refpacket;
+   bool truncated = true;
+   while (true) {
+      char head[8];
+      if (! logfile.read(head, sizeof(head))) {
+         truncated = (logfile.gcount() > 0);
+         break;
+      }
+      if (memcmp(head, PACKETLOG_MAGIC, magic_len) == 0) {
+         if (! logfile.read((char*)&offset, sizeof(offset)))
+            break;
+         have_header = true;
+         continue;
+      }
+      else if (! have_header) {
+         std::cerr << "decodeVbiaslog error: " << filename
+                   << " is not a Vbias packet log" << std::endl;
+         return 2;
+      }
+      double time;
+      memcpy(&time, head, sizeof(time));
+      unsigned short lens[3];
+      if (! logfile.read((char*)lens, sizeof(lens)))
+         break;
+
+      // frames are padded out to full length with zeros, so that a
+      // record cut short can be printed like any other
+      msg.assign(lens[0], 0);
+      packet.assign((lens[1] > 84)? lens[1] : 84, 0);
+      refpacket.assign((lens[2] > 84)? lens[2] : 84, 0);
+      if (! logfile.read(msg.data(), lens[0]) ||
+          ! logfile.read((char*)packet.data(), lens[1]) ||
+          ! logfile.read((char*)refpacket.data(), lens[2]))
+         break;
+      TAGMpacketlog::print_record(std::cout, time + offset,
+                                  std::string(msg.begin(), msg.end()),
+                                  (lens[1] > 0)? packet.data() : 0,
+                                  (lens[2] > 0)? refpacket.data() : 0);
+   }
+   if (! logfile.eof()) {
+      std::cerr << "decodeVbiaslog error: read error on " << filename
+                << std::endl;
+      return 3;
+   }
+   else if (truncated) {
+      std::cerr << "decodeVbiaslog warning: " << filename
+                << " ends in the middle of a record" << std::endl;
+   }
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   std::vector<const char*> filenames;
+   for (int iarg = 1; iarg < argc; ++iarg) {
+      if (argv[iarg][0] == '-')
+         usage();
+      filenames.push_back(argv[iarg]);
+   }
+   if (filenames.size() == 0)
+      filenames.push_back(PACKETLOG_FILE);
+
+   int status = 0;
+   for (unsigned int i=0; i < filenames.size(); ++i) {
+      int ret = decode(filenames[i]);
+      if (ret != 0)
+         status = ret;
+   }
+   exit(status);
+}
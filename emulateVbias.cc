@@ -0,0 +1,158 @@
+//
+// emulateVbias - command-line tool to serve a crate of emulated SiPM bias
+//                control cards on a network device, for testing and
+//                benchmarking the Vbias utilities without the frontend.
+//                Typically run on one end of a veth pair or on a tap
+//                device, with the utilities pointed at the other end.
+//
+// version: october 17, 2026
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <map>
+
+#include "TAGMemulator.h"
+#include "TAGMtransport.h"
+
+volatile sig_atomic_t stop_requested = 0;
+
+void usage()
+{
+   std::cerr << "Usage: emulateVbias [-n <count>] [-g <0xHH>] [-l <us>]"
+             << " [-j <us>] [-p <loss>] [-c <corrupt>] [-s <seed>] <netdev>"
+             << std::endl
+             << " where <netdev> is the network device (eg. veth1)"
+             << std::endl
+             << " on which the emulated Vbias cards are served."
+             << std::endl
+             << "Options:" << std::endl
+             << " -n <count>: number of cards, default 18" << std::endl
+             << " -g <0xHH>: geoaddr of the first card, default 0x8e"
+             << std::endl
+             << " -l <us>: mean response latency, default 0" << std::endl
+             << " -j <us>: rms jitter of the response latency, default 0"
+             << std::endl
+             << " -p <loss>: probability that a response is lost,"
+             << " default 0" << std::endl
+             << " -c <corrupt>: probability that a response has a bit"
+             << " flipped, default 0" << std::endl
+             << " -s <seed>: random number seed, default 1" << std::endl
+             << "The env variable TAGM_TRANSPORT selects how <netdev>"
+             << " is accessed," << std::endl
+             << " pcap (default) or afpacket, both need root access."
+             << std::endl;
+   exit(1);
+}
+
+void request_stop(int)
+{
+   stop_requested = 1;
+}
+
+int main(int argc, char *argv[])
+{
+   static const char *option_keys[][2] = {
+      {"-n", "boards"}, {"-g", "geoaddr"}, {"-l", "latency"},
+      {"-j", "jitter"}, {"-p", "loss"}, {"-c", "corrupt"}, {"-s", "seed"}
+   };
+   std::string options;
+   int iarg;
+   for (iarg = 1; iarg < argc && argv[iarg][0] == '-'; ++iarg) {
+      int opt;
+      for (opt = 0; opt < 7; ++opt) {
+         if (strcmp(argv[iarg], option_keys[opt][0]) == 0)
+            break;
+      }
+      if (opt == 7 || iarg + 1 == argc)
+         usage();
+      options += std::string(option_keys[opt][1]) + "=" + argv[++iarg] + ",";
+   }
+   if (iarg != argc - 1)
+      usage();
+   std::string netdev(argv[iarg]);
+   std::string transport(getenv("TAGM_TRANSPORT")?
+                         getenv("TAGM_TRANSPORT") : "pcap");
+   if (transport == "loopback")
+      usage();
+
+   TAGMemulator crate;
+   TAGMtransport *port;
+   try {
+      crate.configure(options);
+      // the emulated cards listen for the requests, not the responses
+      port = TAGMtransport::open(transport, netdev, "PQR");
+   }
+   catch (const std::runtime_error &err) {
+      std::cerr << err.what() << std::endl;
+      exit(5);
+   }
+   signal(SIGINT, request_stop);
+   signal(SIGTERM, request_stop);
+   std::cout << "emulating " << crate.get_board_count()
+             << " Vbias cards on " << netdev
+             << ", interrupt to stop" << std::endl;
+
+   // Responses wait in the pending queue until they fall due, and
+   // the wait for the next request is cut short to send them on time.
+
+   std::multimap<double, std::vector<unsigned char> > pending;
+   std::vector<TAGMemulator::response> responses;
+   std::vector<const unsigned char*> frames;
+   std::vector<int> lens;
+   while (! stop_requested) {
+      double now = TAGMtransport::monotonic_clock();
+      double deadline = now + 0.1;
+      if (pending.size() > 0 && pending.begin()->first < deadline)
+         deadline = pending.begin()->first;
+      const unsigned char *request;
+      int len;
+      int resp = port->receive(&request, &len, deadline);
+      if (resp < 0) {
+         std::cerr << "emulateVbias error: receive failed on " << netdev
+                   << ": " << port->geterr() << std::endl;
+         break;
+      }
+      now = TAGMtransport::monotonic_clock();
+      if (resp > 0) {
+         responses.clear();
+         crate.respond(request, len, responses);
+         for (unsigned int i=0; i < responses.size(); ++i) {
+            const unsigned char *packet = responses[i].packet;
+            pending.insert(std::make_pair(now + responses[i].delay,
+                           std::vector<unsigned char>(packet, packet +
+                                                      responses[i].len)));
+         }
+      }
+
+      std::multimap<double, std::vector<unsigned char> >::iterator due;
+      frames.clear();
+      lens.clear();
+      for (due = pending.begin(); due != pending.end(); ++due) {
+         if (due->first > now)
+            break;
+         frames.push_back(&due->second[0]);
+         lens.push_back(due->second.size());
+      }
+      if (frames.size() > 0) {
+         if (port->send(&frames[0], &lens[0], frames.size()) != 0) {
+            std::cerr << "emulateVbias error: send failed on " << netdev
+                      << ": " << port->geterr() << std::endl;
+            break;
+         }
+         pending.erase(pending.begin(), due);
+      }
+   }
+
+   std::cout << crate.get_request_count() << " requests, "
+             << crate.get_response_count() << " responses sent, "
+             << crate.get_lost_count() << " lost, "
+             << crate.get_corrupt_count() << " corrupted"
+             << std::endl;
+   delete port;
+   exit(0);
+}
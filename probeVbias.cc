@@ -1,31 +1,103 @@
 //
 // probeVbias - command-line tool to probe for all SiPM bias control cards
-//              that are present and powered on.
+//              that are present and powered on, or to print a table
+//              of the status readings from all of them at once.
 //
 // author: richard.t.jones at uconn.edu
 // version: july 17, 2014
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <iostream>
 #include <stdexcept>
 
 #include <TAGMcontroller.h>
 #include <TAGMcommunicator.h>
 
+#define FRONTEND_BOARD_COUNT 18  // boards 0x8e..0x9f of the full frontend
+
 void usage()
 {
    std::cerr << "Usage: probeVbias -l [remote_host[:port]::][netdev]"
+             << std::endl
+             << "   or: probeVbias -s [-n <count>] [netdev]"
              << std::endl
              << " where netdev is the name of an ethernet port, eg. eth0"
              << std::endl
              << " which may optionally be located on remote_host, served"
              << std::endl
              << " by a TAGMremotectrl daemon listening on port."
-             << std::endl;
+             << std::endl
+             << " With -s, the status of every board is read back with"
+             << std::endl
+             << " a single broadcast query, which returns as soon as"
+             << std::endl
+             << " <count> boards have answered (default "
+             << FRONTEND_BOARD_COUNT << ")." << std::endl;
    exit(1);
 }
 
+int snapshot(int argc, char *argv[])
+{
+   int expected_count = FRONTEND_BOARD_COUNT;
+   char *netdev = 0;
+   int iarg = 2;
+   if (iarg + 1 < argc && strcmp(argv[iarg], "-n") == 0) {
+      if (sscanf(argv[iarg + 1], "%d", &expected_count) != 1)
+         usage();
+      iarg += 2;
+   }
+   if (iarg < argc)
+      netdev = argv[iarg++];
+   if (iarg < argc)
+      usage();
+   else if (netdev && strchr(netdev, ':'))
+      usage();
+
+   std::map<unsigned char, TAGMcontroller::StatusSnapshot> snapshots;
+   try {
+      snapshots = TAGMcontroller::snapshot_all(netdev, expected_count);
+   }
+   catch (const std::runtime_error &err) {
+      std::cerr << err.what() << std::endl;
+      exit(5);
+   }
+
+   if (snapshots.size() == 0) {
+      std::cout << "No boards responding" << std::endl;
+      exit(0);
+   }
+
+   std::cout << std::endl
+             << "board  +5V(V)  -5V(V) +3.3V(V) +1.2V(V) gainmode"
+             << "  health(V)  Tchip(C)   TDAC(C) Tpre1(C) Tpre2(C)"
+             << std::endl
+             << "----------------------------------------------"
+             << "-----------------------------------------------------"
+             << std::endl;
+   std::map<unsigned char, TAGMcontroller::StatusSnapshot>::iterator iter;
+   for (iter = snapshots.begin(); iter != snapshots.end(); ++iter) {
+      TAGMcontroller::StatusSnapshot &status = iter->second;
+      char line[200];
+      sprintf(line, "  %2.2x %7.3f %7.3f %8.3f %8.3f %8s %10.3f"
+                    " %9.2f %9.2f %8.2f %8.2f",
+              (unsigned int)iter->first,
+              status.get_pos5Vpower(), status.get_neg5Vpower(),
+              status.get_pos3_3Vpower(), status.get_pos1_2Vpower(),
+              (status.get_gainmode() == 0)? "low" :
+              (status.get_gainmode() == 1)? "high" : "undef",
+              status.get_VDAChealth(), status.get_Tchip(),
+              status.get_TDAC(), status.get_Tpreamp_1(),
+              status.get_Tpreamp_2());
+      std::cout << line << std::endl;
+   }
+   if ((int)snapshots.size() < expected_count)
+      std::cout << "only " << snapshots.size() << " of " << expected_count
+                << " expected boards responded" << std::endl;
+   exit(0);
+}
+
 int main(int argc, char *argv[])
 {
    std::string server;
@@ -33,6 +105,9 @@ int main(int argc, char *argv[])
    if (argc < 2) {
       usage();
    }
+   else if (strcmp(argv[1], "-s") == 0) {
+      return snapshot(argc, argv);
+   }
    else if (strcmp(argv[1], "-l") != 0) {
       usage();
    }
@@ -46,8 +46,9 @@ int main(int argc, char *argv[])
       usage();
    }
    const char *netdev = 0;
+   std::string arg1dev;
    if (delim != arg1.npos) {
-      std::string arg1dev = arg1.substr(delim + 1);
+      arg1dev = arg1.substr(delim + 1);
       if (arg1dev.find(":") == arg1dev.npos) {
          if (arg1dev.size() > 0)
             netdev = arg1dev.c_str();
@@ -58,6 +59,7 @@ int main(int argc, char *argv[])
    }
 
    TAGMcontroller *ctrl;
+   TAGMcontroller::StatusSnapshot status;
    try {
       if (server.size() == 0) {
          ctrl = new TAGMcontroller((unsigned char)geoaddr, netdev);
@@ -65,8 +67,8 @@ int main(int argc, char *argv[])
       else {
          ctrl = new TAGMcommunicator((unsigned char)geoaddr, server);
       }
-      ctrl->latch_status();
-      ctrl->latch_voltages();
+      ctrl->latch_readings();
+      status = ctrl->get_status();
    }
    catch (const std::runtime_error &err) {
       std::cerr << err.what() << std::endl;
@@ -77,38 +79,38 @@ int main(int argc, char *argv[])
              << "Readings received from Vbias board " 
              << std::hex << (unsigned int)ctrl->get_Geoaddr() << ":"
              << std::endl
-             << "    +5V power = " << ctrl->get_pos5Vpower()
+             << "    +5V power = " << status.get_pos5Vpower()
              << " V" << std::endl
-             << "    -5V power = " << ctrl->get_neg5Vpower()
+             << "    -5V power = " << status.get_neg5Vpower()
              << " V" << std::endl
-             << "    +3.3V power = " << ctrl->get_pos3_3Vpower()
+             << "    +3.3V power = " << status.get_pos3_3Vpower()
              << " V" << std::endl
-             << "    +1.2V power = " << ctrl->get_pos1_2Vpower()
+             << "    +1.2V power = " << status.get_pos1_2Vpower()
              << " V" << std::endl
-             << "    gainmode = " << ctrl->get_Vgainmode()
-             << " V " << ((ctrl->get_gainmode() == 0)? "(low)" :
-                          (ctrl->get_gainmode() == 1)? "(high)" :
+             << "    gainmode = " << status.get_Vgainmode()
+             << " V " << ((status.get_gainmode() == 0)? "(low)" :
+                          (status.get_gainmode() == 1)? "(high)" :
                           "(undefined)")
              << std::endl
-             << "    preamp 1 sumref = " << ctrl->get_Vsumref_1()
+             << "    preamp 1 sumref = " << status.get_Vsumref_1()
              << " V" << std::endl
-             << "    preamp 2 sumref = " << ctrl->get_Vsumref_2()
+             << "    preamp 2 sumref = " << status.get_Vsumref_2()
              << " V" << std::endl
-             << "    DAC health level = " << ctrl->get_VDAChealth()
+             << "    DAC health level = " << status.get_VDAChealth()
              << " V" << std::endl
-             << "    chip temperature = " << ctrl->get_Tchip()
+             << "    chip temperature = " << status.get_Tchip()
              << " C" << std::endl
-             << "    DAC temperature = " << ctrl->get_TDAC()
+             << "    DAC temperature = " << status.get_TDAC()
              << " C" << std::endl
-             << "    preamp 1 temperature = " << ctrl->get_Tpreamp_1()
+             << "    preamp 1 temperature = " << status.get_Tpreamp_1()
              << " C" << std::endl
-             << "    preamp 2 temperature = " << ctrl->get_Tpreamp_2()
+             << "    preamp 2 temperature = " << status.get_Tpreamp_2()
              << " C" << std::endl
              << "    channel voltages are (V):";
    for (int chan=0; chan < 32; ) {
       std::cout << std::endl << "    ";
       for (int c=0; c < 5 && chan < 32; ++c, ++chan) {
-         char str[10];
+         char str[20];
          sprintf(str, "%4d:%7.3f", chan, ctrl->getV(chan));
          std::cout << str;
       }
@@ -53,8 +53,9 @@ int main(int argc, char *argv[])
    }
    std::string server;
    const char *netdev = 0;
+   std::string arg1dev;
    if (delim != arg1.npos) {
-      std::string arg1dev = arg1.substr(delim + 1);
+      arg1dev = arg1.substr(delim + 1);
       if (arg1dev.find(":") == arg1dev.npos) {
          if (arg1dev.size() > 0)
             netdev = arg1dev.c_str();
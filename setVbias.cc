@@ -92,6 +92,8 @@
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <set>
+#include <vector>
 #include <stdexcept>
 #include <stdlib.h>
 #include <stdint.h>
@@ -101,6 +103,7 @@
 #include <math.h>
 #include <TAGMcontroller.h>
 #include <TAGMcommunicator.h>
+#include <TAGMfrontend.h>
 
 // Enable the following line to generate a hex dump of the last
 // D packet and S packet received from each board before exit.
@@ -112,6 +115,19 @@ int dryrun = 0;
 
 std::map<int,std::map<int,double> > Vsetpoint;
 
+// levels to be set on each board, collected here and handed over to all
+// of the boards at once so that a remote server gets them in one message
+std::map<unsigned char, TAGMcommunicator::setpoints> Vstaged;
+
+void stageV(unsigned char geoaddr, int chan, double V)
+{
+   if (chan < 0 || chan > 31)
+      return;
+   TAGMcommunicator::setpoints &levels = Vstaged[geoaddr];  // starts out zeroed
+   levels.V[chan] = V;
+   levels.mask |= (1 << chan);
+}
+
 #if UPDATE_STATUS_IN_EPICS
 #include <cadef.h> /* Structures and data types used by epics CA */
 int epics_status;
@@ -125,14 +141,6 @@ int epics_stop_communication();
 int verbose_epics_messages = 0;
 #endif
 
-struct fiber_config_info {
-   int geoaddr;
-   int chan;
-   double thresh_V;
-   double pixelcap_pF;
-   double meanyield_pix;
-};
-
 void version()
 {
    std::cout << "setVbias version 2.0" << std::endl;
@@ -260,6 +268,7 @@ int columns = 0;
 unsigned char rowselect[MAX_ROWS + 1] = {0};
 unsigned char colselect[MAX_COLUMNS + 1] = {0};
 std::map<unsigned char, TAGMcontroller*> boards;
+TAGMfrontend *frontend = 0;
 
 void dump_last_packet(const unsigned char *packet);
 int decode_sequence(const char *seq, unsigned char *arr, int max);
@@ -440,22 +449,37 @@ int main(int argc, char *argv[])
 #endif
 
    if (!dryrun) {
-      // send commands to frontend
+      // send commands to frontend, ramping all boards together,
+      // by broadcast where they all pass through the same levels
+      std::map<unsigned char, TAGMcontroller*> &targets =
+                           (frontend)? frontend->get_boards() : boards;
+      unsigned char failed_geoaddr = 0;
+      std::string errmsg;
+      if (! TAGMcommunicator::setV_many_all(targets, Vstaged,
+                                            &failed_geoaddr, &errmsg))
+      {
+         std::cerr << errmsg << std::endl
+                   << "Error staging voltages for board at "
+                   << std::hex << (unsigned int)failed_geoaddr << std::endl;
+         exit(4);
+      }
+      if (! TAGMcontroller::ramp_all_broadcast(targets, &failed_geoaddr)) {
+         std::cerr << "Error returned by ramp() method for board at "
+                   << std::hex << (unsigned int)failed_geoaddr << std::endl;
+         exit(4);
+      }
       std::map<unsigned char, TAGMcontroller*>::iterator iter;
-      for (iter = boards.begin(); iter != boards.end(); ++iter) {
-         if (! iter->second->ramp()) {
-            std::cerr << "Error returned by ramp() method for board at "
-                      << std::hex << (unsigned int)iter->first << std::endl;
-            exit(4);
-         }
 #if DUMP_LAST_PACKETS
+      for (iter = targets.begin(); iter != targets.end(); ++iter) {
          iter->second->latch_voltages();
          dump_last_packet(iter->second->get_last_packet());
          iter->second->latch_status();
          dump_last_packet(iter->second->get_last_packet());
+      }
 #endif
+      delete frontend;
+      for (iter = boards.begin(); iter != boards.end(); ++iter)
          delete iter->second;
-      }
    }
 
 #if UPDATE_STATUS_IN_EPICS
@@ -560,7 +584,7 @@ void load_from_textfile()
             }
          }
          if (!dryrun) {
-            boards[geoaddr]->setV(chan, voltage);
+            stageV(geoaddr, chan, voltage);
          }
          else {
             std::cout << "setting channel " 
@@ -581,84 +605,85 @@ void load_from_config()
    // uses them to compute the set values for the set of output channels
    // selected on the command line by row and column indices.
 
-   std::ifstream fin(configfile);
-   if (!fin.good()) {
-      std::cerr << "Error opening config file " << configfile << std::endl;
+   try {
+      frontend = new TAGMfrontend(configfile);
+   }
+   catch (const std::runtime_error &err) {
+      std::cerr << err.what() << std::endl;
       exit(4);
    }
 
-   std::map<int,std::map<int,fiber_config_info> > finfo;
-
-   while (fin.good()) {
-      char line[999];
-      fin.getline(line, 99);
-      if (line[0] != ' ')
-         continue;
-      unsigned char geoaddr;
-      unsigned int chan;
-      unsigned int row, col;
-      double thresh_V;
-      double pixelcap_pF;
-      double meanyield_pix;
-      if (sscanf(line, " %x %d %d %d %lf %lf %lf", &geoaddr, &chan,
-                 &col, &row, &thresh_V, &pixelcap_pF, &meanyield_pix) == 7)
-      {
-         finfo[col][row].geoaddr = geoaddr;
-         finfo[col][row].chan = chan;
-         finfo[col][row].thresh_V = thresh_V;
-         finfo[col][row].pixelcap_pF = pixelcap_pF;
-         finfo[col][row].meanyield_pix = meanyield_pix;
+   // attach only the boards that read out the selected fibers
+   std::vector<int> selcolumns;
+   std::vector<int> selrows;
+   for (int col=1; col <= MAX_COLUMNS; ++col) {
+      if (colselect[col])
+         selcolumns.push_back(col);
+   }
+   for (int row=1; row <= MAX_ROWS; ++row) {
+      if (rowselect[row])
+         selrows.push_back(row);
+   }
+   if (netdev == "dummy") {
+      dryrun = 1;
+   }
+   else {
+      try {
+         if (server.size() > 0)
+            frontend->attach_remote_boards(server, selcolumns, selrows);
+         else
+            frontend->attach_boards(netdev.c_str(), selcolumns, selrows);
+      }
+      catch (const std::runtime_error &err) {
+         std::cerr << err.what() << std::endl;
+         exit(5);
+      }
+   }
 
-         if (rowselect[row] == 0 || colselect[col] == 0)
+   std::set<unsigned char> seen;
+   for (unsigned int c=0; c < selcolumns.size(); ++c) {
+      for (unsigned int r=0; r < selrows.size(); ++r) {
+         int col = selcolumns[c];
+         int row = selrows[r];
+         const TAGMfrontend::fiber &info = frontend->get_fiber(col, row);
+         unsigned char geoaddr = info.geoaddr;
+         unsigned int chan = info.chan;
+         if (geoaddr == 0)
             continue;
 
-         if (boards.find(geoaddr) == boards.end()) {
-            try {
-               if (server.size() > 0) {
-                  boards[geoaddr] = new TAGMcommunicator(geoaddr, server);
-               }
-               else if (netdev == "dummy") {
-                  boards[geoaddr] = 0;
-                  dryrun = 1;
-               }
-               else {
-                  boards[geoaddr] = new TAGMcontroller(geoaddr, netdev.c_str());
-               }
-               if (!dryrun) {
-                  boards[geoaddr]->setV(31, health_V);
-                  boards[geoaddr]->setV(30, (gainmode < 2)? 5.0 : 10.);
-               }
-               else {
-                  std::cout << "setting channel " 
-                            << std::hex << (unsigned int)geoaddr 
-                            << ":" << std::dec << 30
-                            << " to " << ((gainmode < 2)? 5.0 : 10.) << "V"
-                            << std::endl;
-                  std::cout << "setting channel " 
-                            << std::hex << (unsigned int)geoaddr
-                            << ":" << std::dec << 31
-                            << " to " << health_V << "V"
-                            << std::endl;
-               }
+         if (seen.find(geoaddr) == seen.end()) {
+            seen.insert(geoaddr);
+            if (!dryrun) {
+               stageV(geoaddr, 31, health_V);
+               stageV(geoaddr, 30, (gainmode < 2)? 5.0 : 10.);
             }
-            catch (const std::runtime_error &err) {
-               std::cerr << err.what() << std::endl;
-               exit(5);
+            else {
+               std::cout << "setting channel " 
+                         << std::hex << (unsigned int)geoaddr 
+                         << ":" << std::dec << 30
+                         << " to " << ((gainmode < 2)? 5.0 : 10.) << "V"
+                         << std::endl;
+               std::cout << "setting channel " 
+                         << std::hex << (unsigned int)geoaddr
+                         << ":" << std::dec << 31
+                         << " to " << health_V << "V"
+                         << std::endl;
             }
          }
+
          if (level_V < 0) {
             if (peak_pC > 0) {
                double Vp=0;
-               if (meanyield_pix > 0)
-                  Vp = sqrt(peak_pC / (pixelcap_pF * meanyield_pix));
+               if (info.meanyield_pix > 0)
+                  Vp = sqrt(peak_pC / (info.pixelcap_pF * info.meanyield_pix));
                if (Vp > MAX_VBIAS_OVER_THRESHOLD)
                   Vp = MAX_VBIAS_OVER_THRESHOLD;
                else if (Vp < MIN_VBIAS_OVER_THRESHOLD)
                   Vp = MIN_VBIAS_OVER_THRESHOLD;
-               Vp += thresh_V;
+               Vp += info.thresh_V;
                Vsetpoint[col][row] = Vp;
                if (!dryrun) {
-                  boards[geoaddr]->setV(chan, Vp);
+                  stageV(geoaddr, chan, Vp);
                }
                else {
                   std::cout << "setting channel " 
@@ -670,15 +695,15 @@ void load_from_config()
                }
             }
             else {
-               double Vg = gain_pC / pixelcap_pF;
+               double Vg = gain_pC / info.pixelcap_pF;
                if (Vg > MAX_VBIAS_OVER_THRESHOLD)
                   Vg = MAX_VBIAS_OVER_THRESHOLD;
                else if (Vg < MIN_VBIAS_OVER_THRESHOLD)
                   Vg = MIN_VBIAS_OVER_THRESHOLD;
-               Vg += thresh_V;
+               Vg += info.thresh_V;
                Vsetpoint[col][row] = Vg;
                if (!dryrun) {
-                  boards[geoaddr]->setV(chan, Vg);
+                  stageV(geoaddr, chan, Vg);
                }
                else {
                   std::cout << "setting channel " 
@@ -693,7 +718,7 @@ void load_from_config()
          else {
             Vsetpoint[col][row] = level_V;
             if (!dryrun) {
-               boards[geoaddr]->setV(chan, level_V);
+               stageV(geoaddr, chan, level_V);
             }
             else {
                std::cout << "setting channel " 
@@ -706,7 +731,6 @@ void load_from_config()
          }
       }
    }
-   fin.close();
 
    // Apply column locking, if requested
    if (lock_columns) {
@@ -716,11 +740,11 @@ void load_from_config()
          int nrows=0;
          double qmin_pC=1.e99;
          for (int row=1; row <= MAX_ROWS; ++row) {
-            if (rowselect[row] == 0)
+            const TAGMfrontend::fiber &info = frontend->get_fiber(col, row);
+            if (rowselect[row] == 0 || info.geoaddr == 0)
                continue;
-            double dV = Vsetpoint[col][row] - finfo[col][row].thresh_V;
-            double q_pC = finfo[col][row].meanyield_pix *
-                          finfo[col][row].pixelcap_pF * dV * dV;
+            double dV = Vsetpoint[col][row] - info.thresh_V;
+            double q_pC = info.meanyield_pix * info.pixelcap_pF * dV * dV;
             if (q_pC > 0 && q_pC < qmin_pC) {
                qmin_pC = q_pC;
                ++nrows;
@@ -729,26 +753,25 @@ void load_from_config()
          if (nrows == 0)
             continue;
          for (int row=1; row <= MAX_ROWS; ++row) {
-            if (rowselect[row] == 0)
+            const TAGMfrontend::fiber &info = frontend->get_fiber(col, row);
+            if (rowselect[row] == 0 || info.geoaddr == 0)
                continue;
             double V=0;
-            if (finfo[col][row].meanyield_pix > 0)
-               V = sqrt(qmin_pC / (finfo[col][row].pixelcap_pF *
-                                   finfo[col][row].meanyield_pix));
+            if (info.meanyield_pix > 0)
+               V = sqrt(qmin_pC / (info.pixelcap_pF * info.meanyield_pix));
             if (V > MAX_VBIAS_OVER_THRESHOLD)
                V = MAX_VBIAS_OVER_THRESHOLD;
             else if (V < MIN_VBIAS_OVER_THRESHOLD)
                V = MIN_VBIAS_OVER_THRESHOLD;
-            V += finfo[col][row].thresh_V;
+            V += info.thresh_V;
             Vsetpoint[col][row] = V;
-            int geoaddr = finfo[col][row].geoaddr;
-            int chan = finfo[col][row].chan;
+            int geoaddr = info.geoaddr;
+            int chan = info.chan;
             if (!dryrun) {
-               boards[geoaddr]->setV(chan, V);
+               stageV(geoaddr, chan, V);
             }
             else {
-               double geff = (V - finfo[col][row].thresh_V) * 
-                                  finfo[col][row].pixelcap_pF;
+               double geff = (V - info.thresh_V) * info.pixelcap_pF;
                std::cout << "overwriting channel " 
                          << std::hex << (unsigned int)geoaddr 
                          << ":" << std::dec << chan
@@ -766,13 +789,15 @@ void load_from_config()
          std::cout << "expected pulse parameters in column " << col << ":"
                    << std::endl;
          for (int row=1; row <= MAX_ROWS; ++row) {
-            if (colselect[col] == 0 || rowselect[row] == 0)
+            const TAGMfrontend::fiber &info = frontend->get_fiber(col, row);
+            if (colselect[col] == 0 || rowselect[row] == 0 ||
+                info.geoaddr == 0)
+            {
                continue;
-            int geoaddr = finfo[col][row].geoaddr;
-            int chan = finfo[col][row].chan;
-            double thresh_V = finfo[col][row].thresh_V;
-            double pixelcap_pF = finfo[col][row].pixelcap_pF;
-            double meanyield_pix = finfo[col][row].meanyield_pix;
+            }
+            double thresh_V = info.thresh_V;
+            double pixelcap_pF = info.pixelcap_pF;
+            double meanyield_pix = info.meanyield_pix;
             double V = Vsetpoint[col][row];
             double dV = V - thresh_V;
             double q = meanyield_pix * pixelcap_pF * pow(dV, 2);